@@ -0,0 +1,278 @@
+# -*- coding: utf-8 -*-
+from __future__ import print_function
+
+"""
+This module contains the checkpoint of a minimization/relaxation.
+
+The checkpoint stores the state of the minimization (dynamical matrix, structure,
+line minimization, history of the free energy and gradients) and of the relaxation
+(population, cell optimizer), together with a reference to the ensemble saved on the disk.
+The ensemble itself is not copied: it is reloaded from data_dir when the calculation is restarted.
+"""
+import sys, os
+import json
+import time
+import threading
+import numpy as np
+
+import sscha.Parallel as Parallel
+from sscha.Parallel import pprint as print
+
+
+__CHECKPOINT_VERSION__ = 1
+
+# The minimization history saved in the checkpoint
+__HISTORY__ = ["__fe__", "__fe_err__", "__gc__", "__gc_err__", "__gw__", "__gw_err__", "__KL__", "__good_kasteps__"]
+
+
+class Checkpoint(object):
+
+    def __init__(self, filename, asynchronous = True):
+        """
+        CHECKPOINT
+        ==========
+
+        The checkpoint is a single numpy .npz file, containing the arrays of the state
+        and a json header (version, population, reference to the ensemble, scalar parameters).
+
+        The file is written atomically: the data is saved in a temporary file
+        in the same directory, and then renamed over the old checkpoint,
+        so an interruption never leaves a corrupted checkpoint.
+        Only the master process writes.
+
+        Parameters
+        ----------
+            filename : string
+                The path to the checkpoint file.
+            asynchronous : bool
+                If True (default) the file is written by a background thread,
+                so the minimization is not slowed down by the I/O.
+                The state is copied before returning from save, so it is safe to continue the minimization.
+        """
+
+        self.filename = filename
+        self.asynchronous = asynchronous
+
+        # The state of the relaxation (population, ensemble reference, cell optimizer)
+        self.population = 0
+        self.ensemble_reference = None
+        self.relax_state = {}
+        self.cell_optimizer = None
+
+        self.__thread__ = None
+
+
+    def set_relax_state(self, population, ensemble_reference = None, cell_optimizer = None, **kwargs):
+        """
+        Setup the state of the relaxation saved with the minimizer.
+
+        Parameters
+        ----------
+            population : int
+                The id of the population
+            ensemble_reference : dict
+                Where the ensemble of the population is saved:
+                path, population and store (True if saved in an EnsembleStore, False for save_bin).
+                If None, a new population must be generated at the restart.
+            cell_optimizer : Optimizer.UC_OPTIMIZER
+                The cell optimizer of the variable cell relaxation (if any).
+            **kwargs :
+                Any other json serializable info on the relaxation.
+        """
+        self.population = population
+        self.ensemble_reference = ensemble_reference
+        self.cell_optimizer = cell_optimizer
+        self.relax_state = kwargs
+
+
+    def save(self, minim, save_line_minimization = True):
+        """
+        SAVE THE CHECKPOINT
+        ===================
+
+        Save the current state of the minimizer (and of the relaxation).
+
+        Parameters
+        ----------
+            minim : SchaMinimizer.SSCHA_Minimizer
+                The minimizer.
+            save_line_minimization : bool
+                If True, the state of the line minimization is saved.
+                Set it to False outside the minimization of a population,
+                as the line minimization starts again with a new ensemble.
+        """
+
+        if not Parallel.am_i_the_master():
+            return
+
+        header = {"version" : __CHECKPOINT_VERSION__,
+                  "timestamp" : time.time(),
+                  "population" : int(self.population),
+                  "ensemble" : self.ensemble_reference,
+                  "relax" : self.relax_state,
+                  "nqirr" : int(minim.dyn.nqirr),
+                  "minimizer" : {},
+                  "cell_optimizer" : {}}
+
+        arrays = {"dynmats" : np.array(minim.dyn.dynmats, dtype = np.complex128),
+                  "coords" : np.array(minim.dyn.structure.coords, dtype = np.float64),
+                  "unit_cell" : np.array(minim.dyn.structure.unit_cell, dtype = np.float64)}
+
+        for name in __HISTORY__:
+            arrays[name] = np.real(np.array(getattr(minim, name)))
+
+        # The state of the line minimization
+        if save_line_minimization and minim.minimizer is not None and minim.minimizer.current_x is not None:
+            _split_state(minim.minimizer.get_state(), header["minimizer"], arrays, "minimizer_")
+
+        if self.cell_optimizer is not None:
+            _split_state(vars(self.cell_optimizer), header["cell_optimizer"], arrays, "cell_")
+
+        self.wait()
+        if self.asynchronous:
+            self.__thread__ = threading.Thread(target = _write_checkpoint, args = (self.filename, header, arrays))
+            self.__thread__.start()
+        else:
+            _write_checkpoint(self.filename, header, arrays)
+
+
+    def wait(self):
+        """
+        Wait until the last checkpoint has been written on the disk.
+        """
+        if self.__thread__ is not None:
+            self.__thread__.join()
+            self.__thread__ = None
+
+
+def load(filename):
+    """
+    LOAD THE CHECKPOINT
+    ===================
+
+    Parameters
+    ----------
+        filename : string
+            The path to the checkpoint
+
+    Results
+    -------
+        header : dict
+            The json header of the checkpoint.
+        arrays : dict
+            The arrays of the checkpoint.
+    """
+    with np.load(filename, allow_pickle = False) as data:
+        header = json.loads(str(data["header"]))
+        arrays = {name : data[name] for name in data.files if name != "header"}
+
+    if header["version"] > __CHECKPOINT_VERSION__:
+        ERR_MSG = """
+Error, the checkpoint '{}' has version {},
+       but this version of the code reads only up to version {}.
+""".format(filename, header["version"], __CHECKPOINT_VERSION__)
+        print(ERR_MSG)
+        raise IOError(ERR_MSG)
+
+    return header, arrays
+
+
+def restore_minimizer(minim, header, arrays):
+    """
+    Restore the dynamical matrix and the history of the minimizer from the checkpoint.
+    The state of the line minimization is restored at the next call of minim.run.
+
+    Parameters
+    ----------
+        minim : SchaMinimizer.SSCHA_Minimizer
+            The minimizer (with a dynamical matrix of the same system)
+        header, arrays :
+            The checkpoint (see load)
+    """
+
+    dyn = minim.dyn.Copy()
+    if len(dyn.q_tot) != len(arrays["dynmats"]) or dyn.structure.N_atoms != len(arrays["coords"]):
+        raise ValueError("Error, the checkpoint does not match the dynamical matrix of the minimizer.")
+
+    if np.max(np.abs(dyn.structure.unit_cell - arrays["unit_cell"])) > 1e-10:
+        dyn.AdjustToNewCell(arrays["unit_cell"])
+    dyn.structure.coords[:,:] = arrays["coords"]
+    for iq in range(len(dyn.q_tot)):
+        dyn.dynmats[iq] = arrays["dynmats"][iq].copy()
+    minim.dyn = dyn
+
+    for name in __HISTORY__:
+        if name == "__good_kasteps__":
+            setattr(minim, name, [int(x) for x in arrays[name]])
+        else:
+            setattr(minim, name, list(arrays[name]))
+
+    minim.population = header["population"]
+
+    minim.minimizer_restart_state = None
+    if header["minimizer"]:
+        minim.minimizer_restart_state = _join_state(header["minimizer"], arrays, "minimizer_")
+
+
+def restore_cell_optimizer(cell_optimizer, header, arrays):
+    """
+    Restore the state of the cell optimizer from the checkpoint
+    (the optimizer must be of the same kind).
+    """
+    state = _join_state(header["cell_optimizer"], arrays, "cell_")
+    for name in state:
+        setattr(cell_optimizer, name, state[name])
+
+
+def _split_state(state, header, arrays, prefix):
+    """
+    Split a state in the json serializable values (saved in header)
+    and the arrays (saved in arrays with the given prefix).
+    Lists of arrays are stacked.
+    """
+    for name, value in state.items():
+        if isinstance(value, np.ndarray):
+            arrays[prefix + name] = value.copy()
+        elif isinstance(value, list) and all([isinstance(x, np.ndarray) for x in value]):
+            arrays[prefix + name] = np.array(value)
+            header[name] = {"list_length" : len(value)}
+        elif isinstance(value, (np.integer, np.floating, np.bool_)):
+            header[name] = value.item()
+        elif value is None or isinstance(value, (int, float, bool, str)):
+            header[name] = value
+
+
+def _join_state(header, arrays, prefix):
+    """
+    The inverse of _split_state
+    """
+    state = {}
+    for name, value in header.items():
+        if isinstance(value, dict) and "list_length" in value:
+            state[name] = [x for x in arrays[prefix + name][:value["list_length"]]]
+        else:
+            state[name] = value
+
+    for key in arrays:
+        if key.startswith(prefix):
+            name = key[len(prefix):]
+            if not name in state:
+                state[name] = arrays[key].copy()
+    return state
+
+
+def _write_checkpoint(filename, header, arrays):
+    """
+    Write the checkpoint atomically.
+    """
+    dirname = os.path.dirname(os.path.abspath(filename))
+    if not os.path.exists(dirname):
+        os.makedirs(dirname)
+
+    tmp_filename = os.path.join(dirname, ".{}.tmp".format(os.path.basename(filename)))
+    with open(tmp_filename, "wb") as fp:
+        np.savez(fp, header = np.array(json.dumps(header)), **arrays)
+        fp.flush()
+        os.fsync(fp.fileno())
+
+    os.replace(tmp_filename, filename)
@@ -6,6 +6,8 @@ import threading
 import copy
 import time, datetime
 import tarfile
+import tempfile
+import queue
 
 __DIFFLIB__ = False
 try:
@@ -227,6 +229,29 @@ class Cluster(object):
         self.check_timeout = 300
         self.nonblocking_command = True # True if you use a different version of slurm that does not accept blocking commands
 
+        # If True, the status of all the submitted jobs is checked by a single thread (see JobPoller),
+        # with one query to the scheduler every check_timeout seconds,
+        # instead of one query for each job from each submission thread.
+        self.use_job_poller = False
+        # The command that lists the jobs in the queue (one job per line, the first column is the job id)
+        self.job_status_cmd = "squeue -u $USER"
+        self.job_poller = None
+
+        # If True, the outputs of each calculation are retrieved (compressed) and read
+        # as soon as the calculation ends, every check_timeout seconds, while the job is still running.
+        # The submission script marks each finished calculation with a LABEL.done file.
+        self.stream_results = False
+
+        # If True, all the ssh and scp commands of all the threads share a single
+        # persistent connection to the cluster (OpenSSH ControlMaster),
+        # opened by open_connection and kept alive for ssh_persist seconds after the last command
+        # (compute_ensemble_batch closes it at the end).
+        self.use_ssh_multiplexing = False
+        self.ssh_persist = 600
+        # The socket of the shared connection
+        # (if None, open_connection sets it in a private temporary directory)
+        self.ssh_control_path = None
+
         # Enforce ssh to open a shell for each command in the cluster
         self.use_active_shell = False
         # If the following is true, then use the active shell always
@@ -258,8 +283,8 @@ class Cluster(object):
         # two different calculations in the same working directory
         self.label = "ESP_"
 
-        # This is the maximum number of resubmissions after the expected one
-        # from the batch size. It can be use to resubmit the failed jobs.
+        # This is the maximum number of resubmissions of each configuration.
+        # It can be use to resubmit the failed jobs.
         self.max_recalc = 10
         self.connection_attempts = 1
 
@@ -371,7 +396,7 @@ class Cluster(object):
         if server_dest:
             dest_path = server_path + dest_path 
         
-        cmd = self.scpcmd + f" {source_path} {dest_path}"
+        cmd = self.scpcmd + self.get_ssh_options() + f" {source_path} {dest_path}"
         result = self.ExecuteCMD(cmd, raise_error = raise_error, **kwargs)
         return result
 
@@ -410,9 +435,10 @@ class Cluster(object):
         """
 
         if on_cluster:
-            cmd = self.sshcmd + " {} '{}'".format(self.hostname, cmd)
+            sshcmd = self.sshcmd + self.get_ssh_options()
+            cmd = self.get_cluster_command(cmd)
             if use_active_shell:
-                cmd = "{ssh} {host} -t '{shell} --login -c \"{command}\"'".format(ssh = self.sshcmd, 
+                cmd = "{ssh} {host} -t '{shell} --login -c \"{command}\"'".format(ssh = sshcmd, 
                          host = self.hostname, 
                          command = parse_symbols(cmd), 
                          shell = self.terminal)
@@ -463,6 +489,49 @@ class Cluster(object):
 
 
 
+    def get_cluster_command(self, cmd):
+        """
+        Get the local command that executes cmd on the cluster.
+        Its standard output can be piped into a local command.
+        """
+        return self.sshcmd + self.get_ssh_options() + " {} '{}'".format(self.hostname, cmd)
+
+    def get_ssh_options(self):
+        """
+        Get the options of ssh and scp to share the persistent connection
+        (empty if use_ssh_multiplexing is False, or if the socket is not set by open_connection).
+        The first command opens the connection, the following ones reuse it.
+        """
+        if not self.use_ssh_multiplexing or self.ssh_control_path is None:
+            return ""
+
+        return " -o ControlMaster=auto -o ControlPath={} -o ControlPersist={:d}".format(self.ssh_control_path, int(self.ssh_persist))
+
+    def open_connection(self):
+        """
+        Open the persistent connection with the cluster (if use_ssh_multiplexing).
+        Call it before starting the submission threads, so that they all share the same connection.
+        """
+        if not self.use_ssh_multiplexing:
+            return True
+
+        if self.ssh_control_path is None:
+            # The socket must be private, and its path short
+            control_dir = os.path.join(tempfile.gettempdir(), "sscha_ssh_{}".format(os.getuid()))
+            os.makedirs(control_dir, mode = 0o700, exist_ok = True)
+            self.ssh_control_path = os.path.join(control_dir, "%C")
+
+        return self.ExecuteCMD("true", False, on_cluster = True)
+
+    def close_connection(self):
+        """
+        Close the persistent connection with the cluster.
+        """
+        if not self.use_ssh_multiplexing or self.ssh_control_path is None:
+            return True
+        cmd = self.sshcmd + self.get_ssh_options() + " -O exit {}".format(self.hostname)
+        return self.ExecuteCMD(cmd, False)
+
     def set_timeout(self, timeout):
         """
         Set a timeout time for each single calculation.
@@ -589,6 +658,10 @@ class Cluster(object):
         for i, lbl in enumerate(labels):
             submission += self.get_execution_command(lbl)
 
+            # Mark the end of the calculation
+            if self.stream_results:
+                submission += "touch {}.done\n".format(lbl)
+
 
         submission += other_output
 
@@ -761,8 +834,8 @@ Error, for some reason I'm unable to generate the tar.
                     os.remove(os.path.join(self.local_workdir, fname))
 
 
-            # Clean eventually input/output file of this very same calculation
-            self.ExecuteCMD(rm_cmd, False, on_cluster = True)
+            # The input/output files of this very same calculation are cleaned
+            # when the files are unpacked (in the same command)
 #            cp_res = os.system(cmd + " > /dev/null")
 #            if cp_res != 0:
 #                print "Error while executing:", cmd
@@ -785,7 +858,7 @@ Error while connecting to the cluster to copy the files:
                 return cp_res
 
             # Unpack the input files and remove the archive
-            decompress = 'cd {}; tar xf {};'.format(self.workdir, tar_name)
+            decompress = rm_cmd + 'cd {}; tar xf {};'.format(self.workdir, tar_name)
             #cmd = self.sshcmd + " %s '%s'" % (self.hostname, decompress)
             #cp_res = self.ExecuteCMD(cmd, False)
             cp_res = self.ExecuteCMD(decompress, False, on_cluster = True)
@@ -910,7 +983,7 @@ Error while connecting to the cluster to copy the files:
 
     def batch_submission(self, list_of_structures, calc, indices,
                          in_extension, out_extension,
-                         label = "ESP", n_togheder=1):
+                         label = "ESP", n_togheder=1, on_output = None):
         """
         BATCH SUBMISSION
         ================
@@ -942,11 +1015,20 @@ Error while connecting to the cluster to copy the files:
                 If present, the job will lunch a new job immediately after the other
                 is ended. This is usefull to further reduce the number of submitted
                 jobs.
+            on_output : function, optional
+                If stream_results is True, the outputs of the finished calculations are retrieved
+                while the job is running, and on_output is called with the list of their positions
+                (in list_of_structures).
 
         Results
         -------
-            list_of_results.
-                Returns a list of results dicts, one for each structure.
+            submitted : list
+                The positions of the calculations whose outputs have been retrieved
+                at the end of the job (not passed to on_output).
+            indices : list(int)
+                The indices of the configurations
+            label : string
+                The root of the labels
         """
         N_structs  = len(list_of_structures)
 
@@ -973,6 +1055,20 @@ Error while connecting to the cluster to copy the files:
         # Create the input files
         input_files, output_files =  self.prepare_input_file(list_of_structures, calc, submission_labels)
 
+        # The outputs of each calculation, and the positions of those already retrieved
+        streaming = self.stream_results and on_output is not None
+        label_outputs = [[x for x in output_files if x.startswith(lbl + ".")] for lbl in submission_labels]
+        streamed = []
+        def stream():
+            new_outputs = self.stream_outputs(submission_labels, label_outputs, streamed)
+            if len(new_outputs):
+                on_output(new_outputs)
+
+        # The markers of the previous calculations are removed with the old outputs
+        old_files = list(output_files)
+        if self.stream_results:
+            old_files += ["{}.done".format(lbl) for lbl in submission_labels]
+
         # Create the submission script
         submission = self.create_submission_script(submission_labels)
 
@@ -984,7 +1080,7 @@ Error while connecting to the cluster to copy the files:
         f.close()
         input_files.append(sub_name)
 
-        if not self.copy_files(input_files, output_files, to_server = True):
+        if not self.copy_files(input_files, old_files, to_server = True):
             # Submission failed
             return submitted, indices, label
 
@@ -999,13 +1095,31 @@ Error while connecting to the cluster to copy the files:
             now = datetime.datetime.now()
             sys.stderr.write("{}/{}/{} - {}:{}:{} | submitted job id {} ({})\n".format(now.year, now.month, now.day, now.hour, now.minute, now.second, job_id, submission_output))
             sys.stderr.flush()
-            time.sleep(self.check_timeout)
-
-            while not self.check_job_finished(job_id):
+            if self.use_job_poller:
+                # Wait until the poller finds the job out of the queue
+                if job_id is not None:
+                    poller = self.get_job_poller()
+                    if streaming:
+                        while not poller.wait(job_id, self.check_timeout):
+                            stream()
+                    else:
+                        poller.wait(job_id)
+            else:
                 time.sleep(self.check_timeout)
 
-        # Collect back the output
-        if not self.copy_files(input_files, output_files, to_server = False):
+                while not self.check_job_finished(job_id):
+                    if streaming:
+                        stream()
+                    time.sleep(self.check_timeout)
+
+        # Collect back the outputs not yet retrieved
+        submitted = [i for i in submitted if not i in streamed]
+        if streaming:
+            output_files = [x for i in submitted for x in label_outputs[i]]
+
+        if len(output_files) == 0:
+            print('[SUBMISSION {}] ALL THE OUTPUTS STREAMED'.format(threading.get_native_id()))
+        elif not self.copy_files(input_files, output_files, to_server = False):
             # Submission failed
             print('[SUBMISSION {}] FAILED RETRIVING OUTPUT'.format(threading.get_native_id()))
         else:
@@ -1014,15 +1128,55 @@ Error while connecting to the cluster to copy the files:
 
         return submitted, indices, label
 
+    def stream_outputs(self, labels, label_outputs, streamed):
+        """
+        STREAM THE FINISHED OUTPUTS
+        ===========================
+
+        Retrieve the outputs of the calculations marked as finished (LABEL.done)
+        that have not been retrieved yet. The outputs are compressed on the cluster
+        and extracted in the local_workdir in a single pipe.
+
+        Parameters
+        ----------
+            labels : list
+                The labels of the calculations
+            label_outputs : list
+                For each label, the list of its output files
+            streamed : list
+                The positions of the calculations already retrieved.
+                The new ones are appended.
+
+        Results
+        -------
+            new_outputs : list
+                The positions of the calculations retrieved by this call.
+        """
+        candidates = [i for i in range(len(labels)) if not i in streamed and len(label_outputs[i])]
+        if len(candidates) == 0:
+            return []
+
+        listing = " ".join(["[ -e {}.done ] && printf \"%s\\n\" {};".format(labels[i], " ".join(label_outputs[i]))
+                            for i in candidates])
+        remote_cmd = "cd {}; ({} true) | tar czf - -T -".format(self.workdir, listing)
+        cmd = self.get_cluster_command(remote_cmd) + " | tar xzf - -C {}".format(self.local_workdir)
+        if not self.ExecuteCMD(cmd, False):
+            return []
+
+        new_outputs = [i for i in candidates if all([os.path.exists(os.path.join(self.local_workdir, x)) for x in label_outputs[i]])]
+        streamed += new_outputs
+        if len(new_outputs):
+            print('[SUBMISSION {}] STREAMED {} OUTPUTS'.format(threading.get_native_id(), len(new_outputs)))
+        return new_outputs
+
     def collect_results(self, calc, submitted, indices, label):
         """
         Collect back all the results from the submitted data.
-        This operation needs to be performed in thread safe mode
-        (all threads must be locked between this operation and when the results are actually assigned to the ensemble
-        to avoid conflicts)
+        The outputs are read with the calculator of the thread (calc),
+        so different threads can collect their results at the same time.
         """
         # Read the output files
-        results = [None] * len(submitted)
+        results = [None] * len(indices)
         for i in submitted:
             # Prepare a typical label
             lbl = label + "_" + str(indices[i])
@@ -1064,6 +1218,40 @@ Error while connecting to the cluster to copy the files:
             print("Error, expected a standard output, but the result of the submission was: {}".format(output))
             return None
 
+    def get_job_poller(self):
+        """
+        Get the poller of the job status shared by all the submission threads
+        (it is created the first time).
+        """
+        if self.job_poller is None:
+            self.job_poller = JobPoller(self)
+        return self.job_poller
+
+    def get_queued_jobs(self):
+        """
+        GET THE JOBS IN THE QUEUE
+        =========================
+
+        Interrogate the scheduler with job_status_cmd.
+
+        Results
+        -------
+            jobs : set
+                The ids of the jobs in the queue (pending or running).
+                None if the server did not respond.
+        """
+        status, output = self.ExecuteCMD(self.job_status_cmd, False, return_output = True, on_cluster = True)
+        if not status:
+            return None
+
+        lines = [l.strip() for l in output.split("\n") if l.strip()]
+
+        # At least the header is expected
+        if len(lines) == 0:
+            return None
+
+        return set([l.split()[0] for l in lines])
+
     def check_job_finished(self, job_id, verbose = True):
         """
         Check if the job identified by the job_id is finished
@@ -1074,44 +1262,26 @@ Error while connecting to the cluster to copy the files:
                 The string that identifies uniquely the job
         """
 
-        status, output = self.ExecuteCMD("squeue -u $USER", False, return_output = True, on_cluster = True, )
-        lines = output.split("\n")
-
-        if len(lines):
-            for l in lines:
-                l = l.strip()
-                if not l:
-                    if verbose:
-                        now = datetime.datetime.now()
-                        sys.stderr.write("{}/{}/{} - {}:{}:{} | job {}: No response from the server \n".format(now.year, now.month, now.day, now.hour, now.minute, now.second, job_id))
-                        sys.stderr.flush()
-                    return False
-
-                data = l.split()
-                if len(data) == 0:
-                    if verbose:
-                        now = datetime.datetime.now()
-                        sys.stderr.write("{}/{}/{} - {}:{}:{} | job {}: No response from the server \n".format(now.year, now.month, now.day, now.hour, now.minute, now.second, job_id))
-                        sys.stderr.flush()
-                    return False
-                elif data[0] == job_id:
-                    if verbose:
-                        now = datetime.datetime.now()
-                        sys.stderr.write("{}/{}/{} - {}:{}:{} | job {} still running\n".format(now.year, now.month, now.day, now.hour, now.minute, now.second, job_id))
-                        sys.stderr.flush()
-                    return False
-
-            # If I'm here it means I did not find the job, but the command returned at least 1 line (so it was correctly executed).
+        jobs = self.get_queued_jobs()
+        now = datetime.datetime.now()
+
+        if jobs is None:
             if verbose:
-                now = datetime.datetime.now()
-                sys.stderr.write("{}/{}/{} - {}:{}:{} | job {} finished\n".format(now.year, now.month, now.day, now.hour, now.minute, now.second, job_id))
+                sys.stderr.write("{}/{}/{} - {}:{}:{} | job {}: No response from the server \n".format(now.year, now.month, now.day, now.hour, now.minute, now.second, job_id))
                 sys.stderr.flush()
-            return True
+            return False
+
+        if job_id in jobs:
+            if verbose:
+                sys.stderr.write("{}/{}/{} - {}:{}:{} | job {} still running\n".format(now.year, now.month, now.day, now.hour, now.minute, now.second, job_id))
+                sys.stderr.flush()
+            return False
+
+        # The command returned at least 1 line (so it was correctly executed), without the job
         if verbose:
-            now = datetime.datetime.now()
-            sys.stderr.write("{}/{}/{} - {}:{}:{} | error while interrogating the cluster for job {}\n".format(now.year, now.month, now.day, now.hour, now.minute, now.second, job_id))
+            sys.stderr.write("{}/{}/{} - {}:{}:{} | job {} finished\n".format(now.year, now.month, now.day, now.hour, now.minute, now.second, job_id))
             sys.stderr.flush()
-        return False
+        return True
 
 
     def run_atoms(self, ase_calc, ase_atoms, label="ESP",
@@ -1536,6 +1706,23 @@ Error while connecting to the cluster to copy the files:
         """
         RUN THE ENSEMBLE WITH BATCH SUBMISSION
         ======================================
+
+        The configurations are split in jobs of job_number configurations,
+        and up to batch_size jobs are kept running at the same time.
+        As soon as a job returns, a new one is submitted, including the
+        failed configurations, each one resubmitted at most max_recalc times.
+
+        Parameters
+        ----------
+            ensemble : Ensemble.Ensemble
+                The ensemble to be computed
+            cellconstructor_calc :
+                The calculator
+            get_stress : bool
+                If True, the stress tensor is also computed.
+            timeout : float, optional
+                If given, the configurations of a job that does not return within timeout seconds
+                are submitted again.
         """
 
         # Track the remaining configurations
@@ -1550,120 +1737,167 @@ Error while connecting to the cluster to copy the files:
             os.makedirs(self.local_workdir)
 
 
-        # Get the expected number of batch
-        num_batch_offset = int(ensemble.N / self.batch_size)
+        # Create the job poller and the shared connection before the submission threads
+        if self.use_job_poller:
+            self.get_job_poller()
+        self.open_connection()
 
         def compute_single_jobarray(jobs_id, calc):
             structures = [ensemble.structures[i].copy() for i in jobs_id]
             n_together = min(len(structures), self.n_together_def)
-            subs, indices, labels = self.batch_submission(structures, calc, jobs_id, ".pwi",
-                                            ".pwo", "ESP", n_together)
-
-            # Thread safe operation
-            self.lock.acquire()
-            print("[THREAD {}] submitted calculations: {}".format(threading.get_native_id(), indices))
-            results = self.collect_results(calc, subs, indices, labels)
-
-            for i, res in enumerate(results):
-                print("[THREAD {}] ADDING RESULT {} = {}".format(threading.get_native_id(), jobs_id[i], res))
-                num = jobs_id[i]
-
-                if res is None:
-                    continue
-
-                # Check if the run was good
-                check_e = "energy" in res
-                check_f = "forces" in res
-                check_s = "stress" in res
-
-                # Check the structure
-                if "structure" in res:
-                    error_struct = np.linalg.norm(ensemble.structures[jobs_id[i]].coords.ravel() - res["structure"].coords.ravel())
-                    if error_struct > 1e-2:
-                        print("ERROR IDENTIFYING STRUCTURE!")
-                        MSG = """
-                            Error in thread {}.
-                            Displacement between the expected structure {}
-                            and the one readed from the calculator
-                            is of {} A.
-                        """.format(threading.get_native_id(), jobs_id[i], error_struct)
-                        print(MSG)
-                        ensemble.structures[jobs_id[i]].save_scf('t_{}_error_struct_generated_{}.scf'.format(threading.get_native_id(), jobs_id[i]))
-                        structures[i].save_scf('t_{}_error_struct_cmp_local_{}.scf'.format(threading.get_native_id(), jobs_id[i]))
-                        res["structure"].save_scf('t_{}_error_struct_readed_{}.scf'.format(threading.get_native_id(), jobs_id[i]))
 
+            # The outputs are parsed at the same time by all the submission threads,
+            # each one with its own calculator. Only the writes in the ensemble are locked.
+            def add_results(results):
+                for i, res in enumerate(results):
+                    if res is None:
                         continue
-                else:
-                    print("[WARNING] no check on the structure.")
-
-                is_success =  check_e and check_f
-                if get_stress:
-                    is_success = is_success and check_s
-
-                if not is_success:
-                    continue
-
-                res_only_extra = {x : res[x] for x in res if x not in ["energy", "forces", "stress", "structure"]}
-                ensemble.all_properties[num].update(res_only_extra)
-                ensemble.energies[num] = res["energy"] / units["Ry"]
-                ensemble.forces[num, :, :] = res["forces"] / units["Ry"]
-                if get_stress:
-                    stress = np.zeros((3,3), dtype = np.float64)
-                    stress[0,0] = res["stress"][0]
-                    stress[1,1] = res["stress"][1]
-                    stress[2,2] = res["stress"][2]
-                    stress[1,2] = res["stress"][3]
-                    stress[2,1] = res["stress"][3]
-                    stress[0,2] = res["stress"][4]
-                    stress[2,0] = res["stress"][4]
-                    stress[0,1] = res["stress"][5]
-                    stress[1,0] = res["stress"][5]
-                    # Remember, ase has a very strange definition of the stress
-                    ensemble.stresses[num, :, :] = -stress * units["Bohr"]**3 / units["Ry"]
-                success[num] = is_success
 
-            self.lock.release()
-
-        # Run until some work has not finished
-        recalc = 0
-        self.lock = threading.Lock()
-        while np.sum(np.array(success, dtype = int) - 1) != 0:
-            threads = []
-
-            print("[CYCLE] SUCCESS: ", success)
-            print("[CYCLE] STOPPING CONDITION:", np.sum(np.array(success, dtype = int) - 1))
+                    print("[THREAD {}] ADDING RESULT {} = {}".format(threading.get_native_id(), jobs_id[i], res))
+                    num = jobs_id[i]
+
+                    # Check if the run was good
+                    check_e = "energy" in res
+                    check_f = "forces" in res
+                    check_s = "stress" in res
+
+                    # Check the structure
+                    if "structure" in res:
+                        error_struct = np.linalg.norm(ensemble.structures[jobs_id[i]].coords.ravel() - res["structure"].coords.ravel())
+                        if error_struct > 1e-2:
+                            print("ERROR IDENTIFYING STRUCTURE!")
+                            MSG = """
+                                Error in thread {}.
+                                Displacement between the expected structure {}
+                                and the one readed from the calculator
+                                is of {} A.
+                            """.format(threading.get_native_id(), jobs_id[i], error_struct)
+                            print(MSG)
+                            ensemble.structures[jobs_id[i]].save_scf('t_{}_error_struct_generated_{}.scf'.format(threading.get_native_id(), jobs_id[i]))
+                            structures[i].save_scf('t_{}_error_struct_cmp_local_{}.scf'.format(threading.get_native_id(), jobs_id[i]))
+                            res["structure"].save_scf('t_{}_error_struct_readed_{}.scf'.format(threading.get_native_id(), jobs_id[i]))
+
+                            continue
+                    else:
+                        print("[WARNING] no check on the structure.")
+
+                    is_success =  check_e and check_f
+                    if get_stress:
+                        is_success = is_success and check_s
+
+                    if not is_success:
+                        continue
 
-            # Get the remaining jobs
-            false_mask = np.array(success) == False
-            false_id = np.arange(ensemble.N)[false_mask]
+                    res_only_extra = {x : res[x] for x in res if x not in ["energy", "forces", "stress", "structure"]}
+                    energy = res["energy"] / units["Ry"]
+                    forces = res["forces"] / units["Ry"]
+                    if get_stress:
+                        stress = np.zeros((3,3), dtype = np.float64)
+                        stress[0,0] = res["stress"][0]
+                        stress[1,1] = res["stress"][1]
+                        stress[2,2] = res["stress"][2]
+                        stress[1,2] = res["stress"][3]
+                        stress[2,1] = res["stress"][3]
+                        stress[0,2] = res["stress"][4]
+                        stress[2,0] = res["stress"][4]
+                        stress[0,1] = res["stress"][5]
+                        stress[1,0] = res["stress"][5]
+                        # Remember, ase has a very strange definition of the stress
+                        stress *= -units["Bohr"]**3 / units["Ry"]
+
+                    # The same configuration may be computed by two jobs (resubmission after the timeout)
+                    with self.lock:
+                        ensemble.all_properties[num].update(res_only_extra)
+                        ensemble.energies[num] = energy
+                        ensemble.forces[num, :, :] = forces
+                        if get_stress:
+                            ensemble.stresses[num, :, :] = stress
+                            ensemble.stress_computed[num] = True
+                        ensemble.force_computed[num] = True
+                        success[num] = is_success
+
+            # The results streamed while the job is running are added immediately
+            def on_output(positions):
+                add_results(self.collect_results(calc, positions, jobs_id, "ESP"))
+
+            kwargs = {}
+            if self.stream_results:
+                kwargs["on_output"] = on_output
+            subs, indices, labels = self.batch_submission(structures, calc, jobs_id, ".pwi",
+                                            ".pwo", "ESP", n_together, **kwargs)
 
-            count = 0
-            # Submit in parallel
-            jobs = [false_id[i : i + self.job_number] for i in range(0, len(false_id), self.job_number)]
-            # Create a local copy of the calculator for each thread, to avoid conflicting modifications
-            calculators = [cellconstructor_calc.copy() for i in range(0, len(jobs))]
+            print("[THREAD {}] submitted calculations: {}".format(threading.get_native_id(), indices))
+            add_results(self.collect_results(calc, subs, indices, labels))
 
-            for k_th, job in enumerate(jobs):
-                # Submit only the batch size
-                if count >= self.batch_size:
+        # The jobs notify their end in this queue
+        finished_jobs = queue.Queue()
+        def run_job(job_key, jobs_id, calc):
+            try:
+                compute_single_jobarray(jobs_id, calc)
+            finally:
+                finished_jobs.put(job_key)
+
+        # The configurations to be submitted and the number of submissions of each one
+        pending = list(range(ensemble.N))
+        attempts = np.zeros(ensemble.N, dtype = int)
+        running_jobs = {}
+        n_jobs = 0
+        failed = []
+
+        # The shared connection is closed also if the calculation fails
+        try:
+            self.lock = threading.Lock()
+            while len(pending) or len(running_jobs):
+                # Keep batch_size jobs running
+                while len(pending) and len(running_jobs) < self.batch_size and not len(failed):
+                    job = np.array(pending[:self.job_number], dtype = int)
+                    pending = pending[self.job_number:]
+                    attempts[job] += 1
+
+                    # A local copy of the calculator for each thread, to avoid conflicting modifications
+                    t = threading.Thread(target = run_job, args=(n_jobs, job, cellconstructor_calc.copy()))
+                    running_jobs[n_jobs] = (job, time.time())
+                    n_jobs += 1
+                    t.start()
+
+                if len(running_jobs) == 0:
                     break
-                t = threading.Thread(target = compute_single_jobarray, args=(job, calculators[k_th], ))
-                t.start()
-                threads.append(t)
-                count += 1
 
-            # Wait until all the job have finished
-            for t in threads:
-                t.join(timeout)
-
-            print("[CYCLE] [END] SUCCESS: ", success)
-            print("[CYCLE] [END] STOPPING CONDITION:", np.sum(np.array(success, dtype = int) - 1))
-
-            recalc += 1
-            if recalc > num_batch_offset + self.max_recalc:
-                print ("Expected batch ordinary resubmissions:", num_batch_offset)
+                # Wait for the first job that returns
+                # (the jobs already resubmitted for the timeout are ignored)
+                done = []
+                try:
+                    job_key = finished_jobs.get(timeout = timeout)
+                    if job_key in running_jobs:
+                        done.append(running_jobs.pop(job_key)[0])
+                except queue.Empty:
+                    pass
+
+                # The jobs beyond the timeout are submitted again (they may still return)
+                if timeout is not None:
+                    for key in list(running_jobs):
+                        if time.time() - running_jobs[key][1] > timeout:
+                            print("[CYCLE] Job {} exceeded the timeout of {} s".format(key, timeout))
+                            done.append(running_jobs.pop(key)[0])
+
+                # Resubmit the failed configurations
+                for job in done:
+                    for i in job:
+                        if success[i]:
+                            continue
+                        if attempts[i] > self.max_recalc:
+                            failed.append(i)
+                        elif not i in pending:
+                            pending.append(i)
+
+                print("[CYCLE] COMPUTED: {} / {} | RUNNING JOBS: {} | PENDING: {}".format(np.sum(success), ensemble.N,
+                      len(running_jobs), len(pending)))
+
+            if len(failed):
+                print("Configurations submitted more than {} times: {}".format(self.max_recalc + 1, failed))
                 raise ValueError("Error, resubmissions exceeded the maximum number of %d" % self.max_recalc)
-                break
+        finally:
+            self.close_connection()
 
         print("CALCULATION ENDED: all properties: {}".format(ensemble.all_properties))
 
@@ -1685,3 +1919,121 @@ Error while connecting to the cluster to copy the files:
         self.compute_ensemble_batch(ensemble, ase_calc, get_stress, timeout)
         return
 
+
+
+class JobPoller(object):
+
+    def __init__(self, cluster, interval = None):
+        """
+        JOB STATUS POLLER
+        =================
+
+        A single thread interrogates the scheduler about all the submitted jobs,
+        with one query (Cluster.get_queued_jobs) every interval seconds.
+        The submission threads wait on a condition variable, and they are notified
+        as soon as their job disappears from the queue.
+        The thread starts with the first job and stops when no job is left.
+
+        Parameters
+        ----------
+            cluster : Cluster
+                The cluster on which the jobs are submitted
+            interval : float, optional
+                The time between two queries [s]. If None, cluster.check_timeout is used.
+        """
+
+        self.cluster = cluster
+        self.interval = interval
+
+        # The number of queries performed to the scheduler
+        self.n_queries = 0
+
+        self.__condition__ = threading.Condition()
+        self.__jobs__ = {}
+        self.__finished__ = set()
+        self.__thread__ = None
+
+    def add_job(self, job_id):
+        """
+        Start checking the status of a submitted job.
+        """
+        with self.__condition__:
+            self.__add_job__(job_id)
+
+    def __add_job__(self, job_id):
+        # The condition must be acquired
+        if job_id in self.__jobs__ or job_id in self.__finished__:
+            return
+
+        self.__jobs__[job_id] = time.time()
+        if self.__thread__ is None:
+            self.__thread__ = threading.Thread(target = self.__run__)
+            self.__thread__.daemon = True
+            self.__thread__.start()
+
+    def wait(self, job_id, timeout = None):
+        """
+        Wait until the job is finished (it is added to the poller if needed).
+
+        Parameters
+        ----------
+            job_id : string
+                The id of the job
+            timeout : float, optional
+                The maximum time to wait [s]
+
+        Results
+        -------
+            finished : bool
+                True if the job is finished, False if the timeout expired.
+        """
+        with self.__condition__:
+            self.__add_job__(job_id)
+            finished = self.__condition__.wait_for(lambda : job_id in self.__finished__, timeout)
+            if finished:
+                self.__finished__.discard(job_id)
+        return finished
+
+    def __run__(self):
+        """
+        The loop of the poller thread.
+        """
+        while True:
+            interval = self.interval
+            if interval is None:
+                interval = self.cluster.check_timeout
+            time.sleep(interval)
+
+            with self.__condition__:
+                if len(self.__jobs__) == 0:
+                    self.__thread__ = None
+                    return
+                t_query = time.time()
+                jobs = list(self.__jobs__.items())
+
+            # The query is performed without locking the submission threads
+            queued = self.cluster.get_queued_jobs()
+
+            now = datetime.datetime.now()
+            date = "{}/{}/{} - {}:{}:{}".format(now.year, now.month, now.day, now.hour, now.minute, now.second)
+
+            with self.__condition__:
+                self.n_queries += 1
+
+                if queued is None:
+                    sys.stderr.write("{} | No response from the server ({} jobs waiting)\n".format(date, len(jobs)))
+                else:
+                    n_finished = 0
+                    for job_id, t_add in jobs:
+                        # Only the jobs submitted before the query
+                        if job_id in queued or t_add > t_query:
+                            continue
+
+                        del self.__jobs__[job_id]
+                        self.__finished__.add(job_id)
+                        n_finished += 1
+                        sys.stderr.write("{} | job {} finished\n".format(date, job_id))
+
+                    sys.stderr.write("{} | {} jobs still running\n".format(date, len(jobs) - n_finished))
+                    self.__condition__.notify_all()
+                sys.stderr.flush()
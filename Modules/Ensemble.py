@@ -3,7 +3,9 @@ from __future__ import print_function
 import sys, os
 import warnings
 import numpy as np
+import scipy, scipy.sparse.linalg
 import time
+import copy
 #from scipy.special import tanh, sinh, cosh
 
 
@@ -37,6 +39,7 @@ from sscha.Parallel import pprint as print
 from sscha.Tools import NumpyEncoder
 
 import json
+import hashlib
 
 import difflib
 
@@ -121,6 +124,10 @@ __GPa__ = 14710.50763554043
 
 __DEBUG_RHO__ = False
 
+# How many diagonalized dynamical matrices are kept in memory
+# (the generating one, the current one and the previous step)
+__MODES_CACHE_SIZE__ = 3
+
 """
 This source contains the Ensemble class
 It is used to Load and Save info about the ensemble.
@@ -185,6 +192,15 @@ class Ensemble:
         # If True the frequency smaller than CC.Phonons.__EPSILON_W__ are ignored
         self.ignore_small_w = False
 
+        # The cache of the supercell diagonalization (see get_supercell_modes)
+        # It can be shared between ensembles generated by the same dyn (e.g. by split)
+        self.modes_cache = kwargs.get("modes_cache", {})
+        # The key of the cache entry of dyn_0, never evicted (only one entry is pinned)
+        self.modes_cache_pinned = None
+
+        # The symmetries (rotations and IRT) applied on the fly to the averages (see _unwrap_symmetries_)
+        self.symmetry_kernel = None
+
         # The original dynamical matrix used to generate the ensemble
         self.dyn_0 = dyn0.Copy()
         self.T0 = T0
@@ -192,6 +208,10 @@ class Ensemble:
         # This is the weight of each configuration in the sampling.
         # It is updated with the update_weigths function
         self.rho = []
+
+        # If the ensemble recycles several populations (see recycle_populations),
+        # the log of the balance heuristic denominator sum_k c_k P_k(x) / P_0(x) for each configuration.
+        self.mis_log_denominator = None
         self.current_dyn = dyn0.Copy()
 
         self.current_T = T0
@@ -272,6 +292,11 @@ Error, the supercell does not match with the q grid of the dynamical matrix.
         self.u_disps_original = np.zeros_like(self.u_disps)
         self.u_disps_original_qspace = np.zeros_like(self.u_disps_qspace)
 
+        # If true, the per-configuration real space arrays (positions, displacements and forces)
+        # are stored in single precision to halve the memory.
+        # The averages are always accumulated in double precision.
+        self.single_precision = False
+
         # Setup the attribute control
         self.__total_attributes__ = [item for item in self.__dict__.keys()]
         self.fixed_attributes = True # This must be the last attribute to be setted
@@ -304,13 +329,20 @@ Error, the supercell does not match with the q grid of the dynamical matrix.
             super(Ensemble, self).__setattr__(name, value)
 
         if name == "dyn_0":
-            self.w_0, self.pols_0, self.w_q_0, self.pols_q_0 = value.DiagonalizeSupercell(return_qmodes=True)
+            w_0, pols_0, w_q_0, pols_q_0, _ = self.get_supercell_modes(value)
+            self.w_0 = w_0.copy()
+            self.pols_0 = pols_0.copy()
+            self.w_q_0 = w_q_0.copy()
+            self.pols_q_0 = pols_q_0.copy()
             self.current_dyn = value.Copy()
             self.current_w = self.w_0.copy()
             self.current_pols = self.pols_0.copy()
             self.w_q_current = self.w_q_0.copy()
             self.pols_q_current = self.pols_q_0.copy()
 
+        if name == "single_precision":
+            self.convert_storage_precision()
+
 
     def convert_units(self, new_units):
         """
@@ -435,6 +467,16 @@ Error, the supercell does not match with the q grid of the dynamical matrix.
         self.supercell_structure = super_struct
         self.itau = itau + 1
 
+        # Setup the q points and the lattice vectors of the supercell
+        # (before the fourier transforms, as they change with the unit cell)
+        self.q_grid = np.array(self.dyn_0.q_tot) / CC.Units.A_TO_BOHR
+        nat_sc = self.supercell_structure.N_atoms
+        self.r_lat = np.zeros((nat_sc, 3), dtype = np.float64)
+        for i in range(nat_sc):
+            self.r_lat[i,:] = self.supercell_structure.coords[i, :] - \
+                self.dyn_0.structure.coords[self.itau[i] - 1, :]
+        self.r_lat *= CC.Units.A_TO_BOHR
+
         nat = self.dyn_0.structure.N_atoms
         nq = self.q_grid.shape[0]
         nat_sc = nat*nq
@@ -452,7 +494,7 @@ Error, the supercell does not match with the q grid of the dynamical matrix.
 
         if self.fourier_gradient:
             self.u_disps_qspace = julia.Main.vector_r2q(
-                self.u_disps,
+                np.asarray(self.u_disps, dtype = np.float64),
                 self.q_grid,
                 self.itau,
                 self.r_lat,
@@ -460,7 +502,7 @@ Error, the supercell does not match with the q grid of the dynamical matrix.
             self.u_disps_original_qspace = self.u_disps_qspace.copy()
 
             self.forces_qspace = julia.Main.vector_r2q(
-                self.forces.reshape((self.N, 3*nat_sc)),
+                np.asarray(self.forces, dtype = np.float64).reshape((self.N, 3*nat_sc)),
                 self.q_grid,
                 self.itau,
                 self.r_lat
@@ -489,17 +531,36 @@ Error, the supercell does not match with the q grid of the dynamical matrix.
             self.forces_qspace = None
             self.u_disps_qspace = None
 
-        self.q_grid = np.array(self.dyn_0.q_tot) / CC.Units.A_TO_BOHR
-        nat_sc = self.supercell_structure.N_atoms
-        self.r_lat = np.zeros((nat_sc, 3), dtype = np.float64)
-        for i in range(nat_sc):
-            self.r_lat[i,:] = self.supercell_structure.coords[i, :] - \
-                self.dyn_0.structure.coords[self.itau[i] - 1, :]
-        self.r_lat *= CC.Units.A_TO_BOHR
-
         if self.fourier_gradient:
             self.init_q_opposite()
 
+        self.convert_storage_precision()
+
+
+    def convert_storage_precision(self):
+        """
+        CONVERT THE STORAGE PRECISION
+        =============================
+
+        Cast the per-configuration arrays (xats, u_disps, u_disps_original, forces and sscha_forces)
+        to the precision selected by the single_precision attribute.
+        This is called automatically by init and when the single_precision attribute is changed.
+
+        In single precision the memory occupied by the ensemble is halved,
+        while the averages (gradient, stress, forces, free energy) are still accumulated in double precision,
+        as the configurations are upcasted inside the averaging kernels.
+        The fourier space arrays are always kept in double precision, as required by the julia kernels.
+        """
+
+        dtype = np.float64
+        if self.single_precision:
+            dtype = np.float32
+
+        for name in ["xats", "u_disps", "u_disps_original", "forces", "sscha_forces"]:
+            value = self.__dict__.get(name, None)
+            if isinstance(value, np.ndarray) and value.dtype != dtype:
+                super(Ensemble, self).__setattr__(name, value.astype(dtype, order = "K"))
+
 
 
     def load(self, data_dir, population, N, verbose = False, load_displacements = True, raise_error_on_not_found = False, load_noncomputed_ensemble = False, skip_extra_rows = False,
@@ -707,6 +768,7 @@ Error, the file '{}' is missing from the ensemble
 
         # Setup the initial weight
         self.rho = np.ones(self.N, dtype = np.float64)
+        self.mis_log_denominator = None
 
 
         t1 = time.time()
@@ -744,7 +806,8 @@ Error, the following stress files are missing from the ensemble:
 
 
 
-    def load_from_calculator_output(self, directory, out_ext = ".pwo", timer=None):
+    def load_from_calculator_output(self, directory, out_ext = ".pwo", timer=None, n_processes = 1,
+                                    fast_qe_parser = True, verbose = False):
         """
         LOAD THE ENSEMBLE FROM A CALCULATION
         ====================================
@@ -754,6 +817,11 @@ Error, the following stress files are missing from the ensemble:
         however in principle any output file from an ase supported format
         should be readed.
 
+        The output files can be parsed concurrently by a pool of processes.
+        Quantum ESPRESSO output files are parsed by a fast reader that
+        extracts only the energy, forces, stress and positions
+        (if it fails, the generic ASE reader is used).
+
         NOTE: This subroutine requires ASE to be correctly installed.
 
         Parameters
@@ -762,6 +830,14 @@ Error, the following stress files are missing from the ensemble:
                 Path to the directory that contains the output of the calculations
             out_ext : string
                 The extension of the files that will be readed.
+            timer : Timer, optional
+                If given, the init of the ensemble is timed.
+            n_processes : int
+                The number of processes used to parse the files.
+            fast_qe_parser : bool
+                If True, try the fast parser for Quantum ESPRESSO outputs.
+            verbose : bool
+                If True, print the timing report of the parsing.
         """
 
         assert __ASE__, "ASE library required to load from the calculator output file."
@@ -792,18 +868,30 @@ Error, the following stress files are missing from the ensemble:
         count_stress = 0
 
         # Superstructure
-        dyn_supercell = self.dyn_0.GenerateSupercellDyn(self.supercell)
-        super_structure = dyn_supercell.structure
-        super_fc = dyn_supercell.dynmats[0]
+        super_structure = self.dyn_0.structure.generate_supercell(self.supercell)
 
         self.structures = []
 
-        for i, outf in enumerate(output_files):
-            ase_struct = ase.io.read(outf)
+        # Parse the files
+        t1 = time.time()
+        masses = self.dyn_0.structure.masses.copy()
+        parser_args = [(outf, fast_qe_parser, masses, super_structure.atoms) for outf in output_files]
+        if n_processes > 1 and self.N > 1:
+            import concurrent.futures
+            chunksize = max(1, self.N // (4 * n_processes))
+            with concurrent.futures.ProcessPoolExecutor(max_workers = n_processes) as executor:
+                results = list(executor.map(_parse_calculator_output, parser_args, chunksize = chunksize))
+        else:
+            results = [_parse_calculator_output(x) for x in parser_args]
+        t2 = time.time()
 
-            # Get the structure
-            structure = CC.Structure.Structure()
-            structure.generate_from_ase_atoms(ase_struct)
+        errors = []
+        for i, res in enumerate(results):
+            if res["error"] is not None:
+                errors.append((output_files[i], res["error"]))
+                continue
+
+            structure = res["structure"]
 
             self.xats[i, :, :] = structure.coords
             self.structures.append(structure)
@@ -811,31 +899,38 @@ Error, the following stress files are missing from the ensemble:
             # Get the displacement [ANGSTROM]
             self.u_disps[i,:] = structure.get_displacement(super_structure).reshape( 3 * nat_sc)
 
-            # Get the energy
-            energy = ase_struct.get_potential_energy()
-            energy /= Rydberg
-            self.energies[i] = energy
+            # Energy [Ry], forces [Ry/A] and stress [Ry/bohr^3]
+            self.energies[i] = res["energy"]
+            self.forces[i, :, :] = res["forces"]
+            if res["stress"] is not None:
+                self.stresses[i, :, :] = res["stress"]
+                count_stress += 1
 
-            # Get the forces [eV/A -> Ry/A]
-            forces = ase_struct.get_forces() / Rydberg
-            self.forces[i, :, :] = forces
+        if verbose or errors:
+            times = np.array([res["time"] for res in results])
+            slowest = np.argmax(times)
+            print()
+            print("Parsed {} files in {:.3f} s ({} processes)".format(self.N, t2 - t1, n_processes))
+            print("Time per file: average {:.4f} s, slowest {:.4f} s ({})".format(np.mean(times), times[slowest], output_files[slowest]))
+            print("Files read with the fast QE parser: {}".format(np.sum([res["fast"] for res in results])))
+            print("Files with errors: {}".format(len(errors)))
+            for fname, err in errors:
+                print("    {} : {}".format(fname, err))
+
+        if errors:
+            ERROR_MSG = """
+Error, {} output files could not be parsed in directory {}.
+       The first one is {}:
+       {}
+""".format(len(errors), directory, errors[0][0], errors[0][1])
+            print(ERROR_MSG)
+            raise IOError(ERROR_MSG)
 
-            # Get the stress if any
-            try:
-                stress = - ase_struct.get_stress(voigt=False)
-                # eV/A^3 -> Ry/bohr^3
-                stress /= Rydberg / Bohr**3
-                count_stress += 1
-                self.stresses[i, :, :] = stress
-            except:
-                pass
+        if timer:
+            timer.add_timer("Parsing the calculator output", t2 - t1)
 
         self.rho = np.ones(self.N, dtype = np.float64)
-
-        t1 = time.time()
-        # self.q_start = CC.Manipulate.GetQ_vectors(self.structures, dyn_supercell, self.u_disps)
-        t2 = time.time()
-        # self.current_q = self.q_start.copy()
+        self.mis_log_denominator = None
 
         if count_stress == self.N:
             self.has_stress = True
@@ -976,15 +1071,16 @@ Error, the following stress files are missing from the ensemble:
                 with open(os.path.join(data_dir, "all_properties_pop%d.json" % population_id), "w") as fp:
                     json.dump({"properties" : self.all_properties}, fp, cls=NumpyEncoder)
 
-    def save_extxyz(self, filename, append_mode = True):
+    def save_extxyz(self, filename, append_mode = True, use_ase = True, **kwargs):
         """
         SAVE INTO EXTXYZ FORMAT
         =======================
 
         ASE extxyz format is used for build the training set for the nequip and allegro neural network potentials.
 
-        Note, this is the same as save_enhanced_xyz, but it uses ASE builtin function.
-        If ase is not found, it will use the save_enhanced_xyz function.
+        By default the file is written with the ASE builtin function.
+        With use_ase = False, it is written by save_enhanced_xyz (with the default keys),
+        directly from the ensemble arrays, which is much faster on large ensembles.
 
         Parameters
         ----------
@@ -992,10 +1088,18 @@ Error, the following stress files are missing from the ensemble:
                 The path to the .extxyz file containing the ensemble
             append_mode: bool
                 If true the ensemble is appended
+            use_ase : bool
+                If true (default), the file is written with the ase.io.write function.
+            **kwargs :
+                Only with use_ase = False, any other argument of save_enhanced_xyz
+                (chunk_size, compression, n_shards)
         """
 
+        if not use_ase:
+            self.save_enhanced_xyz(filename, append_mode = append_mode, **kwargs)
+            return
+
         if not __ASE__:
-            self.save_enhanced_xyz(filename, append_mode = append_mode)
             raise ImportError("Error, this function requires ASE installed")
 
 
@@ -1017,12 +1121,16 @@ Error, the following stress files are missing from the ensemble:
         ase.io.write(filename, ase_structs, format = "extxyz", append = append_mode)
 
 
-    def save_enhanced_xyz(self, filename, append_mode = True, stress_key = "stress", forces_key = "forces", energy_key = "energy"):
+    def save_enhanced_xyz(self, filename, append_mode = True, stress_key = "stress", forces_key = "forces", energy_key = "energy",
+                          chunk_size = 1000, compression = None, n_shards = 1):
         """
         Save the ensemble as an enhanced xyz.
 
         This is the default format for training the GAP potentials with quippy.
 
+        The file is written directly from the ensemble arrays,
+        formatting chunk_size configurations at once.
+
         Parameters
         ----------
             filename : string
@@ -1030,46 +1138,41 @@ Error, the following stress files are missing from the ensemble:
             append_mode : bool
                 If true, does not overwrite the previous existing file, but append the ensemble on the bottom.
                 This is the way to concatenate easily more ensembles.
+            chunk_size : int
+                How many configurations are formatted and written at once.
+            compression : string, optional
+                If "gz", "bz2" or "xz" the file is compressed.
+            n_shards : int
+                If bigger than 1, the ensemble is split into n_shards files
+                (filename with _shard<k> before the extension), written in parallel processes.
         """
         # Save only if the current processor is the master
         if Parallel.am_i_the_master():
-
-            lines = []
-            for i in range(self.N):
-                # Add the number of atoms
-                struct = self.structures[i]
-                lines.append("{:d}\n".format(struct.N_atoms))
-
-                # Prepare the enriched line of xyz with the description of the structure
-                info = 'pbc="T T T" ' # Periodic boundary conditions
-                info += 'Lattice="{:20.16f} {:20.16f} {:20.16f} {:20.16f} {:20.16f} {:20.16f} {:20.16f} {:20.16f} {:20.16f}" '.format(*list(struct.unit_cell.ravel()))
-
-                # Add the energy
-                info += '{}={:.16f} '.format(energy_key, self.energies[i] * Rydberg)
-
-                # Add the virial stress only if present
-                if self.stress_computed[i]:
-                    stress_data = - self.stresses[i].ravel() * CC.Units.RY_PER_BOHR3_TO_EV_PER_A3
-                    info += '{}="{:20.16f} {:20.16f} {:20.16f} {:20.16f} {:20.16f} {:20.16f} {:20.16f} {:20.16f} {:20.16f}" '.format(stress_key, *list(stress_data))
-
-                # Add the secription of the xyz format
-                info += 'Properties=species:S:1:pos:R:3:{}:R:3\n'.format(forces_key)
-
-                lines.append(info)
-
-                # Append the structure and the forces
-                for j in range(struct.N_atoms):
-                    line = "{}  ".format(struct.atoms[j])
-                    line += " {:20.16f} {:20.16f} {:20.16f}    ".format(*list(struct.coords[j, :]))
-                    line += " {:20.16f} {:20.16f} {:20.16f}\n".format(*list(self.forces[i, j, :] * Rydberg))
-                    lines.append(line)
-
-            # Save the work
-            c = "a"
+            energies = self.energies * Rydberg
+            forces = self.forces * Rydberg
+            stresses = - self.stresses.reshape((self.N, 9)) * CC.Units.RY_PER_BOHR3_TO_EV_PER_A3
+            cells = np.array([s.unit_cell.ravel() for s in self.structures])
+            atoms = [s.atoms for s in self.structures]
+            keys = (energy_key, forces_key, stress_key)
+
+            mode = "a"
             if not append_mode:
-                c = "w"
-            with open(filename, c) as fp:
-                fp.writelines(lines)
+                mode = "w"
+
+            if n_shards <= 1:
+                _write_enhanced_xyz((filename, mode, compression, chunk_size, keys, atoms, self.xats,
+                                     forces, energies, stresses, self.stress_computed, cells))
+            else:
+                import concurrent.futures
+                root, ext = os.path.splitext(filename)
+                bounds = np.linspace(0, self.N, n_shards + 1).astype(int)
+                jobs = []
+                for k in range(n_shards):
+                    sl = slice(bounds[k], bounds[k+1])
+                    jobs.append(("{}_shard{}{}".format(root, k, ext), mode, compression, chunk_size, keys, atoms[sl],
+                                 self.xats[sl], forces[sl], energies[sl], stresses[sl], self.stress_computed[sl], cells[sl]))
+                with concurrent.futures.ProcessPoolExecutor(max_workers = n_shards) as executor:
+                    list(executor.map(_write_enhanced_xyz, jobs))
 
         # Force other processors to wait for the master
         CC.Settings.barrier()
@@ -1111,21 +1214,21 @@ Error, the following stress files are missing from the ensemble:
                 raise IOError("Error, save_raw expects a directory, but '{}' is not a directory.".format(root_directory))
 
             # Save the energies
-            np.savetxt(os.path.join(root_directory, "energy.raw"), self.energies * Rydberg)
+            _write_raw_array(os.path.join(root_directory, "energy.raw"), (self.energies * Rydberg).reshape((self.N, 1)))
 
             # Save the positions
-            np.savetxt(os.path.join(root_directory, "coord.raw"), self.xats.reshape((self.N, 3 * nat)))
+            _write_raw_array(os.path.join(root_directory, "coord.raw"), self.xats.reshape((self.N, 3 * nat)))
 
             # Save the box
             #Prepare an array with all the unit cells
-            np.savetxt(os.path.join(root_directory, "box.raw"), np.array([s.unit_cell.ravel() for s in self.structures]))
+            _write_raw_array(os.path.join(root_directory, "box.raw"), np.array([s.unit_cell.ravel() for s in self.structures]))
 
             # Save the forces
-            np.savetxt(os.path.join(root_directory, "force.raw"), self.forces.reshape((self.N, 3*nat)) * Rydberg)
+            _write_raw_array(os.path.join(root_directory, "force.raw"), self.forces.reshape((self.N, 3*nat)) * Rydberg)
 
             # Save the stress
             #TODO: Check if there is a -1 sign or if the the units are correct
-            np.savetxt(os.path.join(root_directory, "virial.raw"), self.stresses.reshape((self.N, 9)) * __GPa__ * 10000)
+            _write_raw_array(os.path.join(root_directory, "virial.raw"), self.stresses.reshape((self.N, 9)) * __GPa__ * 10000)
 
             # Save the types
             ss = self.current_dyn.structure.generate_supercell(self.current_dyn.GetSupercell())
@@ -1204,6 +1307,7 @@ Error, the following stress files are missing from the ensemble:
 
         # Setup the initial weights
         self.rho = np.ones(self.N, dtype = np.float64)
+        self.mis_log_denominator = None
 
         # Setup that both forces and stresses are not computed
         self.stress_computed = np.ones(self.N, dtype = bool)
@@ -1245,10 +1349,31 @@ Error, the following stress files are missing from the ensemble:
 
         # Perform the standard initialization
 
-        self.N = len(structures)
         Nat_sc = np.prod(self.supercell) * self.dyn_0.structure.N_atoms
 
-        self.structures = [x for x in structures]
+        xats = np.zeros((len(structures), Nat_sc, 3), dtype = np.float64, order = "C")
+        for i, s in enumerate(structures):
+            # Get the displacements
+            xats[i, :, :] = s.coords
+
+        self.init_from_positions(xats, structures)
+
+    def init_from_positions(self, xats, structures = None):
+        """
+        Initialize the ensemble from the atomic positions of the configurations
+
+        Parameters
+        ----------
+            xats : ndarray(size = (N, nat_sc, 3))
+                The atomic positions (in Angstrom) of each configuration.
+                If it is a C contiguous double array, it is used without copying.
+            structures : list of structures, optional
+                The structures of the configurations.
+                If None, they are built from the supercell and xats.
+        """
+
+        self.N = xats.shape[0]
+        Nat_sc = np.prod(self.supercell) * self.dyn_0.structure.N_atoms
 
         self.sscha_energies = np.zeros( ( self.N), dtype = np.float64)
         self.sscha_forces = np.zeros((self.N, Nat_sc, 3), dtype = np.float64, order = "F")
@@ -1257,16 +1382,21 @@ Error, the following stress files are missing from the ensemble:
         self.forces = np.zeros( (self.N, Nat_sc, 3), dtype = np.float64, order = "F")
         self.stresses = np.zeros( (self.N, 3, 3), dtype = np.float64, order = "F")
         self.u_disps = np.zeros( (self.N, Nat_sc * 3), dtype = np.float64, order = "F")
-        self.xats = np.zeros((self.N, Nat_sc, 3), dtype = np.float64, order = "C")
-        for i, s in enumerate(self.structures):
-            # Get the displacements
-            self.xats[i, :, :] = s.coords
+        self.xats = np.ascontiguousarray(xats, dtype = np.float64)
 
         # Initialize the supercell
         super_struct, itau = self.dyn_0.structure.generate_supercell(self.supercell, get_itau=True)
         self.supercell_structure = super_struct
         self.itau = itau + 1
 
+        if structures is None:
+            structures = []
+            for i in range(self.N):
+                s = super_struct.copy()
+                s.coords = self.xats[i, :, :].copy()
+                structures.append(s)
+        self.structures = [x for x in structures]
+
         self.u_disps[:,:] = np.reshape(self.xats - np.tile(self.supercell_structure.coords, (self.N, 1,1)), (self.N, 3 * Nat_sc), order = "C")
         self.u_disps_original = self.u_disps.copy()
 
@@ -1275,13 +1405,13 @@ Error, the following stress files are missing from the ensemble:
         # Initialize the vectors in fourier space
         if self.fourier_gradient:
             self.u_disps_qspace = julia.Main.vector_r2q(
-                self.u_disps,
+                np.asarray(self.u_disps, dtype = np.float64),
                 self.q_grid,
                 self.itau,
                 self.r_lat
             )
             self.u_disps_original_qspace = julia.Main.vector_r2q(
-                self.u_disps_original,
+                np.asarray(self.u_disps_original, dtype = np.float64),
                 self.q_grid,
                 self.itau,
                 self.r_lat
@@ -1306,6 +1436,7 @@ Error, the following stress files are missing from the ensemble:
 
 
         self.rho = np.ones(self.N, dtype = np.float64)
+        self.mis_log_denominator = None
         self.current_dyn = self.dyn_0.Copy()
         self.current_T = self.T0
 
@@ -1331,6 +1462,8 @@ Error, the following stress files are missing from the ensemble:
         self.r_lat *= CC.Units.A_TO_BOHR
         self.init_q_opposite()
 
+        self.convert_storage_precision()
+
 
 
 
@@ -1349,7 +1482,8 @@ Error, the following stress files are missing from the ensemble:
 
 
 
-    def generate(self, N, evenodd = True, project_on_modes = None, sobol = False, sobol_scramble = False, sobol_scatter = 0.0):
+    def generate(self, N, evenodd = True, project_on_modes = None, sobol = False, sobol_scramble = False, sobol_scatter = 0.0,
+                 vectorized = False, n_threads = 1):
         """
         GENERATE THE ENSEMBLE
         =====================
@@ -1373,12 +1507,25 @@ Error, the following stress files are missing from the ensemble:
                 Set the optional scrambling of the generated numbers taken from the Sobol sequence.
             sobol_scatter : real (0.0 to 1) (Deafault = 0.0)
                 Set the scatter parameter to displace the Sobol positions randommly.
+            vectorized : bool, optional (Default = False)
+                If True, the gaussian amplitudes of all the configurations are extracted at once
+                and the displacements are obtained with a single matrix product with the polarization vectors,
+                writing directly the ensemble arrays (see _generate_vectorized_).
+                It is not available with project_on_modes or sobol_scatter,
+                in that case the standard generation is used.
+            n_threads : int, optional (Default = 1)
+                Only with vectorized: the number of threads that compute the displacements
+                and write the positions, each one on a block of configurations.
 
         """
 
         if evenodd and (N % 2 != 0):
             raise ValueError("Error, evenodd allowed only with an even number of random structures")
 
+        if vectorized and project_on_modes is None and sobol_scatter == 0:
+            self._generate_vectorized_(N, evenodd, sobol, sobol_scramble, n_threads)
+            return
+
         self.N = N
         Nat_sc = np.prod(self.supercell) * self.dyn_0.structure.N_atoms
         self.structures = []
@@ -1406,6 +1553,88 @@ Error, the following stress files are missing from the ensemble:
 
         self.init_from_structures(structures)
 
+    def _generate_vectorized_(self, N, evenodd = True, sobol = False, sobol_scramble = False, n_threads = 1):
+        """
+        Generate the ensemble extracting the gaussian amplitudes of all the modes at once.
+
+        The displacements are obtained from a single matrix product between the amplitudes and the
+        polarization vectors scaled by the normal lengths and the masses.
+        Only the amplitudes are broadcasted between the processors, the positions are
+        written directly in the ensemble arrays.
+        If evenodd, each configuration is followed by its opposite (antithetic) partner.
+
+        Parameters
+        ----------
+            N : int
+                The number of random configurations to be extracted
+            evenodd : bool
+                If true for each configuration also the opposite is extracted
+            sobol : bool
+                If true the amplitudes are obtained from a Sobol sequence
+            sobol_scramble : bool
+                If true the Sobol sequence is scrambled
+            n_threads : int
+                The number of threads. The configurations are split in blocks,
+                each thread performs the matrix product of its block and writes
+                the positions in place (numpy releases the GIL).
+        """
+        super_struct = self.dyn_0.structure.generate_supercell(self.dyn_0.GetSupercell())
+        nat_sc = super_struct.N_atoms
+
+        # Get the modes (without translations) from the cache
+        w, pols, _, _, trans = self.get_supercell_modes(self.dyn_0)
+        w = np.real(w[~trans])
+        pols = np.real(pols[:, ~trans])
+        n_modes = len(w)
+
+        # Normal lengths in Ry units (w_to_a works in Ha)
+        a = self.w_to_a(w / 2, self.T0) / np.sqrt(2)
+
+        # The polarization vectors scaled by the normal lengths and the masses [Angstrom]
+        sqrt_m = np.repeat(np.sqrt(super_struct.get_masses_array()), 3)
+        scaled_pols = pols * a[np.newaxis, :] / sqrt_m[:, np.newaxis] * CC.Units.BOHR_TO_ANGSTROM
+
+        # Extract the amplitudes
+        n_indep = N // 2 if evenodd else N
+        if sobol:
+            from scipy.stats import qmc, norm
+            sampler = qmc.Sobol(d = n_modes, scramble = sobol_scramble)
+            if not sobol_scramble:
+                # The first point of the sequence is 0, that is not allowed by the gaussian mapping
+                sampler.fast_forward(1)
+            amplitudes = norm.ppf(sampler.random(n_indep))
+        else:
+            amplitudes = np.random.normal(size = (n_indep, n_modes))
+
+        # Enforce all the processors to share the same amplitudes
+        amplitudes = CC.Settings.broadcast(amplitudes)
+
+        xats = np.zeros((N, nat_sc, 3), dtype = np.float64, order = "C")
+        if evenodd:
+            xats_plus = xats[0::2, :, :]
+            xats_minus = xats[1::2, :, :]
+        else:
+            xats_plus = xats
+            xats_minus = None
+
+        def write_block(start, end):
+            # Get the displacements of the block and write the positions
+            u_disps = amplitudes[start:end, :].dot(scaled_pols.T).reshape((end - start, nat_sc, 3))
+            np.add(super_struct.coords[np.newaxis, :, :], u_disps, out = xats_plus[start:end, :, :])
+            if xats_minus is not None:
+                np.subtract(super_struct.coords[np.newaxis, :, :], u_disps, out = xats_minus[start:end, :, :])
+
+        n_threads = max(1, min(n_threads, n_indep))
+        blocks = np.linspace(0, n_indep, n_threads + 1).astype(int)
+        if n_threads > 1:
+            import concurrent.futures
+            with concurrent.futures.ThreadPoolExecutor(max_workers = n_threads) as executor:
+                list(executor.map(write_block, blocks[:-1], blocks[1:]))
+        else:
+            write_block(0, n_indep)
+
+        self.init_from_positions(xats)
+
     # def get_unwrapped_ensemble(self, subtract_sscha = True, verbose = True):
     #     """
     #     This subroutine gets the displacements, forces and stochastic weights of the ensemble
@@ -1523,10 +1752,30 @@ Error, the following stress files are missing from the ensemble:
         (and energies and forces) of the symmetric specular configurations.
         This allows for a simple simmetrization of the odd3 correction.
 
+        The unwrapping is implicit: the ensemble is not replicated,
+        instead the symmetries (the IRT permutations and the cartesian rotations)
+        are stored in self.symmetry_kernel and applied on the fly to the ensemble averages
+        (gradient, d3 and d4), that are linear in the configurations.
+        The memory scales with the number of configurations N, not N * n_syms.
+
         NOTE: stress tensors are not unwrapped!
 
         NOTE: This works only if spglib is installed
         """
+        self.symmetry_kernel = self._get_supercell_symmetries_()
+
+
+    def _get_supercell_symmetries_(self):
+        """
+        Get the symmetries of the supercell from spglib.
+
+        Results
+        -------
+            rotations : ndarray(size = (n_syms, 3, 3))
+                The rotations in cartesian coordinates (acting on row vectors)
+            irts : ndarray(size = (n_syms, nat_sc), dtype = int)
+                The atom permutation of each symmetry
+        """
 
         # Get the symmetries
         if not __SPGLIB__:
@@ -1553,57 +1802,69 @@ Error, the following stress files are missing from the ensemble:
 
         print ("Time elapsed to compute IRTS:", t2 - t1, "s")
 
-        new_N = self.N * n_syms
-        u_disps_new = np.zeros( (new_N, 3 * nat_sc), dtype = np.float64, order = "F")
-        forces_new = np.zeros( (new_N, nat_sc, 3), dtype = np.float64, order = "F")
-        rho_new = np.zeros( (new_N), dtype = np.float64)
-        xats_new = np.zeros( (new_N, nat_sc, 3), dtype = np.float64, order = "C")
-        energies_new = np.zeros( (new_N), dtype = np.float64)
-        sscha_energies_new = np.zeros( (new_N), dtype = np.float64)
-        sscha_forces_new = np.zeros( (new_N, nat_sc, 3), dtype = np.float64, order = "F")
-        new_structures = []
+        # Get the rotation in cartesian coordinates (acting on row vectors)
+        # by applying each symmetry to the cartesian versors of a single atom
+        rotations = np.zeros( (n_syms, 3, 3), dtype = np.float64)
+        for i in range(n_syms):
+            for k in range(3):
+                rotations[i, k, :] = CC.symmetries.ApplySymmetryToVector(cc_syms[i], np.eye(3)[k:k+1, :],
+                                                                          super_structure.unit_cell, np.zeros(1, dtype = int))
 
-        t1 = time.time()
-        for x in range(self.N):
-            print ("Config %d" % x)
-            for i in range(n_syms):
+        return rotations, irts
 
-                index = n_syms * x + i
 
-                u_v = self.u_disps[x, :].reshape((nat_sc, 3))
-                u_new = CC.symmetries.ApplySymmetryToVector(cc_syms[i], u_v, super_structure.unit_cell, irts[i, :])
-                u_disps_new[index, :] = u_new.ravel()
-                xats_new[index, :, :] = super_structure.coords + u_new
+    def apply_symmetry_kernel(self, tensor):
+        """
+        APPLY THE SYMMETRY KERNEL
+        =========================
 
-                f_v = self.forces[x, :, :]
-                f_new = CC.symmetries.ApplySymmetryToVector(cc_syms[i], f_v, super_structure.unit_cell, irts[i, :])
-                forces_new[index, :, :] = f_new
+        Average a tensor over all the symmetries stored by _unwrap_symmetries_.
+        This is equivalent to compute the same tensor on the ensemble unwrapped
+        with all the symmetric configurations, without allocating them.
 
-                f_v = self.sscha_forces[x, :, :]
-                f_new = CC.symmetries.ApplySymmetryToVector(cc_syms[i], f_v, super_structure.unit_cell, irts[i, :])
-                sscha_forces_new[index, :, :] = f_new
+        Parameters
+        ----------
+            tensor : ndarray(size = (3*nat_sc, ..., 3*nat_sc) or (..., nat_sc, 3))
+                The tensor to symmetrize. Either a tensor of any rank in the supercell
+                (like the gradient, the d3 or the d4),
+                or a batch of vectors (like the forces).
 
-                rho_new[index] = self.rho[x]
-                energies_new[index] = self.energies[x]
-                sscha_energies_new[index] = self.sscha_energies[x]
+        Results
+        -------
+            sym_tensor : ndarray
+                The tensor averaged over the symmetries, with the same shape of tensor.
+        """
+        if self.symmetry_kernel is None:
+            return tensor
 
-                tmp_struct = super_structure.copy()
-                tmp_struct.coords = xats_new[index, :, :]
-                new_structures.append(tmp_struct)
-        t2 = time.time()
+        rotations, irts = self.symmetry_kernel
+        n_syms, nat_sc = irts.shape
 
-        print ("Time elapsed unwrapping the ensemble:", t2 - t1, "s")
+        # Get the inverse permutations (new[irt[i]] = old[i] -> new = old[inv_irt])
+        inv_irts = np.zeros_like(irts)
+        for i in range(n_syms):
+            inv_irts[i, irts[i, :]] = np.arange(nat_sc)
 
-        # Update the ensemble
-        self.N = new_N
-        self.u_disps = u_disps_new
-        self.xats = xats_new
-        self.rho = rho_new
-        self.structures = new_structures
-        self.energies = energies_new
-        self.forces = forces_new
-        self.sscha_energies = sscha_energies_new
-        self.sscha_forces = sscha_forces_new
+        # Identify the atomic and cartesian axis to transform
+        if tensor.shape[-2:] == (nat_sc, 3):
+            work_tensor = tensor
+            axes = [tensor.ndim - 2]
+        else:
+            rank = tensor.ndim
+            work_tensor = tensor.reshape((nat_sc, 3) * rank)
+            axes = [2*k for k in range(rank)]
+
+        result = np.zeros(work_tensor.shape, dtype = tensor.dtype)
+        for i in range(n_syms):
+            work = work_tensor
+            for ax in axes:
+                # Rotate the cartesian index and permute the atoms
+                work = np.moveaxis(np.tensordot(work, rotations[i, :, :], axes = ([ax + 1], [0])), -1, ax + 1)
+                work = np.take(work, inv_irts[i, :], axis = ax)
+            result += work
+
+        result /= n_syms
+        return result.reshape(tensor.shape)
 
     def update_displacements(self, new_structure):
         """
@@ -1618,6 +1879,229 @@ Error, the following stress files are missing from the ensemble:
         self.u_disps_qspace[:,:,0] += np.tile(delta.ravel(), (self.N, 1)) * np.sqrt(nq)
 
 
+    def change_unit_cell(self, new_unit_cell):
+        """
+        STRAIN THE ENSEMBLE
+        ===================
+
+        Move the ensemble to a new unit cell, without recomputing energies and forces.
+        This allows to perform more cell steps of a variable cell relaxation on the same population.
+
+        The configurations and the generating dynamical matrix (dyn_0) are strained homogeneously
+        (the crystal coordinates are kept). The forces are transformed as gradients,
+        while the energies are corrected at first order in the strain with the stress of each configuration:
+
+        .. math::
+
+            E_i(\\varepsilon) = E_i - \\Omega \\sum_{ab} \\sigma_{i,ab}\\varepsilon_{ab}
+
+        The stresses of the configurations are held at zeroth order (they are not updated),
+        as their response to the strain would require the elastic constants of each configuration.
+        Therefore the stress tensor computed on a strained ensemble is only an estimate:
+        the variable cell relaxation does not use it to update the history of the cell optimizer.
+
+        The strained configurations are not distributed according to the strained dyn_0.
+        The log ratio between the two probabilities is added to mis_log_denominator,
+        so that the importance sampling stays exact and the effective sample size
+        measures how far the new cell is from the one that generated the ensemble.
+
+        After this call the weights correspond to dyn_0, call update_weights to move to another dynamical matrix.
+
+        Parameters
+        ----------
+            new_unit_cell : ndarray(size = (3,3))
+                The new unit cell (lattice vectors are the rows) in Angstrom.
+        """
+
+        if not self.has_stress:
+            ERR_MSG = """
+Error, the ensemble can be strained only if the stress tensor is computed.
+"""
+            print(ERR_MSG)
+            raise ValueError(ERR_MSG)
+
+        if self.units != UNITS_DEFAULT:
+            raise ValueError("Error, the ensemble must be in the default units to change the unit cell.")
+
+        # The transformation of the cartesian coordinates (row vectors)
+        strain_matrix = np.linalg.inv(self.dyn_0.structure.unit_cell).dot(new_unit_cell)
+        strain = np.transpose(strain_matrix) - np.eye(3)
+
+        log_p_old = self._get_log_generating_probability()
+        volume = self.supercell_structure.get_volume() * __A_TO_BOHR__**3
+
+        self.energies -= volume * np.einsum("iab, ab -> i", self.stresses, strain)
+        self.forces = self.forces.dot(np.linalg.inv(strain_matrix).T)
+        self.xats = np.ascontiguousarray(self.xats.dot(strain_matrix))
+
+        new_dyn = self.dyn_0.Copy()
+        new_dyn.AdjustToNewCell(new_unit_cell)
+        self.dyn_0 = new_dyn
+
+        super_cell = self.dyn_0.structure.generate_supercell(self.supercell).unit_cell
+        for i, s in enumerate(self.structures):
+            s.coords = np.array(self.xats[i, :, :], dtype = np.float64)
+            s.unit_cell = super_cell.copy()
+
+        self.init()
+
+        # The strain jacobian acts on the 3(nat_sc - 1) non translational degrees of freedom
+        log_jacobian = (self.supercell_structure.N_atoms - 1) * np.log(np.abs(np.linalg.det(strain_matrix)))
+        log_ratio = log_p_old - log_jacobian - self._get_log_generating_probability()
+        if self.mis_log_denominator is None:
+            self.mis_log_denominator = log_ratio
+        else:
+            self.mis_log_denominator = self.mis_log_denominator + log_ratio
+
+        self.current_T = self.T0
+        self.rho = np.exp(-self.mis_log_denominator)
+
+
+    def _get_log_generating_probability(self):
+        """
+        Get the log of the probability (up to a constant) of each configuration
+        in the distribution of dyn_0 at T0.
+        """
+        w, pols, _, _, trans = self.get_supercell_modes(self.dyn_0)
+        a = self.w_to_a(np.array(w[~trans] / 2, dtype = np.float64), self.T0)
+        ups = np.real(self.dyn_0.GetUpsilonMatrix(self.T0, w_pols = (w, pols)))
+
+        u_disps = np.asarray(self.u_disps_original, dtype = np.float64) * __A_TO_BOHR__
+        uYu = np.einsum("ij, ij -> i", u_disps.dot(ups), u_disps)
+
+        return -0.5 * uYu - np.sum(np.log(a))
+
+
+    def get_supercell_modes(self, dyn = None, timer = None):
+        """
+        GET THE SUPERCELL MODES
+        =======================
+
+        Diagonalize the dynamical matrix in the supercell.
+        The result is stored in the ensemble and reused as long as the content
+        of the dynamical matrix does not change, so that all the methods of the ensemble
+        (weights, gradient, stress, hessian) share a single diagonalization.
+
+        NOTE: the returned arrays are read-only, copy them before modifying.
+
+        Parameters
+        ----------
+            dyn : CC.Phonons.Phonons, optional
+                The dynamical matrix to diagonalize. If None, the current_dyn is used.
+            timer : Timer, optional
+                If given, the diagonalization is timed.
+
+        Results
+        -------
+            w : ndarray(3*nat_sc)
+                The frequencies in the supercell [Ry]
+            pols : ndarray(3*nat_sc, 3*nat_sc)
+                The polarization vectors in the supercell
+            w_q : ndarray(3*nat, nq)
+                The frequencies at each q point
+            pols_q : ndarray(3*nat, 3*nat, nq)
+                The polarization vectors at each q point
+            trans_mask : ndarray(3*nat_sc, dtype = bool)
+                True for the translational modes
+        """
+        if dyn is None:
+            dyn = self.current_dyn
+
+        return self._get_modes_entry_(dyn, timer)["modes"]
+
+
+    def get_fortran_modes(self, dyn = None, exclude_translations = False, timer = None):
+        """
+        GET THE MODES IN THE FORTRAN LAYOUT
+        ===================================
+
+        Get the supercell frequencies and polarization vectors in the layout
+        required by the SCHAModules subroutines.
+        The polarization vectors are returned as a Fortran ordered (nat_sc, n_modes, 3) array.
+        The conversion is done once and cached together with the diagonalization (see get_supercell_modes).
+
+        NOTE: the returned arrays are read-only.
+
+        Parameters
+        ----------
+            dyn : CC.Phonons.Phonons, optional
+                The dynamical matrix. If None, the current_dyn is used.
+            exclude_translations : bool
+                If True, the translational modes are removed.
+            timer : Timer, optional
+                If given, the diagonalization is timed.
+
+        Results
+        -------
+            w : ndarray(n_modes)
+                The frequencies [Ry]
+            er : ndarray(nat_sc, n_modes, 3)
+                The real part of the polarization vectors in Fortran order
+        """
+        if dyn is None:
+            dyn = self.current_dyn
+
+        entry = self._get_modes_entry_(dyn, timer)
+        layout_key = ("fortran", exclude_translations)
+        if not layout_key in entry:
+            w, pols, _, _, trans_mask = entry["modes"]
+            if exclude_translations:
+                w = w[~trans_mask]
+                pols = pols[:, ~trans_mask]
+
+            w = np.real(w)
+            er = _get_fortran_pols(np.real(pols))
+            w.flags.writeable = False
+            er.flags.writeable = False
+            entry[layout_key] = (w, er)
+
+        return entry[layout_key]
+
+
+    def _get_modes_entry_(self, dyn, timer = None):
+        """
+        Get the entry of the modes cache for the given dynamical matrix,
+        diagonalizing it if it is not already present.
+        """
+        key = _get_dyn_hash(dyn, self.ignore_small_w)
+        if key in self.modes_cache:
+            # Move the entry at the end (it is the most recently used)
+            entry = self.modes_cache.pop(key)
+            self.modes_cache[key] = entry
+            if dyn is self.dyn_0:
+                self.modes_cache_pinned = key
+            return entry
+
+        if timer:
+            w, pols, w_q, pols_q = timer.execute_timed_function(dyn.DiagonalizeSupercell, return_qmodes=True)
+        else:
+            w, pols, w_q, pols_q = dyn.DiagonalizeSupercell(return_qmodes=True)
+
+        if not self.ignore_small_w:
+            super_structure = dyn.structure.generate_supercell(dyn.GetSupercell())
+            trans_mask = CC.Methods.get_translations(pols, super_structure.get_masses_array())
+        else:
+            trans_mask = np.abs(w) < CC.Phonons.__EPSILON_W__
+
+        modes = (w, pols, w_q, pols_q, np.array(trans_mask, dtype = bool))
+        for x in modes:
+            x.flags.writeable = False
+
+        # The modes of dyn_0 are pinned: the trial steps of the minimization must not evict them.
+        # If dyn_0 changed, the entry of the old one is unpinned.
+        if dyn is self.dyn_0:
+            self.modes_cache_pinned = key
+
+        # Drop the least recently used entry
+        while len(self.modes_cache) >= __MODES_CACHE_SIZE__:
+            unpinned = [k for k in self.modes_cache if k != self.modes_cache_pinned]
+            self.modes_cache.pop(unpinned[0])
+        entry = {"modes" : modes}
+        self.modes_cache[key] = entry
+
+        return entry
+
+
     def update_weights_fourier(self, new_dynamical_matrix, newT, timer=None):
         """
         IMPORTANCE SAMPLING
@@ -1638,10 +2122,6 @@ Error, the following stress files are missing from the ensemble:
 
         self.current_T = newT
 
-        # Check if the dynamical matrix has changed
-        changed_dyn = np.max([np.max(np.abs(self.current_dyn.dynmats[i] - new_dynamical_matrix.dynmats[i])) for i in range(len(self.current_dyn.q_tot))])
-        changed_dyn = changed_dyn > 1e-30
-
         # Check if the structure has changed
         changed_struct = np.max(np.abs(self.current_dyn.structure.coords - new_dynamical_matrix.structure.coords)) > 1e-10
 
@@ -1672,23 +2152,12 @@ Error, the following stress files are missing from the ensemble:
         u_disp_fourier_new = self.u_disps_qspace
         u_disp_fourier_old = self.u_disps_original_qspace
 
-        if changed_dyn:
-            if timer:
-                w_new, pols, wqn, polsqn = timer.execute_timed_function(new_dynamical_matrix.DiagonalizeSupercell, return_qmodes=True)
-            else:
-                w_new, pols, wqn, polsqn = new_dynamical_matrix.DiagonalizeSupercell(return_qmodes=True)#new_super_dyn.DyagDinQ(0)
-            self.current_w = w_new.copy()
-            self.current_pols = pols.copy()
-            self.w_q_current = wqn.copy()
-            self.pols_q_current = polsqn.copy()
-        else:
-            w_new = self.current_w.copy()
-            pols  = self.current_pols.copy()
-            wqn = self.w_q_current.copy()
-            polsqn = self.pols_q_current.copy()
-            #w_new, pols = new_dynamical_matrix.DiagonalizeSupercell()#new_super_dyn.DyagDinQ(0)
-            #self.current_w = w_new.copy()
-            #self.current_pols = pols.copy()
+        # Diagonalize (only if the dynamical matrix changed since the last call)
+        w_new, pols, wqn, polsqn, trans_mask = self.get_supercell_modes(new_dynamical_matrix, timer)
+        self.current_w = w_new.copy()
+        self.current_pols = pols.copy()
+        self.w_q_current = wqn.copy()
+        self.pols_q_current = polsqn.copy()
 
 
         # Get the dynq matrix in the correct format for the julia call
@@ -1731,11 +2200,8 @@ Error, the following stress files are missing from the ensemble:
         w_original = self.w_0.copy()
         pols_original = self.pols_0.copy()
 
-        # Exclude translations
-        if not self.ignore_small_w:
-            trans_original = CC.Methods.get_translations(pols_original, super_struct0.get_masses_array())
-        else:
-            trans_original = np.abs(w_original) < CC.Phonons.__EPSILON_W__
+        # Exclude translations (already identified when dyn_0 was diagonalized)
+        trans_original = self.get_supercell_modes(self.dyn_0)[-1]
 
         w = w_original[~trans_original]
 
@@ -1746,13 +2212,7 @@ Error, the following stress files are missing from the ensemble:
         old_a = self.w_to_a(w, self.T0)
 
         # Now do the same for the new dynamical matrix
-        #new_super_dyn = new_dynamical_matrix.GenerateSupercellDyn(self.supercell)
-
-
-        if not self.ignore_small_w:
-            trans_mask = CC.Methods.get_translations(pols, super_structure.get_masses_array())
-        else:
-            trans_mask = np.abs(w_new) < CC.Phonons.__EPSILON_W__
+        # (the translations have already been identified by get_supercell_modes)
 
 
         # Check if the new dynamical matrix satisfies the sum rule
@@ -1855,6 +2315,8 @@ DETAILS OF ERROR:
         #norm = np.sqrt(np.abs(np.linalg.det(ups_new) / np.linalg.det(ups_old)))
         t2 = time.time()
         self.rho = np.prod( old_a / new_a) * np.exp(-0.5 * (uYu_new - uYu_old) )
+        if self.mis_log_denominator is not None:
+            self.rho *= np.exp(-self.mis_log_denominator)
         t3 = time.time()
 
         if timer:
@@ -1906,10 +2368,6 @@ DETAILS OF ERROR:
 
         self.current_T = newT
 
-        # Check if the dynamical matrix has changed
-        changed_dyn = np.max([np.max(np.abs(self.current_dyn.dynmats[i] - new_dynamical_matrix.dynmats[i])) for i in range(len(self.current_dyn.q_tot))])
-        changed_dyn = changed_dyn > 1e-30
-
         # Prepare the new displacements
         super_struct0 = self.dyn_0.structure.generate_supercell(self.supercell)
         super_structure = new_dynamical_matrix.structure.generate_supercell(self.supercell)
@@ -1921,23 +2379,12 @@ DETAILS OF ERROR:
 
 
 
-        if changed_dyn:
-            if timer:
-                w_new, pols, wqn, polsqn = timer.execute_timed_function(new_dynamical_matrix.DiagonalizeSupercell, return_qmodes=True)
-            else:
-                w_new, pols, wqn, polsqn = new_dynamical_matrix.DiagonalizeSupercell(return_qmodes=True)#new_super_dyn.DyagDinQ(0)
-            self.current_w = w_new.copy()
-            self.current_pols = pols.copy()
-            self.w_q_current = wqn.copy()
-            self.pols_q_current = polsqn.copy()
-        else:
-            w_new = self.current_w.copy()
-            pols  = self.current_pols.copy()
-            wqn = self.w_q_current.copy()
-            polsqn = self.pols_q_current.copy()
-            #w_new, pols = new_dynamical_matrix.DiagonalizeSupercell()#new_super_dyn.DyagDinQ(0)
-            #self.current_w = w_new.copy()
-            #self.current_pols = pols.copy()
+        # Diagonalize (only if the dynamical matrix changed since the last call)
+        w_new, pols, wqn, polsqn, trans_mask = self.get_supercell_modes(new_dynamical_matrix, timer)
+        self.current_w = w_new.copy()
+        self.current_pols = pols.copy()
+        self.w_q_current = wqn.copy()
+        self.pols_q_current = polsqn.copy()
         # Update sscha energies and forces
         if timer:
             self.sscha_energies[:], self.sscha_forces[:,:,:] = timer.execute_timed_function(new_dynamical_matrix.get_energy_forces,
@@ -1953,11 +2400,8 @@ DETAILS OF ERROR:
         w_original = self.w_0.copy()
         pols_original = self.pols_0.copy()
 
-        # Exclude translations
-        if not self.ignore_small_w:
-            trans_original = CC.Methods.get_translations(pols_original, super_struct0.get_masses_array())
-        else:
-            trans_original = np.abs(w_original) < CC.Phonons.__EPSILON_W__
+        # Exclude translations (already identified when dyn_0 was diagonalized)
+        trans_original = self.get_supercell_modes(self.dyn_0)[-1]
 
         w = w_original[~trans_original]
 
@@ -1968,13 +2412,7 @@ DETAILS OF ERROR:
         old_a = self.w_to_a(w, self.T0)
 
         # Now do the same for the new dynamical matrix
-        #new_super_dyn = new_dynamical_matrix.GenerateSupercellDyn(self.supercell)
-
-
-        if not self.ignore_small_w:
-            trans_mask = CC.Methods.get_translations(pols, super_structure.get_masses_array())
-        else:
-            trans_mask = np.abs(w_new) < CC.Phonons.__EPSILON_W__
+        # (the translations have already been identified by get_supercell_modes)
 
 
         # Check if the new dynamical matrix satisfies the sum rule
@@ -2065,6 +2503,8 @@ DETAILS OF ERROR:
             rho_tmp[i] *= np.exp(-0.5 * (v_new - v_old) )
         # Lets try to use this one
         self.rho = rho_tmp
+        if self.mis_log_denominator is not None:
+            self.rho *= np.exp(-self.mis_log_denominator)
 
 
 
@@ -2117,6 +2557,142 @@ DETAILS OF ERROR:
 
 
 
+    def get_log_density_ratio(self, dyn, T, timer = None):
+        """
+        Get the log of the ratio between the probability of each configuration
+        sampled with the given dynamical matrix and temperature, and with dyn_0 at T0.
+        This is the log of the weight computed by update_weights, without updating the ensemble.
+
+        Parameters
+        ----------
+            dyn : CC.Phonons.Phonons
+                The dynamical matrix
+            T : float
+                The temperature
+
+        Results
+        -------
+            log_ratio : ndarray(size = N)
+                log(P_dyn,T(x) / P_0(x)) for each configuration
+        """
+
+        Nat_sc = self.supercell_structure_original.N_atoms
+        xats = np.asarray(self.xats, dtype = np.float64).reshape((self.N, 3*Nat_sc))
+
+        log_ratio = np.zeros(self.N, dtype = np.float64)
+        n_modes = []
+        for k, (d, temp) in enumerate([(dyn, T), (self.dyn_0, self.T0)]):
+            w, pols, _, _, trans = self.get_supercell_modes(d, timer)
+            n_modes.append(np.sum((~trans).astype(int)))
+
+            a = self.w_to_a(np.array(w[~trans] / 2, dtype = np.float64), temp)
+            ups = np.real(d.GetUpsilonMatrix(temp, w_pols = (w, pols)))
+
+            super_structure = d.structure.generate_supercell(self.supercell)
+            u = xats - super_structure.coords.ravel()
+            uYu = np.sum(u.dot(ups) * u, axis = 1) * __A_TO_BOHR__**2
+
+            sign = 1 - 2*k
+            log_ratio -= sign * (np.sum(np.log(a)) + 0.5 * uYu)
+
+        if n_modes[0] != n_modes[1]:
+            ERR_MSG = """
+Error, the dynamical matrices have a different number of translational modes.
+       Cannot compare the probability distributions.
+"""
+            print(ERR_MSG)
+            raise ValueError(ERR_MSG)
+
+        return log_ratio
+
+
+    def recycle_populations(self, ensembles, timer = None):
+        """
+        CROSS-POPULATION RECYCLING
+        ==========================
+
+        Add to this ensemble the configurations of previous populations,
+        generated by different dynamical matrices (or temperatures).
+
+        The weights of all the configurations are computed with the
+        balance heuristic of the multiple importance sampling:
+
+        .. math::
+
+            \\rho(x) = \\frac{P(x)}{\\sum_k \\frac{N_k}{N} P_k(x)}
+
+        where :math:`P_k` is the distribution of the k-th population, with :math:`N_k` configurations.
+        The weights are updated accordingly by update_weights, so the averages and the
+        effective sample size (get_effective_sample_size) account for all the populations.
+
+        Parameters
+        ----------
+            ensembles : list of Ensemble
+                The previous populations (already computed) to be recycled.
+                The original ensembles are not modified.
+
+        Results
+        -------
+            kl : float
+                The combined effective sample size on the current dynamical matrix.
+        """
+
+        if self.mis_log_denominator is not None:
+            raise ValueError("Error, this ensemble already recycles other populations.")
+
+        components = [(self.dyn_0, self.T0, self.N)]
+        for ens in ensembles:
+            if ens.units != self.units:
+                raise ValueError("Error, the ensembles to be recycled must have the same units.")
+            if ens.xats.shape[1:] != self.xats.shape[1:]:
+                raise ValueError("Error, the ensembles to be recycled must have the same supercell.")
+            components.append((ens.dyn_0, ens.T0, ens.N))
+
+        has_stress = self.has_stress
+        for ens in ensembles:
+            has_stress = has_stress and ens.has_stress
+
+            self.N += ens.N
+            self.forces = np.concatenate( (self.forces, ens.forces.astype(self.forces.dtype)), axis = 0)
+            self.stresses = np.concatenate( (self.stresses, ens.stresses), axis = 0)
+            self.structures += ens.structures
+            self.u_disps = np.concatenate((self.u_disps, ens.u_disps.astype(self.u_disps.dtype)), axis = 0)
+            self.xats = np.concatenate((self.xats, ens.xats.astype(self.xats.dtype)), axis = 0)
+            self.energies = np.concatenate( (self.energies, ens.energies))
+
+            self.stress_computed = np.concatenate( (self.stress_computed, ens.stress_computed))
+            self.force_computed = np.concatenate( (self.force_computed, ens.force_computed))
+            self.all_properties += ens.all_properties
+
+            self.sscha_forces = np.concatenate( (self.sscha_forces, ens.sscha_forces.astype(self.sscha_forces.dtype)), axis = 0)
+            self.sscha_energies = np.concatenate( (self.sscha_energies, ens.sscha_energies))
+            self.rho = np.concatenate( (self.rho, ens.rho))
+        self.has_stress = has_stress
+
+        # The balance heuristic denominator (in log scale, with respect to dyn_0)
+        log_terms = np.zeros((len(components), self.N), dtype = np.float64)
+        for k, (dyn, T, N_k) in enumerate(components):
+            log_terms[k, :] = np.log(N_k / np.float64(self.N))
+            if k > 0:
+                log_terms[k, :] += self.get_log_density_ratio(dyn, T, timer)
+
+        max_terms = np.max(log_terms, axis = 0)
+        self.mis_log_denominator = max_terms + np.log(np.sum(np.exp(log_terms - max_terms), axis = 0))
+
+        # Init the forces once more and update the weights
+        self.init()
+        self.update_weights(self.current_dyn, self.current_T, timer = timer)
+
+        kl = self.get_effective_sample_size()
+        print()
+        print("Recycled {} populations: {} configurations".format(len(components), self.N))
+        print("Configurations per population: {}".format(" ".join(["%d" % x[2] for x in components])))
+        print("Combined effective sample size: {:.1f}".format(kl))
+        print()
+
+        return kl
+
+
     def get_effective_sample_size(self):
         """
         Get the Kong-Liu effective sample size with the given importance sampling.
@@ -2227,7 +2803,7 @@ DETAILS OF ERROR:
                 then it returns the forces that acts on the unit cell atoms only.
         """
 
-        eforces = self.forces - self.sscha_forces
+        eforces = self.apply_symmetry_kernel(np.subtract(self.forces, self.sscha_forces, dtype = np.float64))
 
         if in_unit_cell and not np.prod(self.supercell) == 1:
             # Refold the forces in the unit cell
@@ -2711,16 +3287,8 @@ Error while loading the julia module.
         super_struct = self.current_dyn.structure.generate_supercell(self.supercell)
         #supercell_dyn = self.current_dyn.GenerateSupercellDyn(self.supercell)
 
-        # Dyagonalize
-        if timer:
-            w, pols = timer.execute_timed_function(self.current_dyn.DiagonalizeSupercell)
-        else:
-            w, pols = self.current_dyn.DiagonalizeSupercell()#supercell_dyn.DyagDinQ(0)
-
-        if not self.ignore_small_w:
-            trans = CC.Methods.get_translations(pols, super_struct.get_masses_array())
-        else:
-            trans = np.abs(w) < CC.Phonons.__EPSILON_W__
+        # Dyagonalize (the result is cached while the dynamical matrix does not change)
+        w, pols, _, _, trans = self.get_supercell_modes(self.current_dyn, timer)
 
         ityp = super_struct.get_ityp() + 1 # Py to fortran convertion
         mass = np.array(list(super_struct.masses.values()))
@@ -2728,11 +3296,10 @@ Error while loading the julia module.
         log_err = "err_yesrho"
 
         mass *= 2
-        w /= 2
+        w = w / 2
 
         nat = super_struct.N_atoms
         eforces = np.zeros((self.N, nat, 3), dtype = np.float64, order = "F")
-        u_disp = np.zeros((self.N, nat, 3), dtype = np.float64, order = "F")
 
         t1 = time.time()
         #print nat
@@ -2740,8 +3307,7 @@ Error while loading the julia module.
             eforces[:,:,:] = self.forces - self.sscha_forces
         else:
             eforces[:,:,:] = self.forces
-        for i in range(self.N):
-            u_disp[i, :, :] = np.reshape(self.u_disps[i,:], (nat, 3))
+        u_disp = _get_fortran_vectors(self.u_disps, nat)
 
 
         # TODO: This may be dangerous
@@ -2775,6 +3341,8 @@ Error while loading the julia module.
                                                                      self.current_T, mass, ityp, log_err, self.N,
                                                                      nat, 3*nat, len(mass))
 
+        # Average over the symmetries (if the ensemble has been unwrapped)
+        grad = self.apply_symmetry_kernel(grad)
 
         # If we are at gamma, we can skip this part
         # Which makes the code faster
@@ -2955,35 +3523,16 @@ Error while loading the julia module.
         # Get frequencies and polarization vectors
         super_structure = self.current_dyn.structure.generate_supercell(self.supercell)
         #super_dyn = self.current_dyn.GenerateSupercellDyn(self.supercell)
-        wr, pols = self.current_dyn.DiagonalizeSupercell()
-
-        if not self.ignore_small_w:
-            trans = ~ CC.Methods.get_translations(pols, super_structure.get_masses_array())
-        else:
-            trans = np.abs(wr) > CC.Phonons.__EPSILON_W__
-
-        wr = np.real( wr[trans])
-        pols = np.real( pols[:, trans])
+        # (already in the correct shape for fortran, without translations)
+        wr, er = self.get_fortran_modes(self.current_dyn, exclude_translations = True)
 
         nat = super_structure.N_atoms
 
         # Volume bohr^3
         volume = super_structure.get_volume() * __A_TO_BOHR__**3
 
-
-        # Get the correctly shaped polarization vectors
-        er = np.zeros( (nat, len(wr), 3), dtype = np.float64, order = "F")
-
-        for i in range(len(wr)):
-            for j in range(nat):
-                er[j, i, 0] = pols[3*j, i]
-                er[j, i, 1] = pols[3*j+1, i]
-                er[j, i, 2] = pols[3*j+2, i]
-
         # Prepare the displacement in fortran order
-        u_disps = np.zeros((self.N, nat, 3), dtype = np.float64, order = "F")
-        for i in range(self.N):
-            u_disps[i,:,:] = np.reshape(self.u_disps[i,:], (nat, 3))
+        u_disps = _get_fortran_vectors(self.u_disps, nat)
 
         abinit_stress = np.einsum("abc -> cba", self.stresses, order = "F")
 
@@ -3651,6 +4200,16 @@ Error while loading the julia module.
         # """
         #         raise NotImplementedError(ERROR_MSG)
 
+        # Get the modes of the current dynamical matrix before the unit conversion
+        # so that the diagonalization cached by the minimization is reused.
+        # The polarization vectors do not depend on the units, while w_Ha = w_Ry / 2
+        trans = None
+        new_pol = None
+        if w_pols is None and self.units == UNITS_DEFAULT:
+            w, pols, _, _, trans = self.get_supercell_modes(self.current_dyn, timer)
+            new_pol = self.get_fortran_modes(self.current_dyn)[1]
+            w = w / 2
+
         # Convert anything into the Ha units
         # This is needed for the Fortran subroutines
         self.convert_units(UNITS_HARTREE)
@@ -3658,13 +4217,13 @@ Error while loading the julia module.
         # Get the dynamical matrix in the supercell
         #dyn_supercell = self.current_dyn.GenerateSupercellDyn(self.supercell)
         super_structure = self.current_dyn.structure.generate_supercell(self.supercell)
-        if w_pols is None:
+        if w_pols is not None:
+            w, pols = w_pols
+        elif trans is None:
             if timer:
                 w, pols = timer.execute_timed_function(self.current_dyn.DiagonalizeSupercell)
             else:
                 w, pols = self.current_dyn.DiagonalizeSupercell()
-        else:
-            w, pols = w_pols
 
         a = self.w_to_a(w, self.current_T)
 
@@ -3673,17 +4232,16 @@ Error while loading the julia module.
         nat_sc = int(np.shape(pols)[0] / 3)
 
         # Get the polarization vectors in the correct format
-        new_pol = np.zeros( (nat_sc, n_modes, 3), dtype = np.double)
-        for i in range(nat_sc):
-            for j in range(n_modes):
-                new_pol[i, j, :] = pols[3*i : 3*(i+1), j]
+        if new_pol is None:
+            new_pol = _get_fortran_pols(np.real(pols))
 
 
         # Get the translational modes
-        if not self.ignore_small_w:
-            trans = CC.Methods.get_translations(pols, super_structure.get_masses_array())
-        else:
-            trans = np.abs(w) < CC.Phonons.__EPSILON_W__
+        if trans is None:
+            if not self.ignore_small_w:
+                trans = CC.Methods.get_translations(pols, super_structure.get_masses_array())
+            else:
+                trans = np.abs(w) < CC.Phonons.__EPSILON_W__
 
 
         # Get the atomic types
@@ -3714,6 +4272,10 @@ Error while loading the julia module.
         if verbose:
             print("Outside d3")
 
+        # Average over the symmetries (if the ensemble has been unwrapped)
+        if self.symmetry_kernel is not None:
+            d3[:,:,:] = self.apply_symmetry_kernel(d3)
+
 
         # Symmetrize the d3
         if use_symmetries:
@@ -3747,6 +4309,9 @@ Error while loading the julia module.
             t2 = time.time()
             print("Time elapsed to compute the v4: {} s".format(t2-t1))
 
+            if self.symmetry_kernel is not None:
+                d4[:,:,:,:] = self.apply_symmetry_kernel(d4)
+
             # Symmetrize the v4
             if use_symmetries:
                 if timer:
@@ -3819,6 +4384,217 @@ Error while loading the julia module.
 
 
 
+    def get_free_energy_hessian_at_q(self, q_list, include_v4 = False, get_full_hessian = True,
+                                     use_symmetries = True, tol = 1e-8, max_iter = 1000, verbose = False,
+                                     timer = None):
+        """
+        GET THE FREE ENERGY HESSIAN AT SELECTED Q POINTS
+        ================================================
+
+        Compute the static free energy hessian (odd correction) only at the requested q points.
+        Unlike get_free_energy_hessian, neither the d3 nor the d4 tensors are built.
+        The odd correction
+
+        .. math::
+
+            \\Phi^{(odd)} = \\Phi^{(3)} \\Lambda \\left(1 - \\Phi^{(4)}\\Lambda\\right)^{-1} \\Phi^{(3)}
+
+        is applied directly to the Bloch vectors of each q point,
+        computing the products with the d3 and d4 as averages on the ensemble.
+        If the v4 is included, the inversion is performed with an iterative (GMRES) solver.
+        The cost scales as the number of requested q times N * n_modes^2.
+
+        The q points must belong to the q grid of the dynamical matrix.
+
+        If the ensemble has a symmetry_kernel (see _unwrap_symmetries_), the averages
+        run also on the symmetric images of the configurations, as in get_free_energy_hessian.
+        The images are generated one at a time, so the memory does not scale with the number of symmetries.
+        With use_symmetries, the hessian of each q point is then symmetrized with the small group of q.
+
+        Parameters
+        ----------
+            q_list : list of ndarray(size = 3)
+                The q points (in the same units of the q_tot of the dynamical matrix)
+            include_v4 : bool
+                If True, the fourth order force constants are included.
+            get_full_hessian : bool
+                If True the full hessian is returned,
+                otherwise only the odd correction.
+            use_symmetries : bool
+                If True, the hessian at each q is symmetrized in q space.
+                If the ensemble has a symmetry_kernel (see _unwrap_symmetries_), it is always applied.
+            tol : float
+                The relative tolerance of the iterative solver (only with include_v4).
+            max_iter : int
+                The maximum number of iterations of the iterative solver.
+            verbose : bool
+                If True, print info on the convergence of the solver.
+            timer : Timer, optional
+                If given, the diagonalization is timed.
+
+        Results
+        -------
+            hessians : list of ndarray(size = (3*nat, 3*nat), dtype = np.complex128)
+                The free energy hessian for each q point in q_list [Ry/bohr^2]
+        """
+
+        if self.units != UNITS_DEFAULT:
+            raise ValueError("Error, get_free_energy_hessian_at_q requires the ensemble in the default units")
+
+        # Identify the q points in the grid
+        q_tot = np.array(self.current_dyn.q_tot)
+        iq_list = []
+        for q in q_list:
+            dist = np.linalg.norm(q_tot - np.array(q)[np.newaxis, :], axis = 1)
+            if np.min(dist) > 1e-6:
+                ERROR_MSG = """
+Error, the q point {} does not belong to the q grid of the dynamical matrix.
+       The hessian can be computed only on the q points commensurate with the supercell.
+""".format(q)
+                print(ERROR_MSG)
+                raise ValueError(ERROR_MSG)
+            iq_list.append(np.argmin(dist))
+
+        t1 = time.time()
+
+        # Get the modes (from the cache) and convert them in Ha
+        w, pols, _, _, trans = self.get_supercell_modes(self.current_dyn, timer)
+        w = np.real(w[~trans]) / 2
+        pols = np.real(pols[:, ~trans])
+
+        self.convert_units(UNITS_HARTREE)
+
+        super_structure = self.current_dyn.structure.generate_supercell(self.supercell)
+        nat_sc = super_structure.N_atoms
+        nat = self.current_dyn.structure.N_atoms
+        nq = len(self.current_dyn.q_tot)
+        sqrt_m = np.repeat(np.sqrt(super_structure.get_masses_array()), 3)
+        a = self.w_to_a(w, self.current_T)
+
+        # The displacements and the forces in the normalized mode basis
+        # q_modes = E u   (the Upsilon u in the mode basis)
+        # p_modes = L f
+        u = self.u_disps.reshape((self.N, 3*nat_sc)).copy()
+        f = (self.forces - self.sscha_forces).reshape((self.N, 3*nat_sc))
+        q_modes = (u * sqrt_m[np.newaxis, :]).dot(pols) / a[np.newaxis, :]
+        p_modes = (f / sqrt_m[np.newaxis, :]).dot(pols) * a[np.newaxis, :]
+
+        # The symmetric images of the configurations (symmetry_kernel)
+        # are generated one at a time when the averages are computed
+        images = [None]
+        if self.symmetry_kernel is not None:
+            rotations, irts = self.symmetry_kernel
+            images = []
+            for i in range(irts.shape[0]):
+                inv_irt = np.zeros(nat_sc, dtype = int)
+                inv_irt[irts[i, :]] = np.arange(nat_sc)
+                images.append((rotations[i, :, :], inv_irt))
+        weights = self.rho / (np.sum(self.rho) * len(images))
+
+        def get_image(image):
+            # q_modes, p_modes and forces of the symmetric image of the configurations
+            if image is None:
+                return q_modes, p_modes, f
+            rot, inv_irt = image
+            u_s = u.reshape((self.N, nat_sc, 3)).dot(rot)[:, inv_irt, :].reshape((self.N, 3*nat_sc))
+            f_s = f.reshape((self.N, nat_sc, 3)).dot(rot)[:, inv_irt, :].reshape((self.N, 3*nat_sc))
+            return (u_s * sqrt_m[np.newaxis, :]).dot(pols) / a[np.newaxis, :], \
+                (f_s / sqrt_m[np.newaxis, :]).dot(pols) * a[np.newaxis, :], f_s
+
+        # The Bloch phases exp(-2 pi i q R)
+        q_grid = q_tot[iq_list, :] / __A_TO_BOHR__
+        phases = np.exp(-2j * np.pi * q_grid.dot(self.r_lat.T)) / np.sqrt(nq)
+
+        self.convert_units(UNITS_DEFAULT)
+
+        # The static Lambda tensor in the mode basis
+        lambda_static = 0.5 * _get_static_g(w, a, self.current_T)
+        n_modes = len(w)
+
+        itau = self.itau - 1
+
+        t2 = time.time()
+        if timer:
+            timer.add_timer("Preparation of the static hessian", t2 - t1)
+
+        def apply_v3_t(v):
+            # V3^T v => (n_modes, n_modes) matrix
+            res = np.zeros((n_modes, n_modes), dtype = np.complex128)
+            for image in images:
+                q_s, _, f_s = get_image(image)
+                wfv = weights * f_s.dot(v)
+                res -= np.einsum("c, ca, cb -> ab", wfv, q_s, q_s)
+                res += np.sum(wfv) * np.eye(n_modes)
+            return res
+
+        def apply_v3(z):
+            # V3 z => vector in the supercell
+            res = np.zeros(3*nat_sc, dtype = np.complex128)
+            for image in images:
+                q_s, _, f_s = get_image(image)
+                s = np.trace(z) - np.einsum("ca, ab, cb -> c", q_s, z, q_s)
+                res += f_s.T.dot(weights * s)
+            return res
+
+        def apply_v4(y):
+            # V4 y => (n_modes, n_modes) matrix
+            res = np.zeros((n_modes, n_modes), dtype = np.complex128)
+            for image in images:
+                q_s, p_s, _ = get_image(image)
+                t = np.einsum("ca, ab, cb -> c", q_s, y, p_s)
+                res -= np.einsum("c, ca, cb -> ab", weights * t, q_s, q_s)
+            return res
+
+        def matvec(x):
+            x = x.reshape((n_modes, n_modes))
+            return (x - apply_v4(lambda_static * x)).ravel()
+
+        A_op = scipy.sparse.linalg.LinearOperator((n_modes**2, n_modes**2), matvec = matvec, dtype = np.complex128)
+
+        if use_symmetries:
+            qe_sym = CC.symmetries.QE_Symmetry(self.current_dyn.structure)
+
+        hessians = []
+        for i, iq in enumerate(iq_list):
+            # The Bloch vectors in the supercell
+            bloch = np.zeros((3*nat_sc, 3*nat), dtype = np.complex128)
+            for k in range(3):
+                bloch[3*np.arange(nat_sc) + k, 3*itau + k] = phases[i, :]
+
+            odd_bloch = np.zeros((3*nat_sc, 3*nat), dtype = np.complex128)
+            for j in range(3*nat):
+                x = apply_v3_t(bloch[:, j])
+
+                if include_v4:
+                    x, info = _gmres(A_op, x.ravel(), tol, max_iter)
+                    if info != 0:
+                        print("WARNING: the static hessian at q = {} did not converge (info = {})".format(q_list[i], info))
+                    x = x.reshape((n_modes, n_modes))
+
+                odd_bloch[:, j] = apply_v3(lambda_static * x)
+
+            # Project on the Bloch vectors and convert Ha/bohr^2 -> Ry/bohr^2
+            hessian = 2 * np.conj(bloch.T).dot(odd_bloch)
+
+            # Impose the symmetries of the small group of q
+            if use_symmetries:
+                qe_sym.SetupQPoint(q_tot[iq, :])
+                qe_sym.SymmetrizeDynQ(hessian, q_tot[iq, :])
+
+            if get_full_hessian:
+                hessian += self.current_dyn.dynmats[iq]
+            hessians.append(hessian)
+
+            if verbose:
+                print("Static hessian at q = {} computed.".format(q_list[i]))
+
+        t3 = time.time()
+        if timer:
+            timer.add_timer("Static hessian at q", t3 - t2)
+
+        return hessians
+
+
     def compute_ensemble(self, calculator, compute_stress = True, stress_numerical = False,
                          cluster = None, verbose = True, timer=None):
         """
@@ -3914,6 +4690,9 @@ Error while loading the julia module.
 
         self.rho = np.concatenate( (self.rho, other.rho))
 
+        # The recycled populations are not kept after a merge
+        self.mis_log_denominator = None
+
         # Init the forces once more
         self.init()
 
@@ -3945,7 +4724,9 @@ Error while loading the julia module.
         structs = [self.structures[x] for x in np.arange(len(split_mask))[split_mask]]
 
         N = np.sum(split_mask.astype(int))
-        ens = Ensemble(self.dyn_0, self.T0, self.dyn_0.GetSupercell())
+        # Share the diagonalization cache, the modes of dyn_0 and current_dyn are already there
+        ens = Ensemble(self.dyn_0, self.T0, self.dyn_0.GetSupercell(), modes_cache = self.modes_cache,
+                       single_precision = self.single_precision)
         ens.init_from_structures(structs)
 
 
@@ -3955,8 +4736,11 @@ Error while loading the julia module.
         ens.forces[:, :, :] = self.forces[split_mask, :, :]
         ens.has_stress = self.has_stress
         ens.ignore_small_w = self.ignore_small_w
+        ens.symmetry_kernel = self.symmetry_kernel
         if self.has_stress:
             ens.stresses[:, :, :] = self.stresses[split_mask, :, :]
+        if self.mis_log_denominator is not None:
+            ens.mis_log_denominator = self.mis_log_denominator[split_mask]
 
         ens.update_weights(self.current_dyn, self.current_T)
 
@@ -3965,6 +4749,43 @@ Error while loading the julia module.
         return ens
 
 
+    def get_shared_view(self):
+        """
+        SHARE THE CONFIGURATIONS
+        ========================
+
+        Get an ensemble that shares the configurations of this one (positions, energies,
+        forces, stresses and structures) without copying them.
+        The view has its own weights, dynamical matrices (dyn_0 and current_dyn), displacements,
+        sscha energies and forces and diagonalization cache,
+        so it can be reweighted (update_weights) on another dynamical matrix or temperature
+        without affecting this ensemble.
+
+        NOTE: the shared configurations must not be modified (e.g. by merge or remove_noncomputed)
+        while the view is used.
+
+        Results
+        -------
+            view : Ensemble()
+                The ensemble sharing the configurations.
+        """
+
+        view = copy.copy(self)
+        view.modes_cache = {}
+        view.modes_cache_pinned = None
+        view.dyn_0 = self.dyn_0.Copy()
+        view.current_dyn = self.current_dyn.Copy()
+
+        # The state of the importance sampling
+        for name in ["rho", "u_disps", "u_disps_qspace", "sscha_energies", "sscha_forces", "sscha_forces_qspace",
+                     "current_w", "current_pols", "w_q_current", "pols_q_current"]:
+            value = getattr(self, name)
+            if value is not None:
+                setattr(view, name, np.copy(value))
+
+        return view
+
+
     def remove_noncomputed(self):
         """
         Removed all the incomplete calculation from the ensemble.
@@ -3991,6 +4812,8 @@ Error while loading the julia module.
 
 
         self.rho = self.rho[good_mask]
+        if self.mis_log_denominator is not None:
+            self.mis_log_denominator = self.mis_log_denominator[good_mask]
 
         # Check everything and update the weights
         self.update_weights(self.current_dyn, self.current_T)
@@ -4313,3 +5136,331 @@ def _wrapper_julia_vector_vector_fourier(*args, **kwargs):
 
     return julia.Main.multiply_vector_vector_fourier(*args,
             **kwargs)
+
+
+def _open_text_file(filename, mode, compression = None):
+    """
+    Open a text file for writing, optionally compressed ("gz", "bz2" or "xz").
+    """
+    if compression is None:
+        return open(filename, mode)
+    elif compression == "gz":
+        import gzip
+        return gzip.open(filename, mode + "t")
+    elif compression == "bz2":
+        import bz2
+        return bz2.open(filename, mode + "t")
+    elif compression == "xz":
+        import lzma
+        return lzma.open(filename, mode + "t")
+
+    raise ValueError("Error, unknown compression '{}'. Use one of None, 'gz', 'bz2', 'xz'".format(compression))
+
+def _write_enhanced_xyz(args):
+    """
+    Write a set of configurations in the enhanced xyz format (worker of save_enhanced_xyz).
+
+    The atomic lines of each configuration are formatted with a single
+    call, using a format string prepared once for each list of atoms.
+    """
+    filename, mode, compression, chunk_size, keys, atoms, xats, forces, energies, stresses, stress_computed, cells = args
+    energy_key, forces_key, stress_key = keys
+    n_configs = len(energies)
+
+    cell_fmt = " ".join(["{:20.16f}"] * 9)
+    atom_fmts = {}
+
+    with _open_text_file(filename, mode, compression) as fp:
+        for start in range(0, n_configs, chunk_size):
+            lines = []
+            for i in range(start, min(start + chunk_size, n_configs)):
+                nat = len(atoms[i])
+                key = tuple(atoms[i])
+                if not key in atom_fmts:
+                    atom_fmts[key] = "".join(["{}  ".format(x).replace("%", "%%") + " %20.16f %20.16f %20.16f    " + \
+                                              " %20.16f %20.16f %20.16f\n" for x in atoms[i]])
+
+                lines.append("{:d}\n".format(nat))
+
+                # Prepare the enriched line of xyz with the description of the structure
+                info = 'pbc="T T T" ' # Periodic boundary conditions
+                info += 'Lattice="' + cell_fmt.format(*cells[i]) + '" '
+                info += '{}={:.16f} '.format(energy_key, energies[i])
+
+                # Add the virial stress only if present
+                if stress_computed[i]:
+                    info += '{}="'.format(stress_key) + cell_fmt.format(*stresses[i]) + '" '
+
+                info += 'Properties=species:S:1:pos:R:3:{}:R:3\n'.format(forces_key)
+                lines.append(info)
+
+                # Append the structure and the forces
+                data = np.concatenate((xats[i, :, :], forces[i, :, :]), axis = 1)
+                lines.append(atom_fmts[key] % tuple(data.ravel()))
+
+            fp.write("".join(lines))
+
+def _write_raw_array(filename, data, chunk_size = 1000):
+    """
+    Write a 2D array as a text file (as np.savetxt with the default format),
+    formatting chunk_size rows at once.
+    """
+    n_rows, n_cols = data.shape
+    row_fmt = " ".join(["%.18e"] * n_cols) + "\n"
+    with open(filename, "w") as fp:
+        for start in range(0, n_rows, chunk_size):
+            block = data[start : start + chunk_size, :]
+            fp.write((row_fmt * block.shape[0]) % tuple(block.ravel()))
+
+def _parse_calculator_output(args):
+    """
+    Parse one output file of the calculator (worker of load_from_calculator_output).
+
+    Parameters
+    ----------
+        - args : tuple
+            (filename, fast_qe_parser, masses, atoms).
+            atoms are the labels of the atomic types of the supercell of dyn_0:
+            the species read from the file (like Fe1 from pw.x, or Fe from ASE)
+            are mapped on them, atom by atom.
+
+    Returns
+    -------
+        - result : dict
+            The structure, energy [Ry], forces [Ry/A], stress [Ry/bohr^3] (or None),
+            the time spent, if the fast parser has been used and the error (None if no error).
+    """
+    filename, fast_qe_parser, masses, atoms = args
+    t1 = time.time()
+    result = {"structure" : None, "energy" : None, "forces" : None, "stress" : None,
+              "time" : 0, "fast" : False, "error" : None}
+
+    try:
+        parsed = None
+        if fast_qe_parser:
+            try:
+                parsed = _read_qe_output(filename)
+                result["fast"] = True
+            except Exception:
+                parsed = None
+
+        if parsed is None:
+            ase_struct = ase.io.read(filename)
+            stress = None
+            try:
+                # eV/A^3 -> Ry/bohr^3
+                stress = - ase_struct.get_stress(voigt=False) / (Rydberg / Bohr**3)
+            except:
+                pass
+            parsed = {"symbols" : ase_struct.get_chemical_symbols(),
+                      "coords" : ase_struct.get_positions(),
+                      "cell" : ase_struct.get_cell()[:,:],
+                      "energy" : ase_struct.get_potential_energy() / Rydberg,
+                      "forces" : ase_struct.get_forces() / Rydberg,
+                      "stress" : stress}
+
+        # Map the species on the atomic types of dyn_0
+        if len(parsed["symbols"]) != len(atoms):
+            raise ValueError("Expected {} atoms, found {}".format(len(atoms), len(parsed["symbols"])))
+        for x, y in zip(parsed["symbols"], atoms):
+            if x != y and _get_element(x) != _get_element(y):
+                raise ValueError("The species {} does not match the atomic type {} of the dynamical matrix".format(x, y))
+
+        structure = CC.Structure.Structure(len(atoms))
+        structure.atoms = list(atoms)
+        structure.coords = np.array(parsed["coords"], dtype = np.float64)
+        structure.unit_cell = np.array(parsed["cell"], dtype = np.float64)
+        structure.has_unit_cell = True
+        structure.masses = {x : masses[x] for x in masses if x in structure.atoms}
+
+        result["structure"] = structure
+        result["energy"] = parsed["energy"]
+        result["forces"] = parsed["forces"]
+        result["stress"] = parsed["stress"]
+    except Exception as e:
+        result["error"] = "{}: {}".format(type(e).__name__, e)
+
+    result["time"] = time.time() - t1
+    return result
+
+def _get_element(label):
+    """
+    Get the chemical element from the label of an atomic type (e.g. Fe1 -> Fe)
+    """
+    element = ""
+    for c in label:
+        if not c.isalpha():
+            break
+        element += c
+    return element.capitalize()
+
+def _read_qe_output(filename):
+    """
+    Fast reader of the Quantum ESPRESSO (pw.x) output of a single scf calculation.
+
+    Only the last total energy, forces and stress are read,
+    the positions and the cell are those of the header.
+    An exception is raised if something is missing (the caller then uses ASE).
+
+    Returns
+    -------
+        - parsed : dict
+            symbols, coords [A], cell [A], energy [Ry], forces [Ry/A], stress [Ry/bohr^3] (or None)
+    """
+    with open(filename, "r") as fp:
+        lines = fp.readlines()
+
+    alat = None
+    cell = np.zeros((3,3), dtype = np.float64)
+    symbols = []
+    coords = []
+    energy = None
+    forces = None
+    stress = None
+    nat = None
+
+    i = 0
+    n_lines = len(lines)
+    while i < n_lines:
+        line = lines[i]
+        if "ATOMIC_POSITIONS" in line or "CELL_PARAMETERS" in line:
+            raise ValueError("The structure changes during the calculation")
+        elif "number of atoms/cell" in line:
+            nat = int(line.split("=")[-1])
+        elif "lattice parameter (alat)" in line:
+            alat = float(line.split("=")[-1].split()[0])
+        elif "crystal axes: (cart. coord. in units of alat)" in line:
+            for k in range(3):
+                data = lines[i + 1 + k].split("(")[-1].split(")")[0]
+                cell[k, :] = [float(x) for x in data.split()]
+            i += 3
+        elif "positions (alat units)" in line and nat is not None and len(symbols) == 0:
+            for k in range(nat):
+                data = lines[i + 1 + k]
+                symbols.append(data.split()[1])
+                coords.append([float(x) for x in data.split("(")[-1].split(")")[0].split()])
+            i += nat
+        elif line.startswith("!") and "total energy" in line:
+            energy = float(line.split("=")[-1].split()[0])
+        elif "Forces acting on atoms" in line and nat is not None:
+            forces = []
+            k = i + 1
+            while len(forces) < nat:
+                if "force =" in lines[k]:
+                    forces.append([float(x) for x in lines[k].split("=")[-1].split()])
+                k += 1
+            forces = np.array(forces, dtype = np.float64)
+            i = k - 1
+        elif "total   stress" in line:
+            stress = np.array([[float(x) for x in lines[i + 1 + k].split()[:3]] for k in range(3)], dtype = np.float64)
+            i += 3
+        i += 1
+
+    if alat is None or nat is None or len(symbols) != nat or energy is None or forces is None:
+        raise ValueError("Incomplete Quantum ESPRESSO output")
+
+    alat_A = alat / __A_TO_BOHR__
+    return {"symbols" : symbols,
+            "coords" : np.array(coords, dtype = np.float64) * alat_A,
+            "cell" : cell * alat_A,
+            "energy" : energy,
+            "forces" : forces * __A_TO_BOHR__, # Ry/bohr -> Ry/A
+            "stress" : stress}
+
+def _get_static_g(w, a, T):
+    """
+    Get the g matrix of the static Lambda tensor in the mode basis
+    (as the get_g subroutine of SCHAModules).
+
+    Parameters
+    ----------
+        - w : ndarray(n_modes)
+            The frequencies (without translations) [Ha]
+        - a : ndarray(n_modes)
+            The normal lengths (see w_to_a)
+        - T : float
+            The temperature [K]
+
+    Returns
+    -------
+        - g : ndarray(n_modes, n_modes)
+    """
+    if T == 0:
+        da = - np.sqrt(1.0 / (8.0 * w**3))
+    else:
+        beta = 315774.65221921849 / T
+        da = - (w * beta + np.sinh(w * beta)) * \
+            np.sqrt(1.0 / (32.0 * w**3 * np.sinh(0.5 * w * beta)**3 * np.cosh(0.5 * w * beta)))
+
+    diag = da / w / a**3
+
+    w_mu = w[:, np.newaxis]
+    w_nu = w[np.newaxis, :]
+    a_mu = a[:, np.newaxis]
+    a_nu = a[np.newaxis, :]
+
+    degenerate = np.abs((w_mu - w_nu) / w_nu) < 1e-5
+    with np.errstate(divide = "ignore", invalid = "ignore"):
+        g = (a_mu**2 - a_nu**2) / (w_mu**2 - w_nu**2) / (a_nu**2 * a_mu**2)
+    g[degenerate] = np.tile(diag[:, np.newaxis], (1, len(w)))[degenerate]
+    return g
+
+def _gmres(A, b, tol, max_iter):
+    """
+    Call the scipy GMRES with the tolerance keyword of the installed version.
+    """
+    try:
+        return scipy.sparse.linalg.gmres(A, b, rtol = tol, atol = 0, maxiter = max_iter)
+    except TypeError:
+        return scipy.sparse.linalg.gmres(A, b, tol = tol, atol = 0, maxiter = max_iter)
+
+def _get_fortran_pols(pols):
+    """
+    Convert the polarization vectors from the (3*nat, n_modes) python layout
+    into the (nat, n_modes, 3) layout of the SCHAModules subroutines.
+
+    The conversion is a single strided copy into a Fortran ordered buffer.
+    """
+    nat = pols.shape[0] // 3
+    n_modes = pols.shape[1]
+    return np.asfortranarray(pols.reshape((nat, 3, n_modes)).transpose((0, 2, 1)), dtype = np.float64)
+
+def _get_fortran_vectors(vectors, nat):
+    """
+    Convert a set of vectors (N, 3*nat) (e.g. the displacements)
+    into a Fortran ordered (N, nat, 3) buffer for the SCHAModules subroutines.
+    """
+    return np.asfortranarray(vectors.reshape((vectors.shape[0], nat, 3)), dtype = np.float64)
+
+def _get_dyn_hash(dyn, *extra):
+    """
+    Get a fingerprint of the content of the dynamical matrix
+    (force constants, q points, structure and supercell).
+    Two dynamical matrices with the same fingerprint have the same
+    supercell modes.
+
+    Parameters
+    ----------
+
+        - dyn : CC.Phonons.Phonons
+            The dynamical matrix
+        - extra :
+            Any additional parameter that affects the result (hashed by its repr)
+
+    Returns
+    -------
+
+        - key : string
+            The hex digest of the fingerprint
+    """
+    sha = hashlib.sha1()
+    for i in range(len(dyn.q_tot)):
+        sha.update(np.ascontiguousarray(dyn.dynmats[i]).tobytes())
+    sha.update(np.ascontiguousarray(dyn.q_tot, dtype = np.double).tobytes())
+    sha.update(np.ascontiguousarray(dyn.structure.unit_cell, dtype = np.double).tobytes())
+    sha.update(np.ascontiguousarray(dyn.structure.coords, dtype = np.double).tobytes())
+    sha.update(repr(dyn.structure.atoms).encode())
+    sha.update(repr(sorted(dyn.structure.masses.items())).encode())
+    sha.update(repr(tuple(dyn.GetSupercell())).encode())
+    sha.update(repr(extra).encode())
+    return sha.hexdigest()
@@ -0,0 +1,357 @@
+# -*- coding: utf-8 -*-
+from __future__ import print_function
+
+"""
+This module contains an append-only store of the ensembles.
+
+All the populations of a relaxation are saved in the same directory,
+in a single binary file, indexed by population, generating dynamical matrix,
+temperature and computed flags.
+Each population can be loaded back selectively (also by weight threshold)
+without reading the others.
+"""
+import sys, os
+import json
+import numpy as np
+
+import cellconstructor as CC
+import cellconstructor.Phonons
+import cellconstructor.Settings
+
+import sscha, sscha.Ensemble
+import sscha.Parallel as Parallel
+from sscha.Parallel import pprint as print
+
+
+__STORE_INDEX__ = "index.json"
+__STORE_DATA__ = "data.bin"
+__STORE_DYN__ = "dyn_gen_%d_"
+__STORE_VERSION__ = 1
+
+# The arrays saved for each population
+__STORE_ARRAYS__ = ["energies", "forces", "xats", "stresses", "force_computed", "stress_computed"]
+
+
+class EnsembleStore(object):
+
+    def __init__(self, store_dir):
+        """
+        APPEND-ONLY ENSEMBLE STORE
+        ==========================
+
+        The store is a directory containing:
+            - data.bin : the raw arrays of all the populations, appended one after the other
+            - index.json : one json record per line for each population
+              (offsets of the arrays, temperature, id of the generating dynamical matrix)
+            - dyn_gen_<id>_* : the generating dynamical matrices.
+              Populations generated by the same dynamical matrix share the same file.
+
+        A record is added to the index only after its arrays have been written,
+        so an interrupted append never corrupts the store.
+        If a population is appended twice, the last record is used.
+
+        Parameters
+        ----------
+            store_dir : string
+                The path to the directory of the store. It is created if it does not exist.
+        """
+
+        self.store_dir = store_dir
+        self.records = []
+        self.dyn_ids = {}
+
+        if os.path.exists(store_dir) and not os.path.isdir(store_dir):
+            ERR_MSG = """
+Error, the specified location of the ensemble store:
+       '{}'
+       already exists and it is not a directory.
+""".format(store_dir)
+            print(ERR_MSG)
+            raise IOError(ERR_MSG)
+
+        self.read_index()
+
+
+    def read_index(self):
+        """
+        Read (again) the index of the store from the disk.
+        """
+        self.records = []
+        self.dyn_ids = {}
+
+        index_file = os.path.join(self.store_dir, __STORE_INDEX__)
+        if not os.path.exists(index_file):
+            return
+
+        with open(index_file, "r") as fp:
+            for line in fp:
+                line = line.strip()
+                if not line:
+                    continue
+                record = json.loads(line)
+                self.records.append(record)
+                self.dyn_ids[record["dyn_hash"]] = record["dyn_id"]
+
+
+    def get_populations(self):
+        """
+        Get the sorted list of the population ids saved in the store.
+        """
+        return sorted(set([x["population"] for x in self.records]))
+
+
+    def get_record(self, population_id):
+        """
+        Get the index record of the given population (the last one appended).
+        """
+        record = None
+        for x in self.records:
+            if x["population"] == population_id:
+                record = x
+
+        if record is None:
+            ERR_MSG = """
+Error, population {} not found in the ensemble store '{}'.
+       Available populations: {}
+""".format(population_id, self.store_dir, self.get_populations())
+            print(ERR_MSG)
+            raise ValueError(ERR_MSG)
+
+        return record
+
+
+    def get_dyn(self, population_id):
+        """
+        Load the dynamical matrix that generated the given population.
+        """
+        record = self.get_record(population_id)
+        return CC.Phonons.Phonons(os.path.join(self.store_dir, __STORE_DYN__ % record["dyn_id"]), record["nqirr"])
+
+
+    def append(self, ensemble, population_id):
+        """
+        APPEND A POPULATION
+        ===================
+
+        Add the ensemble to the store.
+        Only the master process writes on the disk.
+
+        Parameters
+        ----------
+            ensemble : Ensemble.Ensemble
+                The ensemble to be saved (must be in the default units).
+            population_id : int
+                The id of the population.
+        """
+
+        if ensemble.units != sscha.Ensemble.UNITS_DEFAULT:
+            raise ValueError("Error, the ensemble must be in the default units to be saved.")
+
+        if Parallel.am_i_the_master():
+            if not os.path.exists(self.store_dir):
+                os.makedirs(self.store_dir)
+
+            # Save the generating dynamical matrix only if it is new
+            dyn_hash = sscha.Ensemble._get_dyn_hash(ensemble.dyn_0)
+            if dyn_hash in self.dyn_ids:
+                dyn_id = self.dyn_ids[dyn_hash]
+            else:
+                dyn_id = len(self.dyn_ids) + 1
+                ensemble.dyn_0.save_qe(os.path.join(self.store_dir, __STORE_DYN__ % dyn_id))
+
+            N = ensemble.N
+            force_computed = ensemble.force_computed
+            stress_computed = ensemble.stress_computed
+            if force_computed is None:
+                force_computed = np.ones(N, dtype = bool)
+            if stress_computed is None:
+                stress_computed = np.ones(N, dtype = bool) * ensemble.has_stress
+
+            arrays = {"energies" : ensemble.energies,
+                      "forces" : ensemble.forces,
+                      "xats" : ensemble.xats,
+                      "force_computed" : np.asarray(force_computed, dtype = bool),
+                      "stress_computed" : np.asarray(stress_computed, dtype = bool)}
+            if ensemble.has_stress:
+                arrays["stresses"] = ensemble.stresses
+
+            record = {"version" : __STORE_VERSION__,
+                      "population" : int(population_id),
+                      "n_configs" : int(N),
+                      "nat_sc" : int(ensemble.xats.shape[1]),
+                      "T" : float(ensemble.T0),
+                      "dyn_id" : dyn_id,
+                      "dyn_hash" : dyn_hash,
+                      "nqirr" : int(ensemble.dyn_0.nqirr),
+                      "has_stress" : bool(ensemble.has_stress),
+                      "n_computed" : int(np.sum(force_computed)),
+                      "arrays" : {}}
+
+            with open(os.path.join(self.store_dir, __STORE_DATA__), "ab") as fp:
+                fp.seek(0, 2)
+                for name in __STORE_ARRAYS__:
+                    if not name in arrays:
+                        continue
+                    value = np.ascontiguousarray(arrays[name])
+
+                    # Keep the offsets aligned to 8 bytes
+                    offset = fp.tell()
+                    if offset % 8:
+                        fp.write(b"\0" * (8 - offset % 8))
+                        offset = fp.tell()
+
+                    fp.write(value.tobytes())
+                    record["arrays"][name] = [offset, list(value.shape), value.dtype.str]
+
+                fp.flush()
+                os.fsync(fp.fileno())
+
+            with open(os.path.join(self.store_dir, __STORE_INDEX__), "a") as fp:
+                fp.write(json.dumps(record) + "\n")
+
+            self.records.append(record)
+            self.dyn_ids[dyn_hash] = dyn_id
+
+        CC.Settings.barrier()
+        if not Parallel.am_i_the_master():
+            self.read_index()
+
+
+    def read_array(self, population_id, name, rows = None):
+        """
+        Read one of the arrays of a population directly from the store.
+
+        Parameters
+        ----------
+            population_id : int
+                The id of the population
+            name : string
+                The array (energies, forces, xats, stresses, force_computed or stress_computed)
+            rows : ndarray(dtype = int), optional
+                If given, only these configurations are read.
+
+        Returns
+        -------
+            array : ndarray
+                The content of the array (or None if not saved)
+        """
+        record = self.get_record(population_id)
+        if not name in record["arrays"]:
+            return None
+
+        offset, shape, dtype = record["arrays"][name]
+        data = np.memmap(os.path.join(self.store_dir, __STORE_DATA__), dtype = np.dtype(dtype),
+                         mode = "r", offset = offset, shape = tuple(shape))
+
+        if rows is None:
+            return np.array(data)
+        return np.array(data[rows])
+
+
+    def load(self, populations = None, ensemble = None, dyn = None, T = None, min_weight = None,
+             only_computed = False):
+        """
+        SELECTIVE LOADING
+        =================
+
+        Load the selected populations into an ensemble.
+
+        Parameters
+        ----------
+            populations : list of int, optional
+                The populations to be loaded. If None, all the populations of the store.
+                They must be generated by the same dynamical matrix at the same temperature.
+            ensemble : Ensemble.Ensemble, optional
+                The ensemble in which the configurations are loaded.
+                If None, a new one is created.
+            dyn : CC.Phonons.Phonons, optional
+                If given, the weights of the loaded ensemble are updated to this dynamical matrix.
+            T : float, optional
+                The temperature of dyn (default, the temperature of the population).
+            min_weight : float, optional
+                If given (together with dyn), only the configurations
+                whose weight is greater or equal than min_weight are loaded.
+            only_computed : bool
+                If True, only the configurations with computed forces are loaded.
+
+        Returns
+        -------
+            ensemble : Ensemble.Ensemble
+                The loaded ensemble
+        """
+
+        if populations is None:
+            populations = self.get_populations()
+        if len(populations) == 0:
+            raise ValueError("Error, no population to load from the store '{}'".format(self.store_dir))
+
+        records = [self.get_record(x) for x in populations]
+
+        dyn_ids = set([x["dyn_id"] for x in records])
+        temperatures = set([x["T"] for x in records])
+        if len(dyn_ids) > 1 or len(temperatures) > 1:
+            ERR_MSG = """
+Error, the populations {} were generated by different
+       dynamical matrices or temperatures. Load them in separate ensembles.
+""".format(populations)
+            print(ERR_MSG)
+            raise ValueError(ERR_MSG)
+
+        if min_weight is not None and dyn is None:
+            raise ValueError("Error, the weight threshold requires the dynamical matrix dyn.")
+
+        dyn_gen = self.get_dyn(populations[0])
+        T0 = records[0]["T"]
+        if T is None:
+            T = T0
+
+        has_stress = all([x["has_stress"] for x in records])
+
+        data = {name : [] for name in __STORE_ARRAYS__}
+        for pop in populations:
+            rows = None
+            if only_computed:
+                rows = np.nonzero(self.read_array(pop, "force_computed"))[0]
+
+            if min_weight is not None:
+                # Only the positions are needed to get the weights
+                xats = self.read_array(pop, "xats", rows)
+                tmp_ens = sscha.Ensemble.Ensemble(dyn_gen, T0, dyn_gen.GetSupercell())
+                tmp_ens.init_from_positions(xats)
+                tmp_ens.update_weights(dyn, T)
+                mask = tmp_ens.rho >= min_weight
+
+                if rows is None:
+                    rows = np.arange(len(mask))
+                rows = rows[mask]
+
+            for name in __STORE_ARRAYS__:
+                if name == "stresses" and not has_stress:
+                    continue
+                data[name].append(self.read_array(pop, name, rows))
+
+        for name in data:
+            if len(data[name]):
+                data[name] = np.concatenate(data[name], axis = 0)
+
+        if ensemble is None:
+            ensemble = sscha.Ensemble.Ensemble(dyn_gen, T0, dyn_gen.GetSupercell())
+        else:
+            ensemble.dyn_0 = dyn_gen
+            ensemble.supercell = dyn_gen.GetSupercell()
+            ensemble.T0 = T0
+
+        ensemble.init_from_positions(data["xats"])
+        ensemble.energies[:] = data["energies"]
+        ensemble.forces[:,:,:] = data["forces"]
+        ensemble.has_stress = has_stress
+        if has_stress:
+            ensemble.stresses[:,:,:] = data["stresses"]
+        ensemble.force_computed = data["force_computed"].astype(bool)
+        ensemble.stress_computed = data["stress_computed"].astype(bool)
+        ensemble.init()
+
+        if dyn is not None:
+            ensemble.update_weights(dyn, T)
+
+        return ensemble
@@ -23,3 +23,17 @@ class LocalCluster(Cluster.Cluster):
         """
 
         return super().copy_file(source, destination, server_source = False, server_dest = False, **kwargs)
+
+    def get_ssh_options(self):
+        """
+        No connection is opened with the cluster.
+        """
+
+        return ""
+
+    def get_cluster_command(self, cmd):
+        """
+        The command is executed in the local machine.
+        """
+
+        return "( {} )".format(cmd)
@@ -7,6 +7,31 @@ from sscha.Parallel import pprint as print
 
 __ERROR_THR__ = 1e-7
 
+# The names accepted for each minimization algorithm.
+# 'auto' was the default of the old versions, where only the steepest descent was implemented.
+__ALGORITHMS__ = {"sdes" : ["sdes", "sd", "steepest descend", "auto"],
+                  "cgrf" : ["cgrf", "cg", "pcg"],
+                  "lbfgs" : ["lbfgs", "bfgs"]}
+
+
+def get_algorithm(name):
+    """
+    Get the algorithm ('sdes', 'cgrf' or 'lbfgs') identified by name.
+    A ValueError is raised if the name is not known.
+    """
+    for algorithm in __ALGORITHMS__:
+        if str(name).lower() in __ALGORITHMS__[algorithm]:
+            return algorithm
+
+    all_names = [x for algorithm in __ALGORITHMS__ for x in __ALGORITHMS__[algorithm]]
+    ERROR_MSG = """
+Error, the minimization algorithm '{}' is not implemented.
+       Use one of {}.
+       Suggested similar names: {} ?
+""".format(name, all_names, difflib.get_close_matches(str(name).lower(), all_names))
+    raise ValueError(ERROR_MSG)
+
+
 class Minimizer:
     def __init__(self, minim_struct = True, algorithm = "sdes", root_representation = "normal", step = 1, verbose = True, fixed_step = False, struct_step_ratio = 1):
         """
@@ -17,7 +42,11 @@ class Minimizer:
             minim_struc : bool
                 If true minimizes also the structure
             algorithm : string
-                The algorithm used for the minimization
+                The algorithm used for the minimization:
+                'sdes' (steepest descent), 'cg' (preconditioned conjugate gradient)
+                or 'lbfgs' (limited memory BFGS). See __ALGORITHMS__ for the accepted names
+                ('auto' is the steepest descent).
+                The gradient is already preconditioned by the ensemble.
             root_representation : string
                 One between 'normal', 'sqrt' (or 'root2') and 'root4'.
                 If normal the minimization is performed in the force constant matrix space, otherwise on the space of
@@ -54,6 +83,19 @@ class Minimizer:
         self.new_direction = True
         self.direction = None
 
+        # The gradient at the starting point of the last direction (for CG and L-BFGS)
+        self.old_gradient = None
+        # The same gradient without the preconditioning (see run_step)
+        self.old_raw_gradient = None
+
+        # The L-BFGS history (position and gradient differences between the accepted points).
+        # The curvature products use the differences of the unpreconditioned gradient (y_history),
+        # the preconditioned ones (py_history) apply the preconditioner as the initial inverse hessian.
+        self.lbfgs_memory = 10
+        self.s_history = []
+        self.y_history = []
+        self.py_history = []
+
 
         # Some parameter to optimize the evolution
 
@@ -66,6 +108,14 @@ class Minimizer:
         # How much decrease the step when it is too big (must be < 1)
         self.decrement_step = .87358046475 
 
+        # If n_trial_steps > 0 and a trial_function is given, each time a new direction is chosen
+        # 2 * n_trial_steps + 1 step lengths are scored with the trial_function
+        # (that does not compute the gradient), and the best one is used (see get_best_trial_step).
+        # trial_function(dynq, struct) must return the free energy and the kong-liu ratio
+        # (an infinite free energy rejects the step).
+        self.n_trial_steps = 0
+        self.trial_function = None
+
 
         # Setup the attribute control
         self.__total_attributes__ = [item for item in self.__dict__.keys()]
@@ -99,6 +149,8 @@ class Minimizer:
             assert value >= 0, "Error, the step must be positive, value = {}".format(value)
         if name == "struct_step_ratio":
             assert value > 0, "Error, {} must be positive, value = {}".format(name, value)
+        if name == "algorithm":
+            get_algorithm(value)
         
 
     def init(self, dyn, kl_ratio):
@@ -144,6 +196,13 @@ class Minimizer:
         self.old_kl = kl_ratio
         self.new_direction = True
 
+        self.direction = None
+        self.old_gradient = None
+        self.old_raw_gradient = None
+        self.s_history = []
+        self.y_history = []
+        self.py_history = []
+
     def transform_gradients(self, dyn_gradient, structure_gradient = None):
         """
         Transform the gradients from dynamical matrix and structure
@@ -168,23 +227,31 @@ class Minimizer:
         
         return np.concatenate( (dyn_gradient.ravel(), structure_gradient.ravel() * self.struct_step_ratio) )
 
-    def get_dyn_struct(self):
+    def get_dyn_struct(self, x = None):
         """
         From the current position of the minimization,
         get back the dynamical matrix and the structure
+
+        Parameters
+        ----------
+            x : ndarray, optional
+                The position in the minimization space. If None, the current one.
         """
 
+        if x is None:
+            x = self.current_x
+
         dynq = np.zeros( (self.nq, self.n_modes, self.n_modes), dtype = np.complex128)
 
         for i in range(self.nq):
-            dynq[i,  :, :] = self.current_x[ i * self.n_modes**2 : (i+1) * self.n_modes**2].reshape( (self.n_modes, self.n_modes))
+            dynq[i,  :, :] = x[ i * self.n_modes**2 : (i+1) * self.n_modes**2].reshape( (self.n_modes, self.n_modes))
         
         # Revert the dynamical matrix if we are in the root representation
         dynq = get_standard_dyn(dynq, self.root_representation)
 
         struct = self.dyn.structure.coords.copy()
         if self.minim_struct:
-            struct = self.current_x[self.nq * self.n_modes * self.n_modes :].reshape(self.dyn.structure.coords.shape)
+            struct = x[self.nq * self.n_modes * self.n_modes :].reshape(self.dyn.structure.coords.shape)
         return dynq, struct
 
     def is_new_direction(self):
@@ -197,10 +264,73 @@ class Minimizer:
         return self.new_direction
 
 
-    def run_step(self, gradient, kl_new):
+    def get_state(self):
+        """
+        Get the state of the line minimization (to restart it, see set_state).
+
+        Results
+        -------
+            state : dict
+                The step, the current and starting points, the search direction
+                and the history of the CG and L-BFGS algorithms.
+        """
+        state = {"step" : self.step,
+                 "step_index" : self.step_index,
+                 "old_kl" : self.old_kl,
+                 "new_direction" : self.new_direction}
+
+        for name in ["current_x", "old_x", "direction", "old_gradient", "old_raw_gradient"]:
+            value = self.__dict__[name]
+            if value is not None:
+                value = value.copy()
+            state[name] = value
+
+        state["s_history"] = [x.copy() for x in self.s_history]
+        state["y_history"] = [x.copy() for x in self.y_history]
+        state["py_history"] = [x.copy() for x in self.py_history]
+        return state
+
+    def set_state(self, state):
+        """
+        Restore the state of the line minimization obtained with get_state.
+        The minimizer must be already initialized (see init) on the same dynamical matrix.
+        """
+        if state["current_x"] is not None and len(state["current_x"]) != len(self.current_x):
+            raise ValueError("Error, the state of the minimizer does not match the dynamical matrix.")
+
+        for name in state:
+            value = state[name]
+            if isinstance(value, np.ndarray):
+                value = value.copy()
+            elif isinstance(value, list):
+                value = [x.copy() for x in value]
+            self.__setattr__(name, value)
+
+        # States saved without the unpreconditioned gradients
+        if not "py_history" in state:
+            self.py_history = [x.copy() for x in self.y_history]
+        if not "old_raw_gradient" in state and self.old_gradient is not None:
+            self.old_raw_gradient = self.old_gradient.copy()
+
+
+    def run_step(self, gradient, kl_new, raw_gradient = None):
         """
         Perform the minimization step with the line minimization
+
+        Parameters
+        ----------
+            gradient : ndarray
+                The (preconditioned) gradient, see transform_gradients
+            kl_new : float
+                The Kong-Liu ratio of the current point
+            raw_gradient : ndarray, optional
+                The same gradient without the preconditioning.
+                It is used by the L-BFGS for the curvature products, so that the positions
+                and the gradient differences are in the same metric.
+                If None, gradient is used (that is exact without preconditioning).
         """
+        if raw_gradient is None:
+            raw_gradient = gradient
         # Check consistency
         ERR="""
 Error, increment must be bigger than 1 and decrement lower than 1. 
@@ -213,17 +343,43 @@ Error, increment must be bigger than 1 and decrement lower than 1.
         if self.new_direction:
             # A new direction, update the position with the last one
             self.old_kl = kl_new
-            if self.algorithm.lower() in ["sdes", "sd", "steepest descend"]:
+            algorithm = get_algorithm(self.algorithm)
+            natural_step = False
+            if algorithm == "sdes":
                 self.direction = gradient.copy()
-            else:
-                raise NotImplementedError("Error, algorithm '{}' not implemented".format(self.algorithm))
-            
+            elif algorithm == "cgrf":
+                self.direction = self.get_cg_direction(gradient)
+            elif algorithm == "lbfgs":
+                self.update_lbfgs_history(gradient, raw_gradient)
+                self.direction = self.get_lbfgs_direction(gradient, raw_gradient)
+                natural_step = len(self.s_history) > 0
+
+            # Safeguard against the stochastic noise: restart if the direction is not a descent one
+            if _real_dot(self.direction, gradient) <= 0:
+                if self.verbose:
+                    print("The {} direction is not a descent direction, restart with the gradient".format(self.algorithm))
+                self.direction = gradient.copy()
+                self.s_history = []
+                self.y_history = []
+                self.py_history = []
+                natural_step = False
+
+            self.old_gradient = gradient.copy()
+            self.old_raw_gradient = raw_gradient.copy()
             self.old_x = self.current_x.copy()
             self.new_direction = False 
 
             # Enlarge the step
             if not self.fixed_step:
-                self.step *= self.increment_step
+                if natural_step:
+                    # The quasi-Newton direction already contains the step length
+                    self.step = 1
+                else:
+                    self.step *= self.increment_step
+
+                # Choose the step length by reweighting the ensemble
+                if self.n_trial_steps > 0 and self.trial_function is not None:
+                    self.step = self.get_best_trial_step(self.step)
         else:
             # Proceed with the line minimization
 
@@ -253,7 +409,132 @@ Error, increment must be bigger than 1 and decrement lower than 1.
         self.current_x = self.old_x - self.step * self.direction
 
 
-    def update_dyn(self, new_kl_ratio, dyn_gradient, structure_gradient = None):
+    def get_cg_direction(self, gradient):
+        """
+        Get the preconditioned conjugate gradient direction (Polak-Ribiere, restarted when beta < 0).
+        As the gradient is already preconditioned, the scalar products are computed on the preconditioned gradient.
+        """
+        if self.direction is None or self.old_gradient is None:
+            return gradient.copy()
+
+        beta = _real_dot(gradient, gradient - self.old_gradient) / _real_dot(self.old_gradient, self.old_gradient)
+        beta = max(beta, 0)
+        if self.verbose:
+            print("CG beta = {}".format(beta))
+        return gradient + beta * self.direction
+
+    def update_lbfgs_history(self, gradient, raw_gradient):
+        """
+        Store the difference of position and gradient between the last two accepted points.
+        The pair is discarded if the curvature condition is not satisfied
+        (as it may happen due to the stochastic noise of the gradient).
+        """
+        if self.old_gradient is None:
+            return
+
+        s_vect = self.current_x - self.old_x
+        y_vect = raw_gradient - self.old_raw_gradient
+        py_vect = gradient - self.old_gradient
+        sy = _real_dot(s_vect, y_vect)
+
+        # y.Py is the squared norm of y in the metric of the preconditioner
+        if sy <= __ERROR_THR__ * np.sqrt(_real_dot(s_vect, s_vect) * _real_dot(y_vect, y_vect)) or \
+           _real_dot(y_vect, py_vect) <= 0:
+            if self.verbose:
+                print("L-BFGS: curvature condition not satisfied, pair discarded")
+            return
+
+        self.s_history.append(s_vect)
+        self.y_history.append(y_vect)
+        self.py_history.append(py_vect)
+        if len(self.s_history) > self.lbfgs_memory:
+            self.s_history.pop(0)
+            self.y_history.pop(0)
+            self.py_history.pop(0)
+
+    def get_lbfgs_direction(self, gradient, raw_gradient):
+        """
+        Get the L-BFGS direction with the two loop recursion.
+        The initial inverse hessian is the preconditioner P, scaled by s.y / y.Py of the last pair.
+        P is never built: it is applied through the preconditioned gradient (P g)
+        and gradient differences (P y).
+        """
+        n_pairs = len(self.s_history)
+        if n_pairs == 0:
+            return gradient.copy()
+
+        q = raw_gradient.copy()
+        p_q = gradient.copy()
+        rho = [1 / _real_dot(self.y_history[i], self.s_history[i]) for i in range(n_pairs)]
+        alpha = np.zeros(n_pairs)
+        for i in range(n_pairs - 1, -1, -1):
+            alpha[i] = rho[i] * _real_dot(self.s_history[i], q)
+            q -= alpha[i] * self.y_history[i]
+            p_q -= alpha[i] * self.py_history[i]
+
+        gamma = _real_dot(self.s_history[-1], self.y_history[-1]) / _real_dot(self.y_history[-1], self.py_history[-1])
+        r = gamma * p_q
+        for i in range(n_pairs):
+            beta = rho[i] * _real_dot(self.y_history[i], r)
+            r += (alpha[i] - beta) * self.s_history[i]
+
+        return r
+
+    def get_best_trial_step(self, step):
+        """
+        Score the trial steps along the current direction with the trial_function,
+        without computing the gradient.
+
+        The trial steps are step * increment_step**k, with k from -n_trial_steps to n_trial_steps.
+        The step with the lowest free energy is chosen among those whose kong-liu ratio
+        (with respect to the starting point) is above kl_ratio_thr.
+        If no step satisfies the condition, the shortest one is returned.
+
+        Parameters
+        ----------
+            step : float
+                The central trial step
+
+        Results
+        -------
+            best_step : float
+                The chosen step
+        """
+
+        steps = step * self.increment_step ** np.arange(-self.n_trial_steps, self.n_trial_steps + 1)
+
+        best_step = steps[0]
+        best_fe = np.inf
+        for trial_step in steps:
+            dynq, struct = self.get_dyn_struct(self.old_x - trial_step * self.direction)
+
+            try:
+                fe, kl = self.trial_function(dynq, struct)
+            except np.linalg.LinAlgError as error:
+                if self.verbose:
+                    print("Trial step {} rejected: {}".format(trial_step, error))
+                continue
+
+            if not np.isfinite(fe):
+                if self.verbose:
+                    print("Trial step {} rejected".format(trial_step))
+                continue
+
+            if self.verbose:
+                print("Trial step {:.6e}: free energy = {:.8e} | kl_ratio = {:.4f}".format(trial_step, fe, kl / self.old_kl))
+
+            if kl / self.old_kl >= self.kl_ratio_thr and fe < best_fe:
+                best_fe = fe
+                best_step = trial_step
+
+        if self.verbose:
+            print("Chosen step from the trials: {}".format(best_step))
+
+        return best_step
+
+
+    def update_dyn(self, new_kl_ratio, dyn_gradient, structure_gradient = None,
+                   raw_dyn_gradient = None, raw_structure_gradient = None):
         """
         Update the dynamical matrix.
 
@@ -265,6 +546,9 @@ Error, increment must be bigger than 1 and decrement lower than 1.
                 The gradient of the dynamical matrix
             structure_gradient : ndarray(nmodes), optional
                 The gradient of the structure (only needed if self.minim_struct = True)
+            raw_dyn_gradient, raw_structure_gradient : ndarray, optional
+                The same gradients without the preconditioning (only used by the L-BFGS).
+                If not given, the preconditioned ones are used.
 
         Results
         -------
@@ -284,12 +568,34 @@ Error, increment must be bigger than 1 and decrement lower than 1.
         root_dyn, root_grad = get_root_dyn_grad(current_dyn, dyn_gradient, self.root_representation)
 
         grad_vector = self.transform_gradients(root_grad, structure_gradient)
-        self.run_step(grad_vector, new_kl_ratio)
+
+        raw_vector = None
+        if raw_dyn_gradient is not None or raw_structure_gradient is not None:
+            if raw_dyn_gradient is None:
+                raw_dyn_gradient = dyn_gradient
+            if raw_structure_gradient is None:
+                raw_structure_gradient = structure_gradient
+            _, raw_root_grad = get_root_dyn_grad(current_dyn, raw_dyn_gradient, self.root_representation)
+
+            # The struct_step_ratio is a preconditioning: the raw gradient does not include it
+            raw_vector = raw_root_grad.ravel()
+            if self.minim_struct:
+                raw_vector = np.concatenate((raw_vector, raw_structure_gradient.ravel()))
+
+        self.run_step(grad_vector, new_kl_ratio, raw_vector)
 
         
 
 
 
+def _real_dot(a, b):
+    """
+    The scalar product between two complex vectors,
+    considering the real and imaginary part as independent.
+    """
+    return np.dot(np.real(a), np.real(b)) + np.dot(np.imag(a), np.imag(b))
+
+
 def get_root_dyn_grad(dyn_q, grad_q, root_representation = "sqrt"):
     """
     ROOT MINIMIZATION STEP
@@ -359,27 +665,50 @@ def get_root_dyn_grad(dyn_q, grad_q, root_representation = "sqrt"):
     new_dyn[:,:,:] = dyn_q
     new_grad[:,:,:] = grad_q
 
-    # Cycle over all the q points
+    # All the q points are transformed at once
     if root_representation != "normal":
-        for iq in range(nq):
-            # Dyagonalize the matrix
-            eigvals, eigvects = np.linalg.eigh(dyn_q[iq, :, :])
-            
-            # Regularize acustic modes
-            if iq == 0:
-                eigvals[eigvals < 0] = 0.
-            
-            # The sqrt conversion
-            new_dyn[iq, :, :] = np.einsum("a, ba, ca", np.sqrt(eigvals), eigvects, np.conj(eigvects))
-            new_grad[iq, :, :] = new_dyn[iq, :, :].dot(grad_q[iq, :, :]) + grad_q[iq, :, :].dot(new_dyn[iq, :, :])
-            
-            # If root4 another loop needed
-            if root_representation == "root4":                
-                new_dyn[iq, :, :] = np.einsum("a, ba, ca", np.sqrt(np.sqrt(eigvals)), eigvects, np.conj(eigvects))
-                new_grad[iq, :, :] = new_dyn[iq, :, :].dot(new_grad[iq, :, :]) + new_grad[iq, :, :].dot(new_dyn[iq, :, :])
+        # Dyagonalize the matrices
+        eigvals, eigvects = np.linalg.eigh(new_dyn)
+
+        # Regularize acustic modes
+        eigvals[0, eigvals[0, :] < 0] = 0.
+
+        # The sqrt conversion
+        new_dyn = get_matrix_function(np.sqrt(eigvals), eigvects)
+        new_grad = np.matmul(new_dyn, new_grad) + np.matmul(new_grad, new_dyn)
+
+        # If root4 another transformation is needed (on the same eigenvectors)
+        if root_representation == "root4":
+            new_dyn = get_matrix_function(np.sqrt(np.sqrt(eigvals)), eigvects)
+            new_grad = np.matmul(new_dyn, new_grad) + np.matmul(new_grad, new_dyn)
 
     return new_dyn, new_grad
 
+
+def get_matrix_function(f_eigvals, eigvects):
+    """
+    Build the hermitian matrices with the given eigenvalues and eigenvectors
+    for all the q points at once
+
+    .. math::
+
+        f(D)_{ab} = \\sum_\\mu e_\\mu^a f(\\lambda_\\mu) e_\\mu^{b*}
+
+    Parameters
+    ----------
+        f_eigvals : ndarray (nq x 3nats)
+            The function of the eigenvalues for each q point
+        eigvects : ndarray (nq x 3nats x 3nats)
+            The eigenvectors (as columns) for each q point, as returned by np.linalg.eigh
+
+    Results
+    -------
+        matrix : ndarray (nq x 3nats x 3nats)
+            The matrix function
+    """
+
+    return np.matmul(eigvects * f_eigvals[:, np.newaxis, :], np.conj(np.transpose(eigvects, (0, 2, 1))))
+
 def get_standard_dyn(root_dyn, root_representation):
     """
     Get the standard dynamical matrix from the root representation
@@ -396,13 +725,12 @@ def get_standard_dyn(root_dyn, root_representation):
 
     new_dyn = root_dyn.copy()
     if root_representation != "normal":
-        for iq in range(nq):
-            # The square root conversion
-            new_dyn[iq, :, :] = new_dyn[iq, :,:].dot(new_dyn[iq, :,:])
-            
-            # The root4 conversion
-            if root_representation == "root4":
-                new_dyn[iq, :, :] = new_dyn[iq, :,:].dot(new_dyn[iq, :,:])
+        # The square root conversion
+        new_dyn = np.matmul(new_dyn, new_dyn)
+
+        # The root4 conversion
+        if root_representation == "root4":
+            new_dyn = np.matmul(new_dyn, new_dyn)
     
     # Return the matrix
     return new_dyn
@@ -0,0 +1,297 @@
+# -*- coding: utf-8 -*-
+from __future__ import print_function
+
+"""
+This module performs the SSCHA relaxation on a grid of temperatures.
+
+All the temperatures start from the same ensemble, reweighted (update_weights)
+on an independent dynamical matrix for each temperature.
+New populations are computed only for the temperatures whose minimization
+ran out of the statistical sampling.
+"""
+import sys, os
+import difflib
+import numpy as np
+
+import cellconstructor as CC
+import cellconstructor.Phonons
+
+import sscha, sscha.Ensemble, sscha.SchaMinimizer
+from sscha.aiida_ensemble import AiiDAEnsemble
+from sscha.Parallel import pprint as print
+
+
+# The parameters copied from the template minimizer to the minimizer of each temperature
+__MINIM_SETTINGS__ = ["min_step_dyn", "min_step_struc", "kong_liu_ratio", "meaningful_factor",
+                      "minim_struct", "minim_dyn", "minimization_algorithm", "root_representation",
+                      "max_ka", "gradi_op", "fixed_step", "n_trial_steps", "precond_dyn", "precond_wyck",
+                      "neglect_symmetries", "use_spglib", "symmetrize_in_supercell", "enforce_sum_rule",
+                      "eq_energy", "stress_offset", "use_julia"]
+
+
+class MultiTemperatureSSCHA(object):
+
+    def __init__(self, dyn, temperatures, minimizer = None, ase_calculator = None,
+                 N_configs = 1, max_pop = 20, save_ensemble = False, cluster = None, **kwargs):
+        """
+        MULTI TEMPERATURE RELAX
+        =======================
+
+        Relax the dynamical matrix (at fixed cell) on a grid of temperatures.
+
+        The first population is generated by dyn at the reference temperature
+        (by default the highest one, whose wider distribution overlaps better with the lower temperatures)
+        and it is shared by all the temperatures: each one has its own dynamical matrix,
+        minimizer and weights, while the configurations are shared (see Ensemble.get_shared_view).
+        The temperatures are minimized one after the other.
+        When a minimization stops without converging (effective sample size below the
+        Kong-Liu threshold), a new population is generated only for that temperature,
+        from its current dynamical matrix.
+
+        Parameters
+        ----------
+            dyn : CC.Phonons.Phonons
+                The starting dynamical matrix (for all the temperatures)
+            temperatures : list of float
+                The temperatures [K]
+            minimizer : SchaMinimizer.SSCHA_Minimizer, optional
+                A template minimizer. Its parameters (minimization step, Kong-Liu ratio,
+                algorithm, symmetries, ...) are used for the minimizers of all the temperatures.
+            ase_calculator : ase.calculators...
+                The calculator for energies, forces and stresses.
+            N_configs : int
+                The number of configurations of each population
+            max_pop : int
+                The maximum population index
+            save_ensemble : bool
+                If True, the ensembles are saved in data_dir
+                (the shared one in data_dir, the others in data_dir/T_<temperature>)
+            cluster : Cluster.Cluster, optional
+                The cluster on which energies and forces are computed
+            **kwargs : any other attribute of this object
+        """
+
+        self.temperatures = [float(x) for x in temperatures]
+        self.dyn = dyn.Copy()
+        self.minimizer = minimizer
+        self.calc = ase_calculator
+        self.N_configs = N_configs
+        self.max_pop = max_pop
+        self.save_ensemble = save_ensemble
+        self.cluster = cluster
+        self.aiida_inputs = None
+        self.data_dir = "data"
+        self.start_pop = 1
+        self.get_stress = False
+
+        # The temperature [K] of the shared population (default, the highest one)
+        self.reference_temperature = max(self.temperatures)
+
+        # The verbosity of the minimizations of each temperature
+        self.verbose = 0
+
+        # The minimizers, one for each temperature
+        self.minims = []
+
+        # True for the temperatures whose minimization is converged
+        self.converged = np.zeros(len(self.temperatures), dtype = bool)
+
+        # Setup the attribute control
+        self.__total_attributes__ = [item for item in self.__dict__.keys()]
+        self.fixed_attributes = True # This must be the last attribute to be setted
+
+        # Setup any other keyword given in input (raising the error if not already defined)
+        for key in kwargs:
+            self.__setattr__(key, kwargs[key])
+
+
+    def __setattr__(self, name, value):
+        """
+        This method is used to set an attribute.
+        It will raise an exception if the attribute does not exists (with a suggestion of similar entries)
+        """
+
+        if "fixed_attributes" in self.__dict__:
+            if name in self.__total_attributes__:
+                super(MultiTemperatureSSCHA, self).__setattr__(name, value)
+            elif self.fixed_attributes:
+                similar_objects = str( difflib.get_close_matches(name, self.__total_attributes__))
+                ERROR_MSG = """
+        Error, the attribute '{}' is not a member of '{}'.
+        Suggested similar attributes: {} ?
+        """.format(name, type(self).__name__,  similar_objects)
+
+                raise AttributeError(ERROR_MSG)
+        else:
+            super(MultiTemperatureSSCHA, self).__setattr__(name, value)
+
+
+    def compute_population(self, dyn, T, pop, data_dir = None):
+        """
+        Generate and compute a new population.
+
+        Parameters
+        ----------
+            dyn : CC.Phonons.Phonons
+                The dynamical matrix that generates the ensemble
+            T : float
+                The temperature of the ensemble
+            pop : int
+                The id of the population (to save it)
+            data_dir : string, optional
+                Where to save the ensemble (if save_ensemble)
+
+        Results
+        -------
+            ensemble : Ensemble.Ensemble
+                The computed ensemble
+        """
+        if self.minimizer is not None and self.minimizer.ensemble is not None:
+            ensemble = self.minimizer.ensemble.__class__(dyn.Copy(), T, dyn.GetSupercell())
+        else:
+            ensemble = sscha.Ensemble.Ensemble(dyn.Copy(), T, dyn.GetSupercell())
+        ensemble.generate(self.N_configs)
+
+        if isinstance(ensemble, AiiDAEnsemble):
+            ensemble.compute_ensemble(**self.aiida_inputs)
+        else:
+            ensemble.compute_ensemble(self.calc, self.get_stress, cluster = self.cluster)
+
+        if self.save_ensemble and data_dir is not None:
+            ensemble.save_bin(data_dir, pop)
+
+        return ensemble
+
+
+    def setup_minimizer(self, ensemble, dyn, T):
+        """
+        Prepare the minimizer of a temperature on the given ensemble.
+
+        The configurations of the ensemble are shared, while the weights and the displacements
+        are independent: the view is reweighted on dyn at the temperature T.
+        """
+        view = ensemble.get_shared_view()
+        view.update_weights(dyn, T)
+
+        minim = sscha.SchaMinimizer.SSCHA_Minimizer(view)
+        if self.minimizer is not None:
+            for name in __MINIM_SETTINGS__:
+                setattr(minim, name, getattr(self.minimizer, name))
+        minim.dyn = dyn.Copy()
+        return minim
+
+
+    def minimize(self, index):
+        """
+        Run the minimization of the temperature with the given index.
+        Returns True if it is converged.
+        """
+        minim = self.minims[index]
+        minim.init(delete_previous_data = False)
+        minim.run(verbose = self.verbose)
+
+        return minim.is_converged()
+
+
+    def run_minimizations(self, indices):
+        """
+        Run the minimizations of the given temperatures (one after the other).
+        """
+        for i in indices:
+            self.converged[i] = self.minimize(i)
+
+
+    def relax(self, ensemble = None):
+        """
+        RELAX ALL THE TEMPERATURES
+        ==========================
+
+        Parameters
+        ----------
+            ensemble : Ensemble.Ensemble, optional
+                An already computed ensemble, used as the shared population.
+                If None, it is generated by dyn at the reference temperature.
+
+        Results
+        -------
+            converged : ndarray(dtype = bool)
+                For each temperature, True if the minimization converged.
+        """
+        pop = self.start_pop
+        if ensemble is None:
+            ensemble = self.compute_population(self.dyn, self.reference_temperature, pop, self.data_dir)
+
+        n_T = len(self.temperatures)
+        self.converged[:] = False
+        self.minims = []
+        for T in self.temperatures:
+            self.minims.append(self.setup_minimizer(ensemble, self.dyn, T))
+
+        # The temperatures too far from the reference one get immediately their own population
+        for i, minim in enumerate(self.minims):
+            kl_ratio = minim.ensemble.get_effective_sample_size() / minim.ensemble.N
+            print("T = {:.2f} K | Kong-Liu ratio on the shared population = {:.4f}".format(self.temperatures[i], kl_ratio))
+            if kl_ratio < minim.kong_liu_ratio:
+                self.new_population(i, pop)
+
+        while True:
+            active = [i for i in range(n_T) if not self.converged[i]]
+            self.run_minimizations(active)
+
+            for i in active:
+                print("T = {:.2f} K | population {} | converged = {} | F = {:.8f} Ry".format(self.temperatures[i], pop,
+                      self.converged[i], self.minims[i].get_free_energy()))
+
+            pop += 1
+            if np.all(self.converged) or pop > self.max_pop:
+                break
+
+            # Generate new populations only for the temperatures out of the statistical sampling
+            for i in range(n_T):
+                if not self.converged[i]:
+                    self.new_population(i, pop)
+
+        self.start_pop = pop
+        return self.converged.copy()
+
+
+    def new_population(self, index, pop):
+        """
+        Compute a new population for the temperature with the given index,
+        generated by its current dynamical matrix.
+        """
+        T = self.temperatures[index]
+        dyn = self.minims[index].dyn
+
+        data_dir = None
+        if self.data_dir:
+            data_dir = os.path.join(self.data_dir, "T_{:g}".format(T))
+            if self.save_ensemble and not os.path.exists(data_dir):
+                os.makedirs(data_dir)
+
+        ensemble = self.compute_population(dyn, T, pop, data_dir)
+
+        old_minim = self.minims[index]
+        minim = self.setup_minimizer(ensemble, dyn, T)
+        minim.population = pop
+        for name in ["__fe__", "__fe_err__", "__gc__", "__gc_err__", "__gw__", "__gw_err__", "__KL__", "__good_kasteps__"]:
+            setattr(minim, name, getattr(old_minim, name))
+        self.minims[index] = minim
+
+
+    def get_free_energies(self, return_error = False):
+        """
+        Get the free energy [Ry] (per unit cell) of each temperature.
+        """
+        results = [minim.get_free_energy(return_error = True) for minim in self.minims]
+        fe = np.array([np.real(x[0]) for x in results])
+        if return_error:
+            return fe, np.array([np.real(x[1]) for x in results])
+        return fe
+
+
+    def get_dynamical_matrices(self):
+        """
+        Get the dynamical matrices of each temperature.
+        """
+        return [minim.dyn for minim in self.minims]
@@ -3,6 +3,7 @@ Here the optimizer for the cell and the gradient
 """
 from __future__ import print_function
 import numpy as np
+import copy
 import SCHAModules
 import sys, os
 
@@ -349,7 +350,32 @@ class UC_OPTIMIZER:
             self.check_reset(uc_old)
             self.reset_strain = False
         
-            
+
+    def UpdateCellFrozen(self, unit_cell, stress_tensor, fix_volume = False, verbose = True):
+        """
+        PERFORM THE CELL UPDATE WITHOUT HISTORY
+        =======================================
+
+        Perform the cell update as UpdateCell (without the line minimization),
+        but leave the optimizer untouched: the step length, the line minimization
+        and the hessian are not updated with this stress tensor.
+        Use it when the stress is only an estimate, like the one of a strained population.
+
+        Parameters
+        ----------
+            unit_cell : 3x3 matrix
+                The unit cell of the system. It will be
+                updated after the minimization step.
+            stress_tensor : 3x3 matrix
+                The stress tensor according to which you want
+                to optimize the gradient.
+            fix_volume : bool, optional
+                If true, only the cell shape is affected by the update
+        """
+        optimizer = copy.deepcopy(self)
+        optimizer.use_line_step = False
+        optimizer.UpdateCell(unit_cell, stress_tensor, fix_volume, verbose)
+
 
 class BFGS_UC(UC_OPTIMIZER):
     def __init__(self, unit_cell, bulk_modulus = 1, update_h_step = 0.2):
@@ -9,6 +9,8 @@ constant pressure relax.
 import numpy as np
 import difflib
 import sscha, sscha.Ensemble, sscha.SchaMinimizer
+import sscha.EnsembleStore
+import sscha.Checkpoint
 import sscha.Optimizer
 import sscha.Calculator
 import sscha.Cluster
@@ -113,6 +115,21 @@ class SSCHA(object):
         self.save_dyn = True # Save the dynamical matrix at each iteration
         self.data_dir = "data"
 
+        # If True, the ensembles are appended to a single store (EnsembleStore)
+        # in the data_dir, instead of saving each population in separate files.
+        self.use_ensemble_store = False
+
+        # The number of previous populations recycled in the relax
+        # (requires the ensemble store). The configurations are weighted with
+        # the multiple importance sampling (see Ensemble.recycle_populations)
+        self.recycle_populations = 0
+
+        # If given, the state of the relaxation is saved in this file after each minimization step
+        # (see sscha.Checkpoint). The ensemble is referenced (not copied), so it must be saved (save_ensemble).
+        # Restart with restart_from_checkpoint.
+        self.checkpoint_file = None
+        self.__restart_checkpoint__ = None
+
 
 
         self.__cfpre__ = None
@@ -130,6 +147,26 @@ class SSCHA(object):
         # Usefull (for example) if you want to enfoce a cubic cell even if the structure brakes the symmetries
         self.fix_cell_shape = False
 
+        # The maximum number of cell steps performed on the same population in a vc_relax.
+        # The ensemble is strained to the new cell and reweighted (see Ensemble.change_unit_cell)
+        # as long as its effective sample size is above the Kong-Liu threshold of the minimizer.
+        # If 0, a new population is generated after each cell step.
+        self.max_cell_steps_per_population = 0
+
+        # If True, the size of each population is chosen from the ratio between the gradient
+        # and its stochastic error, and from the effective sample size of the previous population
+        # (see get_population_size). N_configs is the maximum size.
+        # When the minimization converges on a population smaller than N_configs,
+        # the population is extended with new configurations (merged)
+        # and the convergence is verified again.
+        self.adaptive_population = False
+        # The minimum size of a population (if None, N_configs // 8)
+        self.adaptive_min_configs = None
+        # The target ratio between the gradient and its error on the next population
+        self.adaptive_gradient_ratio = 3
+        # The size, the effective sample size and the gradient ratio of each minimized population
+        self.population_history = []
+
 
         # Set the Sobol Parameters by default (aka no Sobol)
         self.sobol_sampling = False
@@ -294,6 +331,300 @@ class SSCHA(object):
         self.__cfg__ = custom_function_gradient
 
 
+    def save_population(self, ensemble_loc, pop):
+        """
+        Save the current ensemble of the given population in ensemble_loc.
+        If use_ensemble_store is True, the ensemble is appended to the EnsembleStore in ensemble_loc,
+        otherwise it is saved with the save_bin method of the ensemble.
+        """
+        if self.use_ensemble_store:
+            store = sscha.EnsembleStore.EnsembleStore(ensemble_loc)
+            store.append(self.minim.ensemble, pop)
+        else:
+            self.minim.ensemble.save_bin(ensemble_loc, pop)
+
+
+    def recycle_previous_populations(self, ensemble_loc, pop):
+        """
+        Add to the current ensemble the last self.recycle_populations populations
+        before pop saved in the ensemble store in ensemble_loc.
+        The configurations are reweighted with the multiple importance sampling.
+        """
+        if not (self.use_ensemble_store and self.save_ensemble):
+            ERR_MSG = """
+Error, recycling the populations requires the ensemble store.
+       Set both use_ensemble_store and save_ensemble to True.
+"""
+            print(ERR_MSG)
+            raise ValueError(ERR_MSG)
+
+        store = sscha.EnsembleStore.EnsembleStore(ensemble_loc)
+        previous = [x for x in store.get_populations() if x < pop][-self.recycle_populations:]
+        if len(previous) == 0:
+            return
+
+        ensembles = [store.load([x], only_computed = True) for x in previous]
+        self.minim.ensemble.recycle_populations(ensembles)
+
+
+    def get_gradient_ratio(self):
+        """
+        Get the ratio between the last gradient of the minimization and its stochastic error.
+        The smallest ratio among the minimized degrees of freedom is returned
+        (the dynamical matrix, gc, and the structure, gw).
+        """
+        ratios = []
+        if self.minim.minim_dyn:
+            ratios.append((self.minim.__gc__[-1], self.minim.__gc_err__[-1]))
+        if self.minim.minim_struct:
+            ratios.append((self.minim.__gw__[-1], self.minim.__gw_err__[-1]))
+
+        # For harmonic systems the error vanishes
+        ratios = [np.abs(g) / err if err > 0 else np.inf for g, err in ratios]
+        return np.min(ratios)
+
+
+    def record_population(self, pop):
+        """
+        Add the current population to the history used by the adaptive population size.
+        """
+        ensemble = self.minim.ensemble
+        record = {"population" : pop,
+                  "n_configs" : ensemble.N,
+                  "ess" : ensemble.get_effective_sample_size(),
+                  "gradient_ratio" : self.get_gradient_ratio(),
+                  "converged" : self.minim.is_converged()}
+        self.population_history.append(record)
+
+        if self.adaptive_population:
+            print("[ADAPTIVE] Population {}: N = {} | ESS = {:.1f} | gradient / error = {:.3f}".format(pop,
+                  record["n_configs"], record["ess"], record["gradient_ratio"]))
+
+
+    def get_population_size(self):
+        """
+        GET THE SIZE OF THE NEXT POPULATION
+        ===================================
+
+        Without adaptive_population, it is N_configs.
+
+        Otherwise, the stochastic error of the gradient of the last population is scaled
+        to the size of a new population, assuming that it decreases as 1/sqrt(N).
+        The error on the last population was measured with an effective sample size ESS, so
+
+        .. math::
+
+            N = ESS \\left(\\frac{r_{target}}{r}\\right)^2
+
+        where r is the measured ratio between the gradient and its error and r_target is adaptive_gradient_ratio.
+        Far from convergence the gradient is large and few configurations are enough to follow it,
+        while close to convergence the population grows to resolve the gradient below its error.
+        The size does not drop below half of the last population
+        and it is bounded between adaptive_min_configs and N_configs.
+
+        Results
+        -------
+            N : int
+                The (even) number of configurations of the next population.
+        """
+        if not self.adaptive_population:
+            return self.N_configs
+
+        n_min = self.adaptive_min_configs
+        if n_min is None:
+            n_min = self.N_configs // 8
+        n_min = max(n_min, 2)
+
+        if len(self.population_history) == 0:
+            n_configs = n_min
+        else:
+            last = self.population_history[-1]
+            if last["gradient_ratio"] == 0:
+                n_configs = self.N_configs
+            else:
+                n_configs = last["ess"] * (self.adaptive_gradient_ratio / last["gradient_ratio"])**2
+            n_configs = max(n_configs, last["n_configs"] / 2)
+
+        n_configs = int(np.ceil(min(max(n_configs, n_min), self.N_configs)))
+
+        # The configurations are generated in pairs (evenodd)
+        n_configs += n_configs % 2
+        return n_configs
+
+
+    def get_extension_size(self):
+        """
+        Get the number of configurations to be added to the current population
+        to verify the convergence of the minimization (0 if it should not be extended).
+
+        The population is extended only with adaptive_population, if it is smaller than N_configs,
+        and if its effective sample size is still above the Kong-Liu threshold.
+        Ensembles containing recycled populations are not extended.
+        """
+        ensemble = self.minim.ensemble
+        if not self.adaptive_population or self.recycle_populations > 0:
+            return 0
+        if ensemble.get_effective_sample_size() / ensemble.N < self.minim.kong_liu_ratio:
+            return 0
+
+        n_extra = self.get_population_size() - ensemble.N
+        return max(n_extra, 0)
+
+
+    def extend_population(self, n_extra, get_stress = False, stress_numerical = False,
+                          sobol = False, sobol_scramble = False, sobol_scatter = 0.0):
+        """
+        EXTEND THE POPULATION
+        =====================
+
+        Compute n_extra new configurations generated by the same dynamical matrix
+        of the current ensemble, and merge them into it.
+        The configurations already computed are kept.
+
+        Parameters
+        ----------
+            n_extra : int
+                The number of new configurations (even)
+            get_stress : bool
+                If True, the stress tensor is computed.
+            stress_numerical : bool
+                If True, the stress is computed by finite differences.
+            sobol, sobol_scramble, sobol_scatter :
+                The parameters of the generation (see Ensemble.generate)
+        """
+        ensemble = self.minim.ensemble
+        print("[ADAPTIVE] Extending the population from {} to {} configurations.".format(ensemble.N, ensemble.N + n_extra))
+
+        extra = ensemble.__class__(ensemble.dyn_0, ensemble.T0, ensemble.dyn_0.GetSupercell())
+        extra.ignore_small_w = ensemble.ignore_small_w
+        extra.generate(n_extra, sobol = sobol, sobol_scramble = sobol_scramble, sobol_scatter = sobol_scatter)
+
+        if isinstance(extra, AiiDAEnsemble):
+            extra.compute_ensemble(**self.aiida_inputs)
+        else:
+            extra.compute_ensemble(self.calc, get_stress, stress_numerical, cluster = self.cluster)
+
+        ensemble.merge(extra)
+
+
+    def strain_population(self):
+        """
+        Strain the current ensemble to the unit cell of the dynamical matrix,
+        so that the next cell step can be performed on the same population.
+
+        Returns
+        -------
+            good : bool
+                True if the effective sample size of the strained ensemble
+                is above the Kong-Liu threshold of the minimizer.
+        """
+        ensemble = self.minim.ensemble
+        ensemble.change_unit_cell(self.minim.dyn.structure.unit_cell)
+        self.minim.update()
+
+        kl_ratio = ensemble.get_effective_sample_size() / ensemble.N
+        print("[CELL] Effective sample size on the new cell: {:.4f} (Kong-Liu ratio = {:.4f})".format(kl_ratio, self.minim.kong_liu_ratio))
+
+        return kl_ratio >= self.minim.kong_liu_ratio
+
+
+    def save_checkpoint(self, ensemble_loc, pop, population_ready = True, cell_optimizer = None, **kwargs):
+        """
+        Update the state of the relaxation in the checkpoint (only if checkpoint_file is set)
+        and save it. The checkpoint is then updated by the minimizer after each step.
+
+        Parameters
+        ----------
+            ensemble_loc : string
+                The directory of the saved ensembles
+            pop : int
+                The current population
+            population_ready : bool
+                If True, the ensemble of pop has been computed and saved in ensemble_loc.
+                Otherwise, a new population is generated at the restart.
+            cell_optimizer : Optimizer.UC_OPTIMIZER
+                The cell optimizer of the variable cell relaxation
+            **kwargs :
+                Other info on the relaxation saved in the checkpoint
+        """
+        if self.checkpoint_file is None:
+            return
+
+        checkpoint = self.minim.checkpoint
+        if checkpoint is None or checkpoint.filename != self.checkpoint_file:
+            checkpoint = sscha.Checkpoint.Checkpoint(self.checkpoint_file)
+            self.minim.checkpoint = checkpoint
+
+        reference = None
+        if population_ready and self.save_ensemble and ensemble_loc:
+            reference = {"path" : os.path.abspath(ensemble_loc),
+                         "population" : int(pop),
+                         "store" : bool(self.use_ensemble_store)}
+
+        checkpoint.set_relax_state(pop, reference, cell_optimizer, **kwargs)
+        checkpoint.save(self.minim, save_line_minimization = False)
+
+
+    def restart_from_checkpoint(self, filename = None):
+        """
+        RESTART FROM THE CHECKPOINT
+        ===========================
+
+        Restore the state of the relaxation from the checkpoint:
+        the dynamical matrix, the history and the line minimization of the minimizer,
+        the population, the cell optimizer and the cell steps on the current population
+        (the next time vc_relax is called).
+        The ensemble of the population is loaded from the disk.
+
+        Then continue the calculation calling relax or vc_relax with
+        restart_from_ens equal to the returned value. For example
+
+        >>> restart = relax.restart_from_checkpoint()
+        >>> relax.vc_relax(restart_from_ens = restart)
+
+        Parameters
+        ----------
+            filename : string, optional
+                The checkpoint file. If None, self.checkpoint_file is used.
+
+        Results
+        -------
+            restart_from_ens : bool
+                True if the ensemble of the current population has been loaded,
+                False if a new population must be generated.
+        """
+        if filename is None:
+            filename = self.checkpoint_file
+
+        header, arrays = sscha.Checkpoint.load(filename)
+        sscha.Checkpoint.restore_minimizer(self.minim, header, arrays)
+        self.start_pop = header["population"]
+
+        self.__restart_checkpoint__ = (header, arrays)
+
+        reference = header["ensemble"]
+        if reference is None:
+            print("The checkpoint does not reference an ensemble, population {} will be generated.".format(self.start_pop))
+            return False
+
+        ensemble = self.minim.ensemble
+        if reference["store"]:
+            store = sscha.EnsembleStore.EnsembleStore(reference["path"])
+            store.load([reference["population"]], ensemble = ensemble, only_computed = True)
+        else:
+            ensemble.load_bin(reference["path"], reference["population"])
+
+        if self.recycle_populations > 0:
+            self.recycle_previous_populations(reference["path"], reference["population"])
+
+        # The ensemble was strained by the cell steps on the same population (see vc_relax)
+        if np.max(np.abs(ensemble.dyn_0.structure.unit_cell - self.minim.dyn.structure.unit_cell)) > __EPSILON__:
+            ensemble.change_unit_cell(self.minim.dyn.structure.unit_cell)
+
+        print("Restarted from the checkpoint {} (population {})".format(filename, self.start_pop))
+        return True
+
+
     def relax(self, restart_from_ens = False, get_stress = False,
               ensemble_loc = None, start_pop = None, sobol = False,
                sobol_scramble = False, sobol_scatter = 0.0):
@@ -363,13 +694,15 @@ Error, the specified location to save the ensemble:
 
         pop = start_pop
 
+        # If True, the current population has been extended and it is minimized again
+        extended = False
+
         running = True
         while running:
             # Generate the ensemble
-            self.minim.ensemble.dyn_0 = self.minim.dyn.Copy()
-
-            if pop != start_pop or not restart_from_ens:
-                self.minim.ensemble.generate(self.N_configs, sobol = sobol, sobol_scramble = sobol_scramble, sobol_scatter = sobol_scatter)
+            if (pop != start_pop or not restart_from_ens) and not extended:
+                self.minim.ensemble.dyn_0 = self.minim.dyn.Copy()
+                self.minim.ensemble.generate(self.get_population_size(), sobol = sobol, sobol_scramble = sobol_scramble, sobol_scatter = sobol_scatter)
 
                 # Compute energies and forces
                 if isinstance(self.minim.ensemble, AiiDAEnsemble):
@@ -380,7 +713,12 @@ Error, the specified location to save the ensemble:
                 #self.minim.ensemble.get_energy_forces(self.calc, get_stress)
 
                 if ensemble_loc is not None and self.save_ensemble:
-                    self.minim.ensemble.save_bin(ensemble_loc, pop)
+                    self.save_population(ensemble_loc, pop)
+
+                if self.recycle_populations > 0:
+                    self.recycle_previous_populations(ensemble_loc, pop)
+
+            self.save_checkpoint(ensemble_loc, pop)
 
             self.minim.population = pop
             self.minim.init(delete_previous_data = False)
@@ -407,10 +745,28 @@ Error, the specified location to save the ensemble:
             if self.save_ensemble or self.save_dyn:
                 self.minim.dyn.save_qe("dyn_pop%d_" % pop)
 
+            self.record_population(pop)
+
             # Check if it is converged
             running = not self.minim.is_converged()
+
+            # Verify the convergence on a larger population
+            extended = False
+            if not running:
+                n_extra = self.get_extension_size()
+                if n_extra > 0:
+                    self.extend_population(n_extra, get_stress, sobol = sobol, sobol_scramble = sobol_scramble,
+                                           sobol_scatter = sobol_scatter)
+                    if ensemble_loc is not None and self.save_ensemble:
+                        self.save_population(ensemble_loc, pop)
+
+                    extended = True
+                    running = True
+                    continue
+
             pop += 1
 
+            self.save_checkpoint(ensemble_loc, pop, population_ready = False)
 
             if pop > self.max_pop:
                 running = False
@@ -437,6 +793,17 @@ Error, the specified location to save the ensemble:
         By default, all the degrees of freedom compatible with the symmetry group are relaxed in the cell.
         You can constrain the cell to keep the same shape by setting fix_cell_shape = True.
 
+        If max_cell_steps_per_population is greater than 0, after each cell step
+        the ensemble is strained to the new cell and reweighted (Ensemble.change_unit_cell),
+        and the dynamical matrix and the cell are relaxed again on the same population,
+        with the cell optimizer keeping its history.
+        A new population is generated only when the effective sample size
+        drops below the Kong-Liu threshold, or after max_cell_steps_per_population steps.
+
+        With adaptive_population, the size of each population is chosen as in relax,
+        and a population on which the dynamical matrix converged is extended
+        (and minimized again) before the cell step.
+
 
         NOTE:
             remember to setup the stress_offset variable of the SCHA_Minimizer,
@@ -569,6 +936,12 @@ Error, the specified location to save the ensemble:
         elif kind_minimizer == "BFGS":
             BFGS = sscha.Optimizer.BFGS_UC(self.minim.dyn.structure.unit_cell, static_bulk_modulus)
 
+        # Continue the cell optimization from the checkpoint
+        restart_checkpoint = self.__restart_checkpoint__
+        self.__restart_checkpoint__ = None
+        if restart_checkpoint is not None and restart_checkpoint[0]["cell_optimizer"] and kind_minimizer != "RPSD":
+            sscha.Checkpoint.restore_cell_optimizer(BFGS, *restart_checkpoint)
+
         # Initialize the bulk modulus
         # The gradient (stress) is in eV/A^3, we have the cell in Angstrom so the Hessian must be
         # in eV / A^6
@@ -578,20 +951,32 @@ Error, the specified location to save the ensemble:
             pop = self.start_pop
             start_pop = self.start_pop
 
+        # If True the ensemble has been strained to the current cell and it is used again
+        reuse_ensemble = False
+        n_cell_steps = 0
+
+        # Continue the cell steps on the strained population of the checkpoint
+        # (restart_from_checkpoint already strained the ensemble to the current cell)
+        if restart_checkpoint is not None and restart_from_ens:
+            n_cell_steps = int(restart_checkpoint[0]["relax"].get("n_cell_steps", 0))
+            reuse_ensemble = n_cell_steps > 0 and kind_minimizer != "RPSD"
+            if not reuse_ensemble:
+                n_cell_steps = 0
+
         running = True
         while running:
             # Compute the static bulk modulus if required
-            if kind_minimizer == "RPSD":
+            if kind_minimizer == "RPSD" and not reuse_ensemble:
                 # Compute the static bulk modulus
                 sbm = GetStaticBulkModulus(self.minim.dyn.structure, self.calc)
                 BFGS = sscha.Optimizer.SD_PREC_UC(self.minim.dyn.structure.unit_cell, sbm)
 
             # Generate the ensemble
-            self.minim.ensemble.dyn_0 = self.minim.dyn.Copy()
-            if pop != start_pop or not restart_from_ens:
+            if (pop != start_pop or not restart_from_ens) and not reuse_ensemble:
+                self.minim.ensemble.dyn_0 = self.minim.dyn.Copy()
                 #print("POP:", pop, "START_POP:", start_pop)
                 #print("RESTART_FROM_ENS:", restart_from_ens)
-                self.minim.ensemble.generate(self.N_configs, sobol=sobol, sobol_scramble = sobol_scramble, sobol_scatter = sobol_scatter)
+                self.minim.ensemble.generate(self.get_population_size(), sobol=sobol, sobol_scramble = sobol_scramble, sobol_scatter = sobol_scatter)
 
                 # Save also the generation
                 #if ensemble_loc is not None and self.save_ensemble:
@@ -607,9 +992,9 @@ Error, the specified location to save the ensemble:
 
                 
                 if ensemble_loc is not None and self.save_ensemble:
-                    self.minim.ensemble.save_bin(ensemble_loc, pop)
-
+                    self.save_population(ensemble_loc, pop)
 
+            self.save_checkpoint(ensemble_loc, pop, cell_optimizer = BFGS, n_cell_steps = n_cell_steps)
 
             self.minim.population = pop
             self.minim.init(delete_previous_data = False)
@@ -622,6 +1007,21 @@ Error, the specified location to save the ensemble:
 
             self.minim.finalize()
 
+            self.record_population(pop)
+
+            # Verify the convergence of the dynamical matrix on a larger population,
+            # before the cell step (the population must not be strained)
+            if n_cell_steps == 0 and self.minim.is_converged():
+                n_extra = self.get_extension_size()
+                if n_extra > 0:
+                    self.extend_population(n_extra, True, stress_numerical, sobol = sobol,
+                                           sobol_scramble = sobol_scramble, sobol_scatter = sobol_scatter)
+                    if ensemble_loc is not None and self.save_ensemble:
+                        self.save_population(ensemble_loc, pop)
+
+                    reuse_ensemble = True
+                    continue
+
             # Get the stress tensor [ev/A^3]
             stress_tensor, stress_err = self.minim.get_stress_tensor()
             stress_tensor *= sscha.SchaMinimizer.__RyBohr3_to_evA3__
@@ -714,7 +1114,12 @@ Error, the specified location to save the ensemble:
                 cell_gradient = (stress_tensor - I *target_press_evA3)
 
             new_uc = self.minim.dyn.structure.unit_cell.copy()
-            BFGS.UpdateCell(new_uc,  cell_gradient, fix_volume)
+            if n_cell_steps > 0:
+                # The stress of a strained population keeps the stresses of the configurations
+                # at zeroth order in the strain: it must not enter the history of the cell optimizer
+                BFGS.UpdateCellFrozen(new_uc, cell_gradient, fix_volume)
+            else:
+                BFGS.UpdateCell(new_uc,  cell_gradient, fix_volume)
 
             # Strain the structure and the q points preserving the symmetries
             self.minim.dyn.AdjustToNewCell(new_uc)
@@ -766,7 +1171,20 @@ Error, the specified location to save the ensemble:
 
             running = running1 or running2
 
-            pop += 1
+            # Try to perform the next cell step on the same population
+            reuse_ensemble = False
+            if running and n_cell_steps < self.max_cell_steps_per_population:
+                reuse_ensemble = self.strain_population()
+
+            if reuse_ensemble:
+                n_cell_steps += 1
+                print("[CELL] Cell step {} on population {}".format(n_cell_steps + 1, pop))
+            else:
+                n_cell_steps = 0
+                pop += 1
+
+            self.save_checkpoint(ensemble_loc, pop, population_ready = reuse_ensemble,
+                                 cell_optimizer = BFGS, n_cell_steps = n_cell_steps)
 
             if pop > self.max_pop:
                 running = False
@@ -38,6 +38,7 @@ import cellconstructor as CC
 import cellconstructor.Methods
 import time
 import warnings
+import hashlib
 import sys, os
 
 __SPGLIB__ = True
@@ -48,6 +49,7 @@ except:
 
 import sscha.Ensemble as Ensemble
 import sscha.Minimizer
+import sscha.Utilities as Utilities
 
 from sscha.Parallel import pprint as print
 
@@ -61,6 +63,10 @@ __EPSILON__ = 1e-4
 __evA3_to_GPa__ = 160.21766208
 __RyBohr3_to_evA3__ = __RyBohr3_to_GPa__ / __evA3_to_GPa__
 
+# Tolerance [A] to reuse the cached symmetries on a displaced structure
+__SYMMETRY_CACHE_THR__ = 1e-4
+__SYMMETRY_CACHE_SIZE__ = 4
+
 
 # Here the namelist variables
 __SCHA_NAMELIST__ = "inputscha"
@@ -88,6 +94,7 @@ __SCHA_GRADIOP__ = "gradi_op"
 __SCHA_POPULATION__ = "population"
 __SCHA_PRINTSTRESS__ = "print_stress"
 __SCHA_USESPGLIB__ = "use_spglib"
+__SCHA_ALGORITHM__ = "minimization_algorithm"
 
 
 __SCHA_ALLOWED_KEYS__ = [__SCHA_LAMBDA_A__, __SCHA_ISBIN__,
@@ -101,7 +108,8 @@ __SCHA_ALLOWED_KEYS__ = [__SCHA_LAMBDA_A__, __SCHA_ISBIN__,
                          __SCHA_TG__, __SCHA_SUPERCELLSIZE__,
                          __SCHA_MAXSTEPS__, __SCHA_STRESSOFFSET__,
                          __SCHA_GRADIOP__, __SCHA_POPULATION__,
-                         __SCHA_PRINTSTRESS__, __SCHA_USESPGLIB__]
+                         __SCHA_PRINTSTRESS__, __SCHA_USESPGLIB__,
+                         __SCHA_ALGORITHM__]
 __SCHA_MANDATORY_KEYS__ = [__SCHA_FILDYN__, __SCHA_NQIRR__, __SCHA_T__]
 
 __MAX_DIAG_ERROR_COUNTER__ = 5
@@ -134,12 +142,12 @@ class SSCHA_Minimizer(object):
                 the minimization is considered to be converged.
             minimization_algorithm : string
                 The minimization algoirthm used. One between 'sdes', 'cgrf' or
-                'auto'. They behave as follow:
+                'lbfgs'. They behave as follow:
                     - 'sdes' => Steepest Descent
-                    - 'cgrf' => Congjugate gradient
-                    - 'auto' => Uses cgrf if the error lower than the gradient, 'sdes' otherwise.
-
-                NOTE: Only sdes is currently implemented.
+                    - 'cgrf' => Preconditioned conjugate gradient (also 'cg')
+                    - 'lbfgs' => Limited memory BFGS, with the preconditioned gradient
+                    - 'auto' => Steepest Descent (as in the previous versions)
+                An unknown algorithm raises a ValueError when it is set.
             lambda_a : float
                 The force constant minimization step.
             **kwargs : any other attribute of this class
@@ -162,6 +170,10 @@ class SSCHA_Minimizer(object):
         # Usefull if you are close to the minimum and you prefer to speedup the minimization with a fixed step.
         self.fixed_step = False
 
+        # The number of trial steps (on each side) scored only by reweighting the ensemble
+        # each time the line minimization starts a new direction (see evaluate_trial_step).
+        self.n_trial_steps = 0
+
         dyn = None
         if ensemble is not None:
             dyn = self.ensemble.current_dyn.Copy()
@@ -207,6 +219,14 @@ class SSCHA_Minimizer(object):
         # NOTE: It is slower, but it enables using supercells
         self.use_spglib = False
 
+        # The symmetry engines already initialized (see get_symmetries)
+        # keyed by a fingerprint of the cell, the atoms and the symmetry method
+        self.symmetry_cache = {}
+
+        # If true (and use_spglib), the gradient is symmetrized on the force constants in the supercell,
+        # otherwise the symmetries are applied directly in q space (faster)
+        self.symmetrize_in_supercell = False
+
         # If True, enforce the symmetrization and the sum rule after each step
         self.enforce_sum_rule = True
 
@@ -250,6 +270,19 @@ class SSCHA_Minimizer(object):
         self.__KL__ = []
         self.__good_kasteps__ = []
 
+        # If given, a json record for each minimization step is appended to this file
+        # (free energy, gradients, effective sample size, timings of each phase and resources used)
+        self.metrics_file = None
+
+        # The wall time [s] of each phase of the last minimization step
+        self.__step_times__ = {}
+
+        # If given (a Checkpoint.Checkpoint), the state is saved after each minimization step
+        self.checkpoint = None
+
+        # The state of the line minimization restored from a checkpoint, used at the next run
+        self.minimizer_restart_state = None
+
 
 
         # Setup the attribute control
@@ -292,6 +325,9 @@ class SSCHA_Minimizer(object):
             if value and not Ensemble.__JULIA_EXT__:
                 raise ValueError("Error, Julia is not available")
 
+        if name == "minimization_algorithm":
+            sscha.Minimizer.get_algorithm(value)
+
     def set_minimization_step(self, step):
         """
         Set an uniform minimization step for both the dynamical matrix and the structure minimization.
@@ -310,6 +346,79 @@ class SSCHA_Minimizer(object):
         if self.dyn is None:
             self.dyn = self.ensemble.current_dyn.Copy()
 
+    def get_symmetries(self, structure, use_spglib = False):
+        """
+        GET THE SYMMETRY ENGINE
+        =======================
+
+        Return the CC.symmetries.QE_Symmetry of the structure, already initialized
+        (with SetupFromSPGLIB if use_spglib, otherwise with SetupQPoint).
+
+        The symmetries (with the IRT tables) are cached in self.symmetry_cache:
+        they are computed again only if the cell or the atoms changed,
+        or if the cached operations do not map the structure into itself anymore
+        (the atomic positions moved breaking the symmetries).
+
+        NOTE: SymmetrizeFCQ leaves the engine set up on the last q point:
+        call SetupQPoint() before using it at Gamma (e.g. SymmetrizeVector)
+        if the symmetries are not from spglib.
+
+        Parameters
+        ----------
+            structure : CC.Structure.Structure
+                The structure
+            use_spglib : bool
+                If true, the symmetries are detected with spglib.
+
+        Results
+        -------
+            qe_sym : CC.symmetries.QE_Symmetry
+                The symmetry engine.
+        """
+
+        key = _get_structure_fingerprint(structure, use_spglib)
+
+        if key in self.symmetry_cache:
+            qe_sym, symmetries, irts = self.symmetry_cache[key]
+            if _check_structure_symmetries(structure, symmetries, irts, __SYMMETRY_CACHE_THR__):
+                return qe_sym
+            del self.symmetry_cache[key]
+
+        qe_sym = CC.symmetries.QE_Symmetry(structure)
+        if use_spglib:
+            qe_sym.SetupFromSPGLIB()
+        else:
+            qe_sym.SetupQPoint(verbose = False)
+
+        if len(self.symmetry_cache) >= __SYMMETRY_CACHE_SIZE__:
+            del self.symmetry_cache[next(iter(self.symmetry_cache))]
+        symmetries = qe_sym.GetSymmetries()
+        self.symmetry_cache[key] = (qe_sym, symmetries, _get_symmetry_irts(structure, symmetries))
+
+        return qe_sym
+
+    def get_q_symmetries(self, structure, q_tot):
+        """
+        Return the symmetry tables to symmetrize in q space (see GetSpglibQSymmetries).
+        They are cached in self.symmetry_cache as the symmetry engines (see get_symmetries).
+        """
+        key = _get_structure_fingerprint(structure, "qspace", np.array(q_tot).round(8).tolist())
+
+        if key in self.symmetry_cache:
+            q_symmetries = self.symmetry_cache[key]
+            if _check_structure_symmetries(structure, q_symmetries["symmetries"], q_symmetries["irts"],
+                                           __SYMMETRY_CACHE_THR__):
+                return q_symmetries
+            del self.symmetry_cache[key]
+
+        q_symmetries = GetSpglibQSymmetries(structure, q_tot)
+
+        if len(self.symmetry_cache) >= __SYMMETRY_CACHE_SIZE__:
+            del self.symmetry_cache[next(iter(self.symmetry_cache))]
+        self.symmetry_cache[key] = q_symmetries
+
+        return q_symmetries
+
     def minimization_step(self, custom_function_gradient = None, timer=None):
         """
         Perform the single minimization step.
@@ -327,17 +436,13 @@ class SSCHA_Minimizer(object):
 
         # Setup the symmetries
         t1 = time.time()
-        qe_sym = CC.symmetries.QE_Symmetry(self.dyn.structure)
-
-        if self.use_spglib:
-            qe_sym.SetupFromSPGLIB()
-            self.N_symmetries = qe_sym.QE_nsym
-        else:
-            qe_sym.SetupQPoint(verbose = False)
-            self.N_symmetries = qe_sym.QE_nsym
+        qe_sym = self.get_symmetries(self.dyn.structure, self.use_spglib)
+        self.N_symmetries = qe_sym.QE_nsym
         t2 = time.time()
         if timer is not None:
             timer.add_timer("Setup symmetries", t2 - t1)
+        self.__step_times__ = {"symmetries" : t2 - t1}
+        t_phase = t2
 
 
 
@@ -367,12 +472,15 @@ class SSCHA_Minimizer(object):
             err = np.zeros_like(dyn_grad)
 
 
+        t1 = time.time()
+        self.__step_times__["dyn_gradient"] = t1 - t_phase
+        t_phase = t1
+
         # Perform the symmetrization
 #        qe_sym.ImposeSumRule(dyn_grad)
 #        qe_sym.SymmetrizeDynQ(dyn_grad, np.array([0,0,0]))
 #        qe_sym.ImposeSumRule(err)
 #        qe_sym.SymmetrizeDynQ(err, np.array([0,0,0]))
-        t1 = time.time()
         if self.minim_dyn:
             if not self.neglect_symmetries:
                 # Check if the symmetries must be applied in the supercell
@@ -389,6 +497,13 @@ class SSCHA_Minimizer(object):
 
                         #qe_sym.ApplySymmetriesToV2(err)
                         #CC.symmetries.CustomASR(err)
+                    elif not self.symmetrize_in_supercell:
+                        # Apply the space group directly on the q points
+                        q_symmetries = self.get_q_symmetries(self.dyn.structure, self.dyn.q_tot)
+                        if timer is not None:
+                            timer.execute_timed_function(ApplyQSymmetries, dyn_grad, q_symmetries)
+                        else:
+                            ApplyQSymmetries(dyn_grad, q_symmetries)
                     else:
                         # We have a supercell, we must generate the dynamical matrix in the supercell
                         if timer is not None:
@@ -411,8 +526,7 @@ class SSCHA_Minimizer(object):
                                 self.dyn.structure, super_structure)
 
                         # Lets generate a new symmetries for the supercell
-                        qe_sym_supcell = CC.symmetries.QE_Symmetry(super_structure)
-                        qe_sym_supcell.SetupFromSPGLIB()
+                        qe_sym_supcell = self.get_symmetries(super_structure, True)
 
                         t_6 = time.time()
 
@@ -490,6 +604,23 @@ class SSCHA_Minimizer(object):
 
 
 
+        t1 = time.time()
+        self.__step_times__["dyn_symmetrization"] = t1 - t_phase
+        t_phase = t1
+
+        # The L-BFGS needs also the gradient without preconditioning
+        # for the curvature of a new direction (see Minimizer.run_step)
+        raw_dyn_grad = None
+        raw_struct_grad = None
+        get_raw_gradient = (self.precond_dyn or self.precond_wyck) and not self.use_julia
+        get_raw_gradient = get_raw_gradient and self.minimizer is not None and self.minimizer.is_new_direction()
+        get_raw_gradient = get_raw_gradient and sscha.Minimizer.get_algorithm(self.minimization_algorithm) == "lbfgs"
+        if get_raw_gradient:
+            if self.minim_dyn and self.precond_dyn:
+                raw_dyn_grad, _ = self.ensemble.get_preconditioned_gradient_parallel(True, True, preconditioned=0)
+            else:
+                raw_dyn_grad = dyn_grad
+
         # If the structure must be minimized perform the step
         struct_grad = np.zeros(self.dyn.structure.coords.shape, dtype = np.double, order = "C")
         if self.minim_struct:
@@ -516,6 +647,10 @@ class SSCHA_Minimizer(object):
                     struct_precond = GetStructPrecond(self.ensemble.current_dyn, ignore_small_w = self.ensemble.ignore_small_w, w_pols = w_pols)
                 struct_grad_precond = struct_precond.dot(struct_grad_reshaped)
                 struct_grad = struct_grad_precond.reshape( (self.dyn.structure.N_atoms, 3))
+                if get_raw_gradient:
+                    raw_struct_grad = struct_grad_reshaped.reshape( (self.dyn.structure.N_atoms, 3)).copy()
+            elif get_raw_gradient:
+                raw_struct_grad = struct_grad
             t2 = time.time()
 
             if timer:
@@ -524,6 +659,7 @@ class SSCHA_Minimizer(object):
 
             # Apply the symmetries to the forces
             if not self.neglect_symmetries:
+                # The cached engine may be on another q point after SymmetrizeFCQ
                 if not self.use_spglib:
                     qe_sym.SetupQPoint()
                 if timer:
@@ -544,6 +680,10 @@ class SSCHA_Minimizer(object):
             #self.dyn.structure.coords -= self.min_step_struc * struct_grad
 
 
+        t1 = time.time()
+        self.__step_times__["struct_gradient"] = t1 - t_phase
+        t_phase = t1
+
         # Perform the gradient restriction
         if custom_function_gradient is not None:
 
@@ -612,10 +752,11 @@ Error, the custom_function_gradient must have either 2 or 3 arguments:
         while not is_diag_ok:
             is_diag_ok = True
             if timer:
-                timer.execute_timed_function(self.minimizer.update_dyn, new_kl_ratio, dyn_grad, struct_grad)
+                timer.execute_timed_function(self.minimizer.update_dyn, new_kl_ratio, dyn_grad, struct_grad,
+                                             raw_dyn_grad, raw_struct_grad)
                 new_dyn, new_struct = timer.execute_timed_function(self.minimizer.get_dyn_struct)
             else:
-                self.minimizer.update_dyn(new_kl_ratio, dyn_grad, struct_grad)
+                self.minimizer.update_dyn(new_kl_ratio, dyn_grad, struct_grad, raw_dyn_grad, raw_struct_grad)
                 new_dyn, new_struct = self.minimizer.get_dyn_struct()
 
 
@@ -714,6 +855,8 @@ Error, exceeded the maximum number of step with an imaginary frequency ({}).
         if self.minimizer.new_direction:
             self.__good_kasteps__.append(len(self.__fe__) - 1)
 
+        self.__step_times__["update"] = time.time() - t_phase
+
     def setup_from_namelist(self, input_file):
         """
         SETUP THE MINIMIZATION
@@ -872,6 +1015,10 @@ Error, exceeded the maximum number of step with an imaginary frequency ({}).
 
             self.gradi_op = namelist[__SCHA_GRADIOP__]
 
+        if __SCHA_ALGORITHM__ in keys:
+            # Validated by __setattr__
+            self.minimization_algorithm = str(namelist[__SCHA_ALGORITHM__])
+
         # Ensemble keywords
         if __SCHA_DATADIR__ in keys:
             # We can load an ensemble, check for the population number
@@ -1014,6 +1161,56 @@ Error, exceeded the maximum number of step with an imaginary frequency ({}).
             else:
                 self.ensemble.update_weights_fourier(self.dyn, self.ensemble.current_T)
 
+    def evaluate_trial_step(self, dynq, struct):
+        """
+        EVALUATE A TRIAL STEP
+        =====================
+
+        Score a candidate dynamical matrix only by reweighting the ensemble:
+        no gradient is computed.
+        The candidate is symmetrized as the accepted step (only if enforce_sum_rule),
+        so the score refers to the same dynamical matrix the step would produce.
+        The ensemble weights are left on the candidate: call update() before using them.
+
+        Parameters
+        ----------
+            dynq : ndarray(nq, 3*nat, 3*nat)
+                The candidate dynamical matrix
+            struct : ndarray(nat, 3)
+                The candidate structure
+
+        Results
+        -------
+            free_energy : float
+                The free energy [Ry] of the candidate
+                (np.inf if the candidate has imaginary frequencies)
+            kl_ratio : float
+                The Kong-Liu effective sample size ratio of the candidate
+        """
+        trial_dyn = self.dyn.Copy()
+        for iq in range(len(trial_dyn.q_tot)):
+            trial_dyn.dynmats[iq] = dynq[iq, :, :]
+        if self.minim_struct:
+            trial_dyn.structure.coords[:,:] = np.real(struct)
+
+        # Symmetrize as in minimization_step
+        if self.enforce_sum_rule and (not self.neglect_symmetries):
+            trial_dyn.Symmetrize(use_spglib = self.use_spglib)
+
+        # Reject the candidates with imaginary frequencies (the weights are not updated)
+        w, _, _, _, trans = self.ensemble.get_supercell_modes(trial_dyn)
+        if np.min(w[~trans]) <= 0:
+            return np.inf, 0
+
+        if self.use_julia:
+            self.ensemble.update_weights_fourier(trial_dyn, self.ensemble.current_T)
+        else:
+            self.ensemble.update_weights(trial_dyn, self.ensemble.current_T)
+
+        free_energy = self.ensemble.get_free_energy()
+        kl_ratio = self.ensemble.get_effective_sample_size() / self.ensemble.N
+        return free_energy, kl_ratio
+
     def get_free_energy(self, return_error = False):
         """
         SSCHA FREE ENERGY
@@ -1269,17 +1466,30 @@ WARNING, the preconditioning is activated together with a root representation.
             self.gradi_op = "gc"
 
         # Prepare the minimizer
-        self.minimizer = sscha.Minimizer.Minimizer(self.minim_struct, fixed_step= self.fixed_step, root_representation = self.root_representation, verbose = verbose >= 1)
+        self.minimizer = sscha.Minimizer.Minimizer(self.minim_struct, algorithm = self.minimization_algorithm, fixed_step= self.fixed_step, root_representation = self.root_representation, verbose = verbose >= 1)
         self.minimizer.init(self.dyn, self.ensemble.get_effective_sample_size() / self.ensemble.N)
 
         # Define the starting step as a weighted average on the step in the dynamical matrix a
         self.minimizer.step = self.min_step_dyn
+        self.minimizer.n_trial_steps = self.n_trial_steps
+        self.minimizer.trial_function = self.evaluate_trial_step
         if self.minim_struct:
             self.minimizer.struct_step_ratio = self.min_step_struc / self.min_step_dyn
 
+        # Continue the line minimization from the checkpoint
+        if self.minimizer_restart_state is not None:
+            self.minimizer.set_state(self.minimizer_restart_state)
+            self.minimizer_restart_state = None
+
+        # Prepare the stream of the step metrics
+        metrics = None
+        if self.metrics_file is not None:
+            metrics = Utilities.MetricsStream(self.metrics_file)
 
 
         while running:
+            t_step = time.time()
+
             # Invoke the custom fuction if any
             if custom_function_pre is not None:
                 custom_function_pre(self)
@@ -1298,10 +1508,14 @@ WARNING, the preconditioning is activated together with a root representation.
             # Perform the minimization step
             if timer is not None:
                 timer.execute_timed_function(self.minimization_step, custom_function_gradient)
+                t1 = time.time()
                 im_freqs = timer.execute_timed_function(self.check_imaginary_frequencies)
             else:
                 self.minimization_step(custom_function_gradient)
+                t1 = time.time()
                 im_freqs = self.check_imaginary_frequencies()
+            step_times = dict(self.__step_times__)
+            step_times["imaginary_frequencies"] = time.time() - t1
 
 
             if im_freqs:
@@ -1310,6 +1524,7 @@ WARNING, the preconditioning is activated together with a root representation.
                 break
 
             # Compute the free energy and its error
+            t1 = time.time()
             fe, err = self.get_free_energy(True)
             fe -= self.eq_energy
             self.__fe__.append(np.real(fe))
@@ -1330,6 +1545,7 @@ WARNING, the preconditioning is activated together with a root representation.
                 kl_sample_size = self.ensemble.get_effective_sample_size()
 
             self.__KL__.append(kl_sample_size)
+            step_times["free_energy"] = time.time() - t1
 
             # Print the step
             if verbose >= 1:
@@ -1358,10 +1574,12 @@ WARNING, the preconditioning is activated together with a root representation.
 
 
             # Get the stopping criteria
+            t1 = time.time()
             if timer is not None:
                 running = not timer.execute_timed_function(self.check_stop)
             else:
                 running = not self.check_stop()
+            step_times["check_stop"] = time.time() - t1
 
             if verbose >= 1:
                 print ("Check the stopping criteria: Running = ", running)
@@ -1379,6 +1597,30 @@ WARNING, the preconditioning is activated together with a root representation.
                 else:
                     custom_function_post(self)
 
+            # Append the step to the metrics stream
+            if metrics is not None:
+                record = {"population" : int(self.population),
+                          "step" : len(self.__fe__) - 1,
+                          "wall_time" : time.time() - t_step,
+                          "phases" : step_times,
+                          "free_energy" : float(self.__fe__[-1]),
+                          "free_energy_err" : float(self.__fe_err__[-1]),
+                          "gc" : float(np.real(self.__gc__[-1])),
+                          "gc_err" : float(np.real(self.__gc_err__[-1])),
+                          "gw" : float(np.real(self.__gw__[-1])),
+                          "gw_err" : float(np.real(self.__gw_err__[-1])),
+                          "kl" : float(self.__KL__[-1]),
+                          "kl_ratio" : float(self.__KL__[-1]) / self.ensemble.N,
+                          "n_configs" : int(self.ensemble.N),
+                          "step_size" : float(self.minimizer.step),
+                          "new_direction" : bool(self.minimizer.new_direction),
+                          "running" : bool(running)}
+                record.update(Utilities.get_resource_usage())
+                metrics.write(record)
+
+            if self.checkpoint is not None:
+                self.checkpoint.save(self)
+
 
             if verbose >= 2:
                 timer.print_report(is_master = True)
@@ -1397,6 +1639,9 @@ WARNING, the preconditioning is activated together with a root representation.
             self.update()
             print ()
 
+        if self.checkpoint is not None:
+            self.checkpoint.wait()
+
 
     def finalize(self, verbose = 1, timer=None):
         """
@@ -1527,18 +1772,15 @@ WARNING, the preconditioning is activated together with a root representation.
 
         # Get the frequencies
         #superdyn = self.dyn.GenerateSupercellDyn(self.ensemble.supercell)
-        w = self.ensemble.current_w.copy()
-        pols = self.ensemble.current_pols.copy()
+        # The diagonalization and the translations are cached by the ensemble
+        w, pols, _, _, trans_mask = self.ensemble.get_supercell_modes(self.ensemble.current_dyn)
+        w = w.copy()
+        pols = pols.copy()
+        trans_mask = ~trans_mask
         #w, pols = self.dyn.DiagonalizeSupercell()#.DyagDinQ(0)
         ss = self.ensemble.supercell_structure.copy()
         #ss = self.dyn.structure.generate_supercell(self.dyn.GetSupercell())
 
-        # Get translations
-        if not self.ensemble.ignore_small_w:
-            trans_mask = ~CC.Methods.get_translations(pols, ss.get_masses_array())
-        else:
-            trans_mask = np.abs(w) > CC.Phonons.__EPSILON_W__
-
         current_n_trans = np.sum((~trans_mask).astype(int))
 
         # Remove translations
@@ -1555,10 +1797,7 @@ WARNING, the preconditioning is activated together with a root representation.
 
             #ss0 = self.ensemble.dyn_0.structure.generate_supercell(self.dyn.GetSupercell())
 
-            if not self.ensemble.ignore_small_w:
-                trans_mask = ~CC.Methods.get_translations(pold, ss.get_masses_array())
-            else:
-                trans_mask = np.abs(wold) > CC.Phonons.__EPSILON_W__
+            trans_mask = ~self.ensemble.get_supercell_modes(self.ensemble.dyn_0)[-1]
 
             old_n_trans = np.sum((~trans_mask).astype(int))
 
@@ -1796,6 +2035,207 @@ You can try to fix this error setting the {} variable of {} class to True.
 
 
 
+def _get_structure_fingerprint(structure, *extra):
+    """
+    Get a fingerprint of the cell and the atomic types of the structure
+    (the atomic positions are not included, as they change along the minimization).
+    """
+    sha = hashlib.sha1()
+    sha.update(np.ascontiguousarray(structure.unit_cell, dtype = np.double).tobytes())
+    sha.update(repr(list(structure.atoms)).encode())
+    sha.update(repr(extra).encode())
+    return sha.hexdigest()
+
+
+def _get_symmetry_irts(structure, symmetries):
+    """
+    Get the atom in which each symmetry (3x4 matrices in crystal coordinates)
+    maps each atom of the structure.
+    This is done once, when the symmetries are cached (see _check_structure_symmetries).
+    """
+    unit_cell = structure.unit_cell
+    crystal = structure.coords.dot(np.linalg.inv(unit_cell))
+    atoms = np.array(structure.atoms)
+    same_type = atoms[:, np.newaxis] == atoms[np.newaxis, :]
+
+    irts = np.zeros((len(symmetries), structure.N_atoms), dtype = int)
+    for i, sym in enumerate(symmetries):
+        new_crystal = crystal.dot(sym[:, :3].T) + sym[:, 3]
+
+        delta = new_crystal[:, np.newaxis, :] - crystal[np.newaxis, :, :]
+        delta -= np.round(delta)
+        distance = np.linalg.norm(delta.dot(unit_cell), axis = 2)
+        distance[~same_type] = np.inf
+        irts[i, :] = np.argmin(distance, axis = 1)
+
+    return irts
+
+
+def _check_structure_symmetries(structure, symmetries, irts, threshold):
+    """
+    Check if all the symmetries (3x4 matrices in crystal coordinates)
+    map the structure into itself within the threshold [A].
+
+    Each atom is compared only with its image in the IRT table (see _get_symmetry_irts),
+    so the cost is O(n_sym * nat).
+    """
+    if len(symmetries) == 0:
+        return True
+
+    unit_cell = structure.unit_cell
+    crystal = structure.coords.dot(np.linalg.inv(unit_cell))
+    syms = np.array(symmetries)
+
+    new_crystal = np.einsum("ab, scb -> sac", crystal, syms[:, :, :3]) + syms[:, np.newaxis, :, 3]
+
+    delta = new_crystal - crystal[irts, :]
+    delta -= np.round(delta)
+    distance = np.linalg.norm(delta.dot(unit_cell), axis = 2)
+
+    return np.max(distance) <= threshold
+
+
+def GetSpglibQSymmetries(structure, q_tot, symprec = 1e-5):
+    """
+    SPACE GROUP IN Q SPACE
+    ======================
+
+    Map the space group operations of the structure (detected with spglib)
+    on the q points of the dynamical matrix, to symmetrize it directly in q space
+    (see ApplyQSymmetries).
+
+    For each operation :math:`\\{S|t\\}`, the atom :math:`\\kappa` goes in :math:`\\kappa' = irt(\\kappa)`
+    translated by the lattice vector :math:`L_\\kappa = S\\tau_\\kappa + t - \\tau_{\\kappa'}`, and
+
+    .. math::
+
+        D_{\\kappa'\\lambda'}(Sq) = e^{2\\pi i Sq\\cdot(L_\\lambda - L_\\kappa)} S D_{\\kappa\\lambda}(q) S^\\dagger
+
+    Parameters
+    ----------
+        structure : CC.Structure.Structure
+            The unit cell structure
+        q_tot : ndarray(size = (nq, 3))
+            The q points of the dynamical matrix (as in dyn.q_tot)
+        symprec : float
+            The tolerance of spglib
+
+    Results
+    -------
+        q_symmetries : dict
+            The symmetry tables: the cartesian rotations, the irt, the q index of Sq,
+            the phases of each atom, and the index of -q for the time reversal.
+            The symmetries in the CC format are in the "symmetries" key.
+    """
+    if not __SPGLIB__:
+        raise ImportError("Error, the q space symmetrization requires spglib")
+
+    spglib_syms = spglib.get_symmetry(structure.get_ase_atoms(), symprec = symprec)
+    rotations = spglib_syms["rotations"]
+    translations = spglib_syms["translations"]
+    n_syms = len(rotations)
+
+    cell = structure.unit_cell
+    nat = structure.N_atoms
+    q_tot = np.array(q_tot, dtype = np.float64)
+    nq = q_tot.shape[0]
+
+    crystal = structure.coords.dot(np.linalg.inv(cell))
+    q_crystal = q_tot.dot(cell.T)
+
+    def get_q_index(q_cryst):
+        delta = q_crystal[np.newaxis, :, :] - q_cryst[:, np.newaxis, :]
+        delta -= np.round(delta)
+        dist = np.sum(np.abs(delta), axis = 2)
+        index = np.argmin(dist, axis = 1)
+        if np.max(dist[np.arange(len(index)), index]) > __EPSILON__:
+            raise ValueError("Error, the q grid is not compatible with the symmetries of the structure")
+        return index
+
+    cart_rotations = np.zeros((n_syms, 3, 3), dtype = np.float64)
+    irts = np.zeros((n_syms, nat), dtype = int)
+    q_index = np.zeros((n_syms, nq), dtype = int)
+    phases = np.zeros((n_syms, nq, nat), dtype = np.complex128)
+    symmetries = []
+    for i in range(n_syms):
+        R = rotations[i]
+        t = translations[i]
+        cart_rotations[i, :, :] = cell.T.dot(R).dot(np.linalg.inv(cell.T))
+
+        sym = np.zeros((3, 4), dtype = np.float64)
+        sym[:, :3] = R
+        sym[:, 3] = t
+        symmetries.append(sym)
+
+        # Find the irt and the lattice vectors
+        new_crystal = crystal.dot(R.T) + t
+        for k in range(nat):
+            delta = new_crystal[k, :] - crystal
+            delta_red = delta - np.round(delta)
+            dist = np.linalg.norm(delta_red.dot(cell), axis = 1)
+            dist[np.array(structure.atoms) != structure.atoms[k]] = np.inf
+            irts[i, k] = np.argmin(dist)
+        L = (new_crystal - crystal[irts[i], :]).round().dot(cell)
+
+        # Map the q points (the rotation of a reciprocal vector in crystal coordinates)
+        Sq = q_tot.dot(cart_rotations[i].T)
+        q_index[i, :] = get_q_index(Sq.dot(cell.T))
+        phases[i, :, :] = np.exp(2j * np.pi * Sq.dot(L.T))
+
+    return {"rotations" : cart_rotations,
+            "irts" : irts,
+            "q_index" : q_index,
+            "phases" : phases,
+            "minus_q" : get_q_index(-q_crystal),
+            "symmetries" : symmetries}
+
+
+def ApplyQSymmetries(fcq, q_symmetries):
+    """
+    SYMMETRIZE IN Q SPACE
+    =====================
+
+    Symmetrize the dynamical matrix (or its gradient) directly on the q points,
+    with the tables computed by GetSpglibQSymmetries.
+    This is equivalent to symmetrize the force constants in the supercell,
+    but avoids the transformations to and from the supercell.
+    Also the hermitianity and the time reversal symmetry :math:`D(-q) = D(q)^*` are imposed.
+
+    Parameters
+    ----------
+        fcq : ndarray(size = (nq, 3*nat, 3*nat), dtype = np.complex128)
+            The dynamical matrix at each q. It is modified in place.
+        q_symmetries : dict
+            The output of GetSpglibQSymmetries
+    """
+    nq = fcq.shape[0]
+    nat = fcq.shape[1] // 3
+    n_syms = len(q_symmetries["rotations"])
+
+    blocks = fcq.reshape((nq, nat, 3, nat, 3))
+    new_blocks = np.zeros_like(blocks)
+
+    for i in range(n_syms):
+        S = q_symmetries["rotations"][i]
+        irt = q_symmetries["irts"][i]
+        p = q_symmetries["phases"][i]
+
+        rotated = np.einsum("ab, qkblc, dc -> qkald", S, blocks, S)
+        rotated *= np.conj(p)[:, :, np.newaxis, np.newaxis, np.newaxis]
+        rotated *= p[:, np.newaxis, np.newaxis, :, np.newaxis]
+
+        # Permute the atoms and the q points
+        inv_irt = np.argsort(irt)
+        rotated = rotated[:, inv_irt, :, :, :][:, :, :, inv_irt, :]
+        new_blocks[q_symmetries["q_index"][i], ...] += rotated
+
+    new_fcq = new_blocks.reshape((nq, 3*nat, 3*nat)) / n_syms
+
+    # Hermitianity and time reversal
+    new_fcq = 0.5 * (new_fcq + np.conj(np.transpose(new_fcq, (0, 2, 1))))
+    fcq[:, :, :] = 0.5 * (new_fcq + np.conj(new_fcq[q_symmetries["minus_q"], :, :]))
+
+
 def get_root_dyn(dyn_fc, root_representation):
     """
     Get the root dyn matrix
@@ -1867,32 +2307,8 @@ def PerformRootStep(dyn_q, grad_q, step_size=1, root_representation = "sqrt", mi
     if nq != np.shape(grad_q)[0]:
         raise ValueError("Error, the number of q point of the dynamical matrix %d and gradient %d does not match!" % (nq, np.shape(grad_q)[0]))
 
-    # Create the root representation
-    new_dyn = np.zeros(np.shape(dyn_q), dtype = np.complex128)
-    new_grad = np.zeros(np.shape(dyn_q), dtype = np.complex128)
-
-    # Copy
-    new_dyn[:,:,:] = dyn_q
-    new_grad[:,:,:] = grad_q
-
-    # Cycle over all the q points
-    if root_representation != "normal":
-        for iq in range(nq):
-            # Dyagonalize the matrix
-            eigvals, eigvects = np.linalg.eigh(dyn_q[iq, :, :])
-
-            # Regularize acustic modes
-            if iq == 0:
-                eigvals[eigvals < 0] = 0.
-
-            # The sqrt conversion
-            new_dyn[iq, :, :] = np.einsum("a, ba, ca", np.sqrt(eigvals), eigvects, np.conj(eigvects))
-            new_grad[iq, :, :] = new_dyn[iq, :, :].dot(grad_q[iq, :, :]) + grad_q[iq, :, :].dot(new_dyn[iq, :, :])
-
-            # If root4 another loop needed
-            if root_representation == "root4":
-                new_dyn[iq, :, :] = np.einsum("a, ba, ca", np.sqrt(np.sqrt(eigvals)), eigvects, np.conj(eigvects))
-                new_grad[iq, :, :] = new_dyn[iq, :, :].dot(new_grad[iq, :, :]) + new_grad[iq, :, :].dot(new_dyn[iq, :, :])
+    # Create the root representation (all the q points at once)
+    new_dyn, new_grad = sscha.Minimizer.get_root_dyn_grad(dyn_q, grad_q, root_representation)
 
     # Perform the step
     # For now only steepest descent implemented
@@ -1902,14 +2318,8 @@ def PerformRootStep(dyn_q, grad_q, step_size=1, root_representation = "sqrt", mi
         raise ValueError("Error, the given minimization_algorithm '%s' is not implemented." % minimization_algorithm)
 
 
-    if root_representation != "normal":
-        for iq in range(nq):
-            # The square root conversion
-            new_dyn[iq, :, :] = new_dyn[iq, :,:].dot(new_dyn[iq, :,:])
-
-            # The root4 conversion
-            if root_representation == "root4":
-                new_dyn[iq, :, :] = new_dyn[iq, :,:].dot(new_dyn[iq, :,:])
+    # Go back to the standard representation
+    new_dyn = sscha.Minimizer.get_standard_dyn(new_dyn, root_representation)
 
     # Return the matrix
     return new_dyn
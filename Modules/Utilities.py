@@ -8,10 +8,21 @@ CGF : custom_gradient_function
 """
 from __future__ import print_function
 import difflib
+import sys, os
+import json
+import time
+import threading
 import cellconstructor as CC
 import cellconstructor.Phonons
+import cellconstructor.Settings
 import numpy as np
 
+try:
+    import resource
+    __RESOURCE__ = True
+except ImportError:
+    __RESOURCE__ = False
+
 from sscha.Parallel import pprint as print
 import sscha.Parallel
 
@@ -434,6 +445,75 @@ class ModeProjection:
 
 
 
+class MetricsStream(object):
+    def __init__(self, filename):
+        """
+        METRICS STREAM
+        ==============
+
+        An append-only stream of json records, one per line.
+        Each record is written and flushed as soon as it is produced,
+        so the file can be followed during long runs (e.g. with tail -f)
+        and parsed line by line to monitor stalls or the collapse of the effective sample size.
+
+        Only the master process writes on the file.
+
+        Parameters
+        ----------
+            filename : string
+                The path to the file. If it already exists, the new records are appended.
+        """
+        self.filename = filename
+
+    def write(self, record):
+        """
+        Append a record (a dictionary of json serializable values) to the stream.
+        The time stamp (unix time) is added to the record.
+        """
+        if not sscha.Parallel.am_i_the_master():
+            return
+
+        data = {"timestamp" : time.time()}
+        data.update(record)
+
+        with open(self.filename, "a") as fp:
+            fp.write(json.dumps(data) + "\n")
+            fp.flush()
+
+
+def get_resource_usage():
+    """
+    Get the resources used by the current process.
+
+    Results
+    -------
+        usage : dict
+            - max_rss_mb : the memory high-water mark of the process in MB (None if not available)
+            - n_threads : the number of python threads alive
+            - omp_num_threads : the value of OMP_NUM_THREADS (None if not set)
+            - n_processes : the number of MPI processes
+    """
+    max_rss = None
+    if __RESOURCE__:
+        max_rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+        # ru_maxrss is in bytes on macOS, in kilobytes on linux
+        if sys.platform == "darwin":
+            max_rss /= 1024
+        max_rss /= 1024.
+
+    omp_threads = os.environ.get("OMP_NUM_THREADS", None)
+    if omp_threads is not None:
+        try:
+            omp_threads = int(omp_threads)
+        except ValueError:
+            pass
+
+    return {"max_rss_mb" : max_rss,
+            "n_threads" : threading.active_count(),
+            "omp_num_threads" : omp_threads,
+            "n_processes" : CC.Settings.GetNProc()}
+
+
 class IOInfo:
     
     save_weights = False
@@ -4,6 +4,7 @@ from __future__ import division
 
 import sys, os
 import shutil
+import numpy as np
 import cellconstructor as CC
 import cellconstructor.Phonons
 
@@ -34,5 +35,53 @@ def test_generate_ensemble_sup():
     ens.save(DATA_DIR, POPULATION)
     shutil.rmtree(DATA_DIR, ignore_errors= True)
 
+def test_generate_ensemble_vectorized():
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    np.random.seed(0)
+
+    T = 100
+    NQIRR = 3
+    SUPERCELL = (2,1,2)
+    N_RANDOM = 2000
+
+    dyn = CC.Phonons.Phonons("dyn", NQIRR)
+
+    ens = sscha.Ensemble.Ensemble(dyn, T, SUPERCELL)
+    ens.generate(N_RANDOM, vectorized = True)
+
+    # Check the antithetic pairs
+    assert np.allclose(ens.u_disps[0::2, :], -ens.u_disps[1::2, :])
+    for i in range(N_RANDOM):
+        assert np.allclose(ens.structures[i].coords, ens.xats[i, :, :])
+
+    # Check the distribution: <u Upsilon u> must be the number of (non translational) modes
+    ups = np.real(dyn.GetUpsilonMatrix(T))
+    u_bohr = ens.u_disps * CC.Units.A_TO_BOHR
+    chi2 = np.einsum("ia, ab, ib -> i", u_bohr, ups, u_bohr)
+    n_modes = 3 * ens.supercell_structure.N_atoms - 3
+    assert np.abs(np.mean(chi2) - n_modes) < 5 * np.sqrt(2 * n_modes / (N_RANDOM // 2))
+
+def test_generate_ensemble_threaded():
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    T = 100
+    dyn = CC.Phonons.Phonons("dyn", 3)
+
+    # The threaded generation must give the same ensemble
+    ensembles = []
+    for n_threads in [1, 3]:
+        np.random.seed(0)
+        ens = sscha.Ensemble.Ensemble(dyn, T, dyn.GetSupercell())
+        ens.generate(100, vectorized = True, n_threads = n_threads)
+        ensembles.append(ens)
+
+    assert np.allclose(ensembles[0].xats, ensembles[1].xats)
+    assert np.allclose(ensembles[0].u_disps, ensembles[1].u_disps)
+
 if __name__ == "__main__":
     test_generate_ensemble_sup()
+    test_generate_ensemble_vectorized()
+    test_generate_ensemble_threaded()
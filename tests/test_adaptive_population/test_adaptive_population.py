@@ -0,0 +1,136 @@
+# -*- coding: utf-8 -*-
+from __future__ import print_function
+from __future__ import division
+
+import sys, os
+import numpy as np
+import cellconstructor as CC
+import cellconstructor.Phonons
+
+import sscha, sscha.Ensemble
+import sscha.SchaMinimizer
+import sscha.Relax
+
+"""
+This test checks the adaptive size of the populations in the relax:
+the size grows when the gradient approaches its stochastic error.
+"""
+
+def test_adaptive_population(verbose = False):
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    DATA_PATH = "../../Examples/ensemble_data_test/"
+
+    dyn_start = CC.Phonons.Phonons(os.path.join(DATA_PATH, "dyn"))
+
+    ens = sscha.Ensemble.Ensemble(dyn_start, 0, dyn_start.GetSupercell())
+    ens.load(DATA_PATH, 2, 1000)
+
+    minim = sscha.SchaMinimizer.SSCHA_Minimizer(ens)
+    minim.min_step_dyn = 0.5
+    minim.meaningful_factor = 1e-10
+    minim.max_ka = 3
+    minim.init()
+    minim.run(verbose = 0)
+
+    relax = sscha.Relax.SSCHA(minim, N_configs = 4000, adaptive_population = True)
+
+    # Without adaptive_population always N_configs
+    relax.adaptive_population = False
+    assert relax.get_population_size() == relax.N_configs
+    relax.adaptive_population = True
+
+    # The first population uses the minimum size
+    assert relax.get_population_size() == relax.N_configs // 8
+
+    relax.record_population(2)
+    record = relax.population_history[-1]
+    assert record["n_configs"] == ens.N
+    assert record["ess"] <= ens.N + 1e-8
+    assert record["gradient_ratio"] > 0
+
+    n_configs = relax.get_population_size()
+    assert n_configs % 2 == 0
+    assert relax.adaptive_min_configs is None
+    assert relax.N_configs // 8 <= n_configs <= relax.N_configs
+    assert n_configs >= ens.N // 2
+
+    # Far from convergence the next population is small, close to convergence it is the largest
+    for ratio, expected in [(1e6, max(relax.N_configs // 8, ens.N // 2)), (1e-6, relax.N_configs)]:
+        relax.population_history[-1]["gradient_ratio"] = ratio
+        n = relax.get_population_size()
+        if verbose:
+            print("Gradient ratio {} => N = {}".format(ratio, n))
+        assert n == expected + expected % 2
+
+    # The converged population is extended up to N_configs
+    relax.population_history[-1]["gradient_ratio"] = 1e-6
+    minim.kong_liu_ratio = 0
+    assert relax.get_extension_size() == relax.N_configs - ens.N
+
+    # A population out of the statistical sampling is not extended
+    minim.kong_liu_ratio = 1.1
+    assert relax.get_extension_size() == 0
+
+
+class HarmonicEnsemble(sscha.Ensemble.Ensemble):
+    """
+    An ensemble computed with the harmonic forces of dyn_0 (no calculator)
+    """
+    def compute_ensemble(self, calculator, compute_stress = True, stress_numerical = False,
+                         cluster = None, verbose = True, timer = None):
+        self.update_weights(self.dyn_0, self.T0)
+        self.forces[:, :, :] = self.sscha_forces
+        self.energies[:] = self.sscha_energies
+        self.force_computed[:] = True
+        self.has_stress = False
+
+
+def test_extend_population(verbose = False):
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    np.random.seed(0)
+
+    DATA_PATH = "../../Examples/ensemble_data_test/"
+    N_START = 20
+    N_EXTRA = 30
+
+    dyn_start = CC.Phonons.Phonons(os.path.join(DATA_PATH, "dyn"))
+    dyn_target = CC.Phonons.Phonons(os.path.join(DATA_PATH, "dyn1_population2"), full_name = True)
+
+    ens = HarmonicEnsemble(dyn_start, 0, dyn_start.GetSupercell())
+    ens.generate(N_START)
+    ens.compute_ensemble(None, False)
+    xats = ens.xats.copy()
+    forces = ens.forces.copy()
+
+    minim = sscha.SchaMinimizer.SSCHA_Minimizer(ens)
+    relax = sscha.Relax.SSCHA(minim, N_configs = N_START + N_EXTRA, adaptive_population = True)
+
+    # The new configurations are generated by dyn_0 and merged
+    relax.extend_population(N_EXTRA)
+    assert ens.N == N_START + N_EXTRA
+    assert len(ens.structures) == N_START + N_EXTRA
+    assert ens.force_computed.shape == (N_START + N_EXTRA,)
+    assert np.all(ens.force_computed)
+    assert np.max(np.abs(ens.xats[:N_START] - xats)) < 1e-12
+    assert np.max(np.abs(ens.forces[:N_START] - forces)) < 1e-12
+
+    # The ensemble is weighted on dyn_0, and the weights of the merged configurations
+    # on another dynamical matrix are the ones of a separated ensemble
+    assert np.max(np.abs(ens.rho - 1)) < 1e-8
+    ens.update_weights(dyn_target, 0)
+    mask = np.zeros(ens.N, dtype = bool)
+    mask[N_START:] = True
+    ens_extra = ens.split(mask)
+    ens_extra.update_weights(dyn_target, 0)
+    if verbose:
+        print("Max weight difference: {}".format(np.max(np.abs(ens.rho[mask] - ens_extra.rho))))
+    assert np.max(np.abs(ens.rho[mask] - ens_extra.rho)) < 1e-8
+
+
+if __name__ == "__main__":
+    test_adaptive_population(True)
+    test_extend_population(True)
@@ -0,0 +1,196 @@
+# -*- coding: utf-8 -*-
+from __future__ import print_function
+from __future__ import division
+
+import sys, os
+import shutil
+import time
+import threading
+import numpy as np
+
+import sscha, sscha.Cluster
+import sscha.LocalCluster
+
+"""
+This test checks the scheduling of the jobs in compute_ensemble_batch:
+the free slots are refilled as soon as a job returns, the failed configurations
+are resubmitted (at most max_recalc times) and the jobs beyond the timeout are submitted again.
+The scheduler is faked: each job is a local function that computes (or fails) the configurations.
+"""
+
+N_ATOMS = 2
+WORKDIR = "batch_workdir"
+
+
+class FakeCalculator(object):
+    def copy(self):
+        return FakeCalculator()
+
+
+class FakeStructure(object):
+    def __init__(self, coords):
+        self.coords = coords
+
+    def copy(self):
+        return FakeStructure(self.coords.copy())
+
+
+class FakeEnsemble(object):
+    """
+    The attributes of the ensemble filled by compute_ensemble_batch
+    """
+    def __init__(self, N):
+        self.N = N
+        self.structures = [FakeStructure(np.random.uniform(size = (N_ATOMS, 3))) for i in range(N)]
+        self.energies = np.zeros(N)
+        self.forces = np.zeros((N, N_ATOMS, 3))
+        self.stresses = np.zeros((N, 3, 3))
+        self.all_properties = [{} for i in range(N)]
+        self.has_stress = False
+        self.force_computed = np.zeros(N, dtype = bool)
+        self.stress_computed = np.zeros(N, dtype = bool)
+
+
+class FakeScheduler(sscha.LocalCluster.LocalCluster):
+    """
+    Each job runs run_configuration on its configurations.
+    run_configuration(index, attempt) returns the energy [eV] or None if the calculation fails.
+    """
+    def __init__(self, ensemble, run_configuration):
+        super(FakeScheduler, self).__init__("localhost")
+        self.use_job_poller = False
+        self.local_workdir = WORKDIR
+        self.__dict__["ensemble"] = ensemble
+        self.__dict__["run_configuration"] = run_configuration
+        self.__dict__["submissions"] = []
+
+    def batch_submission(self, list_of_structures, calc, indices, in_extension, out_extension,
+                         label = "ESP", n_togheder = 1, on_output = None):
+        with self.lock:
+            attempts = [self.submissions.count(i) + 1 for i in indices]
+            self.submissions.extend(indices)
+
+        energies = [self.run_configuration(i, a) for i, a in zip(indices, attempts)]
+        return energies, indices, label
+
+    def collect_results(self, calc, submitted, indices, label):
+        results = []
+        for i, energy in zip(indices, submitted):
+            if energy is None:
+                results.append(None)
+            else:
+                results.append({"energy" : energy,
+                                "forces" : np.full((N_ATOMS, 3), energy),
+                                "structure" : self.ensemble.structures[i]})
+        return results
+
+
+def run_scheduler(N, run_configuration, batch_size = 2, max_recalc = 10, timeout = None):
+    ensemble = FakeEnsemble(N)
+    cluster = FakeScheduler(ensemble, run_configuration)
+    cluster.job_number = 1
+    cluster.batch_size = batch_size
+    cluster.max_recalc = max_recalc
+
+    error = None
+    try:
+        cluster.compute_ensemble_batch(ensemble, FakeCalculator(), get_stress = False, timeout = timeout)
+    except ValueError as err:
+        error = err
+    return ensemble, cluster.submissions, error
+
+
+def test_resubmission(verbose = False):
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+    np.random.seed(0)
+
+    # The configuration 0 fails at the first attempt,
+    # the configuration 1 ends only after the configuration 0 is submitted again
+    resubmitted = threading.Event()
+    slow_job = {}
+    def run_configuration(index, attempt):
+        if index == 0 and attempt == 1:
+            return None
+        if index == 0:
+            resubmitted.set()
+        if index == 1:
+            slow_job["refilled"] = resubmitted.wait(timeout = 10)
+        return 1.0 + index
+
+    ensemble, submissions, error = run_scheduler(6, run_configuration)
+    if verbose:
+        print("Submissions: {}".format(submissions))
+
+    assert error is None
+    assert slow_job["refilled"]
+    assert np.all(ensemble.force_computed)
+    expected = (1.0 + np.arange(6)) / sscha.Cluster.units["Ry"]
+    assert np.max(np.abs(ensemble.energies - expected)) < 1e-12
+
+    # The attempts are counted per configuration
+    assert submissions.count(0) == 2
+    for i in range(1, 6):
+        assert submissions.count(i) == 1
+
+    shutil.rmtree(WORKDIR)
+
+
+def test_max_recalc(verbose = False):
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+    np.random.seed(0)
+
+    # The configuration 2 always fails
+    max_recalc = 2
+    def run_configuration(index, attempt):
+        if index == 2:
+            return None
+        return 1.0
+
+    ensemble, submissions, error = run_scheduler(5, run_configuration, max_recalc = max_recalc)
+    if verbose:
+        print("Submissions: {}".format(submissions))
+
+    assert isinstance(error, ValueError)
+    assert submissions.count(2) == max_recalc + 1
+    assert not ensemble.force_computed[2]
+    assert np.sum(ensemble.force_computed) == 4
+
+    shutil.rmtree(WORKDIR)
+
+
+def test_timeout(verbose = False):
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+    np.random.seed(0)
+
+    # The first job of the configuration 3 never returns (until the end of the test)
+    release = threading.Event()
+    def run_configuration(index, attempt):
+        if index == 3 and attempt == 1:
+            release.wait(timeout = 30)
+            return None
+        return 1.0
+
+    timeout = 0.5
+    t_start = time.time()
+    ensemble, submissions, error = run_scheduler(4, run_configuration, timeout = timeout)
+    elapsed = time.time() - t_start
+    release.set()
+
+    if verbose:
+        print("Submissions: {} | elapsed time: {:.2f} s".format(submissions, elapsed))
+
+    assert error is None
+    assert np.all(ensemble.force_computed)
+    assert submissions.count(3) == 2
+    assert elapsed < 10
+
+    shutil.rmtree(WORKDIR)
+
+
+if __name__ == "__main__":
+    test_resubmission(True)
+    test_max_recalc(True)
+    test_timeout(True)
@@ -0,0 +1,63 @@
+from __future__ import print_function
+import cellconstructor as CC
+import cellconstructor.Phonons
+
+import numpy as np
+
+import sscha, sscha.Ensemble
+import sys, os
+
+DATA_PATH = "../../Examples/ensemble_data_test"
+N_CONFIGS = 100
+STRAIN = 1e-3
+__EPS__ = 1e-8
+
+
+def test_change_unit_cell(verbose = False):
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    dyn = CC.Phonons.Phonons(os.path.join(DATA_PATH, "dyn"))
+    ens = sscha.Ensemble.Ensemble(dyn, 0, dyn.GetSupercell())
+    ens.load(DATA_PATH, 2, N_CONFIGS)
+    assert ens.has_stress
+
+    xats = ens.xats.copy()
+    forces = ens.forces.copy()
+    energies = ens.energies.copy()
+    unit_cell = ens.dyn_0.structure.unit_cell.copy()
+
+    # Zero strain is a no-op
+    ens.change_unit_cell(unit_cell)
+    assert np.max(np.abs(ens.xats - xats)) < __EPS__
+    assert np.max(np.abs(ens.forces - forces)) < __EPS__
+    assert np.max(np.abs(ens.energies - energies)) < __EPS__
+    assert np.max(np.abs(ens.mis_log_denominator)) < __EPS__
+    assert np.max(np.abs(ens.rho - 1)) < __EPS__
+
+    # Strain and back: the positions and the forces are recovered,
+    # the log ratios of the two steps cancel
+    strain = np.eye(3) + STRAIN * np.array([[1, 0.5, 0], [0.5, -1, 0.2], [0, 0.2, 2]])
+    ens.change_unit_cell(unit_cell.dot(strain))
+    assert np.max(np.abs(ens.dyn_0.structure.unit_cell - unit_cell.dot(strain))) < __EPS__
+    assert np.max(np.abs(ens.xats - xats.dot(strain))) < __EPS__
+
+    # The strained ensemble is not distributed as the strained dyn_0: the weights move from 1
+    if verbose:
+        print("Effective sample size after the strain: {} / {}".format(ens.get_effective_sample_size(), ens.N))
+    assert np.max(np.abs(ens.rho - np.exp(-ens.mis_log_denominator))) < __EPS__
+
+    ens.change_unit_cell(unit_cell)
+    assert np.max(np.abs(ens.dyn_0.structure.unit_cell - unit_cell)) < __EPS__
+    assert np.max(np.abs(ens.xats - xats)) < __EPS__
+    assert np.max(np.abs(ens.forces - forces)) < __EPS__
+    assert np.max(np.abs(ens.mis_log_denominator)) < 1e-6
+    assert np.max(np.abs(ens.rho - 1)) < 1e-6
+
+    # The stresses are held at zeroth order
+    if verbose:
+        print("Max energy difference after the round trip: {} Ry".format(np.max(np.abs(ens.energies - energies))))
+
+
+if __name__ == "__main__":
+    test_change_unit_cell(verbose = True)
@@ -0,0 +1,142 @@
+from __future__ import print_function
+import cellconstructor as CC
+import cellconstructor.Phonons
+
+import numpy as np
+
+import sscha, sscha.Ensemble, sscha.SchaMinimizer
+import sscha.Minimizer, sscha.Optimizer
+import sscha.Relax, sscha.Checkpoint
+import sys, os
+import shutil, glob
+
+DATA_PATH = "../../Examples/ensemble_data_test"
+N_CONFIGS = 200
+__EPS__ = 1e-10
+
+
+def get_minimizer(load = True):
+    dyn = CC.Phonons.Phonons(os.path.join(DATA_PATH, "dyn"))
+    ens = sscha.Ensemble.Ensemble(dyn, 0, dyn.GetSupercell())
+    if load:
+        ens.load(DATA_PATH, 2, N_CONFIGS)
+
+    minim = sscha.SchaMinimizer.SSCHA_Minimizer(ens)
+    minim.min_step_dyn = 0.1
+    minim.meaningful_factor = 1e-10
+    minim.max_ka = 5
+    minim.use_julia = False
+    return minim
+
+
+def compare_states(state1, state2):
+    assert set(state1.keys()) == set(state2.keys())
+    for name in state1:
+        if isinstance(state1[name], list):
+            assert len(state1[name]) == len(state2[name])
+            for x1, x2 in zip(state1[name], state2[name]):
+                assert np.max(np.abs(np.array(x1) - np.array(x2))) < __EPS__
+        elif state1[name] is None or isinstance(state1[name], (str, bool)):
+            assert state1[name] == state2[name]
+        else:
+            assert np.max(np.abs(np.array(state1[name]) - np.array(state2[name]))) < __EPS__, name
+
+
+def test_checkpoint_minimizer():
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    filename = "minim_checkpoint.npz"
+    minim = get_minimizer()
+    minim.checkpoint = sscha.Checkpoint.Checkpoint(filename, asynchronous = False)
+    minim.init()
+    minim.run()
+
+    # Save -> load -> restore_minimizer
+    header, arrays = sscha.Checkpoint.load(filename)
+    new_minim = get_minimizer()
+    sscha.Checkpoint.restore_minimizer(new_minim, header, arrays)
+
+    assert new_minim.population == minim.population
+    assert np.max(np.abs(new_minim.dyn.structure.coords - minim.dyn.structure.coords)) < __EPS__
+    for iq in range(len(minim.dyn.q_tot)):
+        assert np.max(np.abs(new_minim.dyn.dynmats[iq] - minim.dyn.dynmats[iq])) < __EPS__
+    for name in sscha.Checkpoint.__HISTORY__:
+        assert np.max(np.abs(np.real(getattr(new_minim, name)) - np.real(getattr(minim, name)))) < __EPS__
+
+    # The line minimization: restore_minimizer -> set_state gives back the state of the last step
+    state = minim.minimizer.get_state()
+    compare_states(new_minim.minimizer_restart_state, state)
+
+    line_minim = sscha.Minimizer.Minimizer(minim.minim_struct, algorithm = minim.minimization_algorithm)
+    line_minim.init(new_minim.dyn, 1)
+    line_minim.set_state(new_minim.minimizer_restart_state)
+    compare_states(line_minim.get_state(), state)
+
+    os.remove(filename)
+
+
+def test_checkpoint_vc_relax():
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    filename = "relax_checkpoint.npz"
+    data_dir = "data_checkpoint"
+    pop = 2
+
+    # A relaxation interrupted after a cell step on the strained population pop
+    minim = get_minimizer()
+    relax = sscha.Relax.SSCHA(minim, N_configs = N_CONFIGS, max_pop = pop, save_ensemble = True)
+    relax.save_dyn = False
+    relax.checkpoint_file = filename
+    relax.max_cell_steps_per_population = 1
+    relax.save_population(data_dir, pop)
+
+    unit_cell = minim.dyn.structure.unit_cell.copy()
+    cell_optimizer = sscha.Optimizer.UC_OPTIMIZER(unit_cell)
+    cell_optimizer.alpha = 1 / (3 * 100 / sscha.SchaMinimizer.__evA3_to_GPa__ * minim.dyn.structure.get_volume())
+    cell_optimizer.algorithm = "sd"
+    new_uc = unit_cell.copy()
+    cell_optimizer.UpdateCell(new_uc, np.diag([1e-3, 1e-3, 2e-3]))
+    minim.dyn.AdjustToNewCell(new_uc)
+    relax.save_checkpoint(data_dir, pop, cell_optimizer = cell_optimizer, n_cell_steps = 1)
+    minim.checkpoint.wait()
+    header_start, arrays_start = sscha.Checkpoint.load(filename)
+
+    # Restart: the ensemble is loaded and strained to the cell of the checkpoint
+    new_minim = get_minimizer(load = False)
+    new_relax = sscha.Relax.SSCHA(new_minim, N_configs = N_CONFIGS, max_pop = pop, save_ensemble = True)
+    new_relax.save_dyn = False
+    new_relax.checkpoint_file = filename
+    new_relax.max_cell_steps_per_population = 1
+
+    assert new_relax.restart_from_checkpoint()
+    assert new_relax.start_pop == pop
+    ensemble = new_minim.ensemble
+    assert ensemble.N == minim.ensemble.N
+    assert np.max(np.abs(ensemble.dyn_0.structure.unit_cell - new_uc)) < __EPS__
+    strain_matrix = np.linalg.inv(unit_cell).dot(new_uc)
+    assert np.max(np.abs(ensemble.xats - minim.ensemble.xats.dot(strain_matrix))) < 1e-8
+
+    # The restarted vc_relax continues the cell steps on the same population:
+    # it does not generate a new ensemble (there is no calculator),
+    # the cell step on the strained population does not enter the history of the optimizer
+    # and, as max_cell_steps_per_population is reached, the relaxation moves to the next population.
+    new_relax.vc_relax(restart_from_ens = True, ensemble_loc = data_dir, cell_relax_algorithm = "sd")
+    new_minim.checkpoint.wait()
+
+    header, arrays = sscha.Checkpoint.load(filename)
+    assert header["population"] == pop + 1
+    assert header["relax"]["n_cell_steps"] == 0
+    compare_states(sscha.Checkpoint._join_state(header["cell_optimizer"], arrays, "cell_"),
+                   sscha.Checkpoint._join_state(header_start["cell_optimizer"], arrays_start, "cell_"))
+
+    os.remove(filename)
+    shutil.rmtree(data_dir)
+    for fname in glob.glob("dyn_pop*"):
+        os.remove(fname)
+
+
+if __name__ == "__main__":
+    test_checkpoint_minimizer()
+    test_checkpoint_vc_relax()
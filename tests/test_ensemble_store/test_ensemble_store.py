@@ -0,0 +1,109 @@
+from __future__ import print_function
+import cellconstructor as CC
+import cellconstructor.Phonons
+
+import numpy as np
+
+import sscha, sscha.Ensemble, sscha.EnsembleStore
+import sys, os, shutil
+
+ENS_DIR = "../../Examples/ensemble_data_test"
+STORE_DIR = "store_test"
+N_RANDOM = 10
+T = 0
+__EPS__ = 1e-10
+
+def test_ensemble_store():
+    np.random.seed(0)
+
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    if os.path.exists(STORE_DIR):
+        shutil.rmtree(STORE_DIR)
+
+    dyn_start = CC.Phonons.Phonons(os.path.join(ENS_DIR, "dyn"))
+    dyn_end = CC.Phonons.Phonons(os.path.join(ENS_DIR, "dyn1_population2"), full_name = True)
+
+    store = sscha.EnsembleStore.EnsembleStore(STORE_DIR)
+
+    # Two populations generated by the same dynamical matrix
+    ensembles = []
+    for pop in [1, 2]:
+        ens = sscha.Ensemble.Ensemble(dyn_start, T)
+        ens.generate(N_RANDOM)
+        ens.energies[:] = np.random.normal(size = ens.N)
+        ens.forces[:,:,:] = np.random.normal(size = ens.forces.shape)
+        ens.stresses[:,:,:] = np.random.normal(size = ens.stresses.shape)
+        ens.force_computed[:] = True
+        ens.stress_computed[:] = True
+        ens.force_computed[0] = False
+        store.append(ens, pop)
+        ensembles.append(ens)
+
+    # The generating dynamical matrix is saved only once
+    store = sscha.EnsembleStore.EnsembleStore(STORE_DIR)
+    assert store.get_populations() == [1, 2]
+    assert len(set([x["dyn_id"] for x in store.records])) == 1
+
+    # Selective loading of a single population
+    ens2 = store.load([2])
+    assert ens2.N == N_RANDOM
+    assert np.max(np.abs(ens2.xats - ensembles[1].xats)) < __EPS__
+    assert np.max(np.abs(ens2.forces - ensembles[1].forces)) < __EPS__
+    assert np.max(np.abs(ens2.stresses - ensembles[1].stresses)) < __EPS__
+    assert not ens2.force_computed[0]
+
+    # Only the computed configurations of both populations
+    ens_all = store.load(only_computed = True)
+    assert ens_all.N == 2 * (N_RANDOM - 1)
+
+    # Weight threshold
+    ens_ref = store.load([1], dyn = dyn_end, T = T)
+    threshold = np.median(ens_ref.rho)
+    ens_w = store.load([1], dyn = dyn_end, T = T, min_weight = threshold)
+    assert ens_w.N == np.sum(ens_ref.rho >= threshold)
+    assert np.min(ens_w.rho) >= threshold - __EPS__
+
+    shutil.rmtree(STORE_DIR)
+
+
+def test_recycle_populations():
+    np.random.seed(1)
+
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    dyn_start = CC.Phonons.Phonons(os.path.join(ENS_DIR, "dyn"))
+    dyn_end = CC.Phonons.Phonons(os.path.join(ENS_DIR, "dyn1_population2"), full_name = True)
+
+    ens1 = sscha.Ensemble.Ensemble(dyn_start, T)
+    ens1.generate(N_RANDOM)
+    ens2 = sscha.Ensemble.Ensemble(dyn_start, T)
+    ens2.generate(N_RANDOM)
+    ens3 = sscha.Ensemble.Ensemble(dyn_end, T)
+    ens3.generate(N_RANDOM)
+
+    # Populations generated by the same dyn: the weights are the standard ones
+    ens_merged = sscha.Ensemble.Ensemble(dyn_start, T)
+    ens_merged.init_from_positions(np.concatenate((ens1.xats, ens2.xats)))
+    ens_merged.update_weights(dyn_end, T)
+
+    ens_mis = ens1.split(np.ones(N_RANDOM, dtype = bool))
+    ens_mis.recycle_populations([ens2])
+    ens_mis.update_weights(dyn_end, T)
+    assert ens_mis.N == 2 * N_RANDOM
+    assert np.max(np.abs(ens_mis.rho - ens_merged.rho)) < 1e-8 * np.max(ens_merged.rho)
+
+    # The configurations generated by the target dyn have a balance heuristic weight
+    # rho = P / (P_1 / 2 + P_3 / 2) <= 2
+    ens_mis = ens1.split(np.ones(N_RANDOM, dtype = bool))
+    kl = ens_mis.recycle_populations([ens3])
+    ens_mis.update_weights(dyn_end, T)
+    assert np.max(ens_mis.rho) <= 2 + __EPS__
+    assert kl > 0
+
+
+if __name__ == "__main__":
+    test_ensemble_store()
+    test_recycle_populations()
@@ -45,6 +45,70 @@ def test_hessian(verbose = False):
     if verbose:
         timer.print_report()
 
+def test_hessian_at_q(verbose = False):
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    DATA_PATH = "../../Examples/ensemble_data_test/"
+
+    dyn_start = CC.Phonons.Phonons(os.path.join(DATA_PATH, "dyn"))
+    dyn_target = CC.Phonons.Phonons(os.path.join(DATA_PATH, "dyn1_population2"), full_name = True)
+
+    ens = sscha.Ensemble.Ensemble(dyn_start, 0, dyn_start.GetSupercell())
+    ens.load(DATA_PATH, 2, 1000)
+    ens.update_weights(dyn_target, 0)
+
+    compare_hessian_at_q(ens, verbose)
+
+
+def test_hessian_at_q_supercell(verbose = False):
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    np.random.seed(0)
+
+    T = 100
+    dyn = CC.Phonons.Phonons("../TestGenerateEnsembleSupercell/dyn", 3)
+
+    ens = sscha.Ensemble.Ensemble(dyn, T, dyn.GetSupercell())
+    ens.generate(200)
+
+    # Anharmonic toy forces [Ry/A]
+    ens.update_weights(dyn, T)
+    ens.forces[:, :, :] = 1.2 * ens.sscha_forces + 0.3 * ens.u_disps.reshape(ens.forces.shape)**2
+    ens.force_computed[:] = True
+
+    # Reweight on a different dynamical matrix
+    dyn_target = dyn.Copy()
+    for iq in range(len(dyn_target.q_tot)):
+        dyn_target.dynmats[iq] *= 1.05
+    ens.update_weights(dyn_target, T)
+
+    compare_hessian_at_q(ens, verbose)
+
+    # The symmetry kernel must be applied by both methods
+    ens._unwrap_symmetries_()
+    compare_hessian_at_q(ens, verbose)
+
+
+def compare_hessian_at_q(ens, verbose = False):
+    """
+    Compare the iterative solution at each q with the dense odd correction
+    """
+    q_tot = ens.current_dyn.q_tot
+    for include_v4 in [False, True]:
+        hessian = ens.get_free_energy_hessian(include_v4 = include_v4, use_symmetries = False)
+        hessians_q = ens.get_free_energy_hessian_at_q(q_tot, include_v4 = include_v4,
+                                                      use_symmetries = False, tol = 1e-12)
+
+        for iq in range(len(q_tot)):
+            if verbose:
+                print("IQ = {}, max diff = {}".format(iq, np.max(np.abs(hessians_q[iq] - hessian.dynmats[iq]))))
+            assert np.allclose(hessians_q[iq], hessian.dynmats[iq], atol = 1e-7)
+
+
 if __name__ == "__main__":
     test_hessian(True)
+    test_hessian_at_q(True)
+    test_hessian_at_q_supercell(True)
 
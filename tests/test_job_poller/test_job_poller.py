@@ -0,0 +1,78 @@
+# -*- coding: utf-8 -*-
+from __future__ import print_function
+from __future__ import division
+
+import sys, os
+import time
+import threading
+
+import sscha, sscha.Cluster
+import sscha.LocalCluster
+
+"""
+This test checks that the status of many submitted jobs
+is interrogated with a single query to the scheduler for each interval.
+The scheduler is a local script printing the content of a queue file.
+"""
+
+QUEUE_FILE = "fake_queue.txt"
+CALLS_FILE = "fake_calls.txt"
+SCHEDULER = "fake_squeue.sh"
+
+def test_job_poller(verbose = False):
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    with open(SCHEDULER, "w") as fp:
+        fp.write("echo JOBID USER\ncat {}\necho query >> {}\n".format(QUEUE_FILE, CALLS_FILE))
+    if os.path.exists(CALLS_FILE):
+        os.remove(CALLS_FILE)
+
+    jobs = [str(100 + i) for i in range(10)]
+    def set_queue(queue):
+        with open(QUEUE_FILE, "w") as fp:
+            fp.write("".join(["{} {}\n".format(x, "user") for x in queue]))
+    set_queue(jobs)
+
+    interval = 0.2
+    cluster = sscha.LocalCluster.LocalCluster("localhost")
+    cluster.check_timeout = interval
+    cluster.job_status_cmd = "bash {}".format(SCHEDULER)
+
+    poller = cluster.get_job_poller()
+    finished = {}
+    def wait_job(job_id):
+        finished[job_id] = poller.wait(job_id, timeout = 30)
+
+    t_start = time.time()
+    threads = [threading.Thread(target = wait_job, args = (x,)) for x in jobs]
+    for t in threads:
+        t.start()
+
+    # The jobs leave the queue one after the other
+    for i in range(len(jobs)):
+        time.sleep(interval)
+        set_queue(jobs[i+1:])
+
+    for t in threads:
+        t.join()
+    elapsed = time.time() - t_start
+
+    assert all([finished[x] for x in jobs])
+
+    with open(CALLS_FILE, "r") as fp:
+        n_calls = len(fp.readlines())
+
+    if verbose:
+        print("Elapsed time: {:.2f} s | queries: {}".format(elapsed, n_calls))
+
+    # One query per interval for all the jobs
+    assert n_calls == poller.n_queries
+    assert n_calls <= elapsed / interval + 2
+
+    for fname in [SCHEDULER, QUEUE_FILE, CALLS_FILE]:
+        os.remove(fname)
+
+
+if __name__ == "__main__":
+    test_job_poller(True)
@@ -1,4 +1,5 @@
 import cellconstructor as CC, cellconstructor.Phonons
+import numpy as np
 import sscha, sscha.Ensemble
 import sscha.SchaMinimizer
 import sys, os
@@ -28,5 +29,34 @@ def test_load_noncomputed_ensemble():
     minim.finalize()
 
 
+def test_load_parallel_fast_parser():
+    os.chdir(os.path.dirname(os.path.abspath(__file__)))
+
+    dyn = CC.Phonons.Phonons("dyn", 4)
+
+    # Reference: serial with the generic ASE reader
+    ens_ase = sscha.Ensemble.Ensemble(dyn, 300)
+    ens_ase.load_from_calculator_output(directory="data", out_ext=".pwo", fast_qe_parser = False)
+
+    # Parallel with the fast Quantum ESPRESSO reader
+    ens_fast = sscha.Ensemble.Ensemble(dyn, 300)
+    ens_fast.load_from_calculator_output(directory="data", out_ext=".pwo", n_processes = 2, verbose = True)
+
+    assert ens_fast.N == ens_ase.N
+    assert ens_fast.has_stress == ens_ase.has_stress
+    assert np.allclose(ens_fast.energies, ens_ase.energies, atol = 1e-6)
+    assert np.allclose(ens_fast.forces, ens_ase.forces, atol = 1e-6)
+    assert np.allclose(ens_fast.xats, ens_ase.xats, atol = 1e-5)
+    assert np.allclose(ens_fast.stresses, ens_ase.stresses, atol = 1e-7)
+
+    # Both readers must label the atoms with the types of the dynamical matrix
+    super_structure = dyn.structure.generate_supercell(dyn.GetSupercell())
+    for i in range(ens_fast.N):
+        assert ens_fast.structures[i].atoms == super_structure.atoms
+        assert ens_ase.structures[i].atoms == super_structure.atoms
+        assert all([x in ens_fast.structures[i].masses for x in super_structure.atoms])
+
+
 if __name__ == "__main__":
     test_load_noncomputed_ensemble()
+    test_load_parallel_fast_parser()
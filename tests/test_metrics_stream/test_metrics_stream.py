@@ -0,0 +1,67 @@
+# -*- coding: utf-8 -*-
+from __future__ import print_function
+from __future__ import division
+
+import sys, os
+import json
+import numpy as np
+import cellconstructor as CC
+import cellconstructor.Phonons
+
+import sscha, sscha.Ensemble
+import sscha.SchaMinimizer
+
+"""
+This test runs a short minimization of the sample ensemble
+and checks the per-step metrics stream.
+"""
+
+METRICS_FILE = "metrics.jsonl"
+
+def test_metrics_stream(verbose = False):
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    if os.path.exists(METRICS_FILE):
+        os.remove(METRICS_FILE)
+
+    DATA_PATH = "../../Examples/ensemble_data_test/"
+
+    dyn_start = CC.Phonons.Phonons(os.path.join(DATA_PATH, "dyn"))
+
+    ens = sscha.Ensemble.Ensemble(dyn_start, 0, dyn_start.GetSupercell())
+    ens.load(DATA_PATH, 2, 1000)
+
+    minim = sscha.SchaMinimizer.SSCHA_Minimizer(ens)
+    minim.min_step_dyn = 0.5
+    minim.meaningful_factor = 1e-10
+    minim.max_ka = 3
+    minim.metrics_file = METRICS_FILE
+
+    minim.init()
+    minim.run()
+
+    with open(METRICS_FILE, "r") as fp:
+        records = [json.loads(line) for line in fp]
+
+    if verbose:
+        for record in records:
+            print(record)
+
+    # One record for each step
+    assert len(records) == len(minim.__fe__)
+    for i, record in enumerate(records):
+        assert record["step"] == i
+        assert abs(record["free_energy"] - minim.__fe__[i]) < 1e-12
+        assert abs(record["kl"] - minim.__KL__[i]) < 1e-8
+        assert record["n_configs"] == ens.N
+        assert record["wall_time"] >= sum(record["phases"].values()) - 1e-6
+        for key in ["symmetries", "dyn_gradient", "update", "free_energy", "check_stop"]:
+            assert key in record["phases"]
+        assert record["n_threads"] >= 1
+
+    assert not records[-1]["running"]
+
+
+if __name__ == "__main__":
+    test_metrics_stream(True)
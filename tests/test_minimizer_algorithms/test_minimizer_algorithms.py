@@ -0,0 +1,96 @@
+from __future__ import print_function
+import numpy as np
+import sys, os
+
+import sscha, sscha.Minimizer
+
+N_MODES = 6
+MAX_STEPS = 200
+GRAD_THR = 1e-3
+
+
+class FakeDyn(object):
+    """
+    The minimal dynamical matrix interface needed by the Minimizer
+    """
+    def __init__(self, n_modes):
+        self.q_tot = [np.zeros(3)]
+        self.dynmats = [np.zeros((n_modes, n_modes), dtype = np.complex128)]
+        self.structure = type("FakeStructure", (object,), {})()
+        self.structure.N_atoms = n_modes // 3
+        self.structure.coords = np.zeros((n_modes // 3, 3))
+
+
+def minimize_quadratic(algorithm, precond = None):
+    """
+    Minimize 1/2 Tr[(X - X0) H (X - X0) H] and return the number of steps to converge.
+    If precond is given, the minimizer receives the preconditioned gradient precond G precond
+    together with the unpreconditioned one G.
+    """
+    np.random.seed(0)
+    A = np.random.normal(size = (N_MODES, N_MODES))
+    H = A.dot(A.T) + np.diag(np.linspace(0.1, 5, N_MODES))
+    target = np.random.normal(size = (N_MODES, N_MODES))
+    target += target.T
+
+    minim = sscha.Minimizer.Minimizer(minim_struct = False, algorithm = algorithm, step = 0.05, verbose = False)
+    minim.init(FakeDyn(N_MODES), 1.0)
+
+    for i in range(MAX_STEPS):
+        x = np.real(minim.get_dyn_struct()[0][0])
+        grad = H.dot(x - target).dot(H)
+        grad = 0.5 * (grad + grad.T)
+        if np.linalg.norm(grad) < GRAD_THR:
+            return i
+        if precond is None:
+            minim.update_dyn(1.0, grad[np.newaxis, :, :].astype(np.complex128))
+        else:
+            grad_precond = precond.dot(grad).dot(precond)
+            minim.update_dyn(1.0, grad_precond[np.newaxis, :, :].astype(np.complex128),
+                             raw_dyn_gradient = grad[np.newaxis, :, :].astype(np.complex128))
+
+    return MAX_STEPS
+
+
+def test_minimizer_algorithms(verbose = False):
+    steps = {}
+    for algorithm in ["sdes", "cg", "lbfgs"]:
+        steps[algorithm] = minimize_quadratic(algorithm)
+        if verbose:
+            print("{}: {} steps".format(algorithm, steps[algorithm]))
+
+    assert steps["lbfgs"] < MAX_STEPS
+    assert steps["lbfgs"] < steps["sdes"]
+
+    # The preconditioned L-BFGS (the curvature is measured on the unpreconditioned gradient)
+    # with an approximate inverse of H as preconditioner
+    np.random.seed(0)
+    A = np.random.normal(size = (N_MODES, N_MODES))
+    H = A.dot(A.T) + np.diag(np.linspace(0.1, 5, N_MODES))
+    np.random.seed(1)
+    B = np.random.normal(size = (N_MODES, N_MODES))
+    precond = np.linalg.inv(H + 0.5 * B.dot(B.T))
+    for algorithm in ["sdes", "lbfgs"]:
+        steps[algorithm + "_precond"] = minimize_quadratic(algorithm, precond)
+        if verbose:
+            print("preconditioned {}: {} steps".format(algorithm, steps[algorithm + "_precond"]))
+    assert steps["lbfgs_precond"] < MAX_STEPS
+    assert steps["lbfgs_precond"] <= steps["sdes_precond"]
+
+
+def test_algorithm_names():
+    assert sscha.Minimizer.get_algorithm("auto") == "sdes"
+    assert sscha.Minimizer.get_algorithm("CG") == "cgrf"
+    assert sscha.Minimizer.get_algorithm("bfgs") == "lbfgs"
+
+    # Unknown algorithms are refused when they are set, not in the middle of the minimization
+    try:
+        sscha.Minimizer.Minimizer(algorithm = "newton")
+        assert False, "An unknown algorithm must raise a ValueError"
+    except ValueError:
+        pass
+
+
+if __name__ == "__main__":
+    test_minimizer_algorithms(verbose = True)
+    test_algorithm_names()
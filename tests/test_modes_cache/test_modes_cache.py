@@ -0,0 +1,89 @@
+from __future__ import print_function
+import cellconstructor as CC
+import cellconstructor.Phonons
+
+import numpy as np
+
+import sscha, sscha.Ensemble
+import sys, os
+
+ENS_DIR = "../../Examples/ensemble_data_test"
+N_RANDOM = 4
+T = 0
+__EPS__ = 1e-10
+
+def test_modes_cache():
+    np.random.seed(0)
+
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    dyn_start = CC.Phonons.Phonons(os.path.join(ENS_DIR, "dyn"))
+    dyn_end = CC.Phonons.Phonons(os.path.join(ENS_DIR, "dyn1_population2"), full_name = True)
+
+    ens = sscha.Ensemble.Ensemble(dyn_start, T)
+    ens.generate(N_RANDOM)
+    ens.update_weights(dyn_end, T)
+
+    # The cached modes must be the same of a direct diagonalization
+    w, pols, _, _, trans_mask = ens.get_supercell_modes(dyn_end)
+    w_direct, pols_direct = dyn_end.DiagonalizeSupercell()
+    assert np.max(np.abs(w - w_direct)) < __EPS__
+    assert np.sum(trans_mask.astype(int)) == 3
+
+    # A second call must return the same (cached) objects
+    w2, pols2, _, _, _ = ens.get_supercell_modes(dyn_end.Copy())
+    assert w2 is w
+    assert pols2 is pols
+    assert not w.flags.writeable
+
+    # The fortran layout of the polarization vectors
+    w_f, er = ens.get_fortran_modes(dyn_end, exclude_translations = True)
+    assert er.flags.f_contiguous
+    pols_nt = pols[:, ~trans_mask]
+    nat_sc = pols.shape[0] // 3
+    for i in range(nat_sc):
+        for j in range(len(w_f)):
+            assert np.max(np.abs(er[i, j, :] - pols_nt[3*i : 3*(i+1), j])) < __EPS__
+    assert ens.get_fortran_modes(dyn_end, exclude_translations = True)[1] is er
+
+    # Changing the dynamical matrix must invalidate the cache
+    dyn_new = dyn_end.Copy()
+    dyn_new.dynmats[0] *= 1.1
+    w3, _, _, _, _ = ens.get_supercell_modes(dyn_new)
+    assert w3 is not w
+    assert np.max(np.abs(w3 - dyn_new.DiagonalizeSupercell()[0])) < __EPS__
+
+    # Many trial dynamical matrices must not evict the modes of dyn_0
+    w_0 = ens.get_supercell_modes(ens.dyn_0)[0]
+    for k in range(2 * sscha.Ensemble.__MODES_CACHE_SIZE__):
+        dyn_trial = dyn_end.Copy()
+        dyn_trial.dynmats[0] *= 1.0 + 0.01 * (k + 1)
+        ens.get_supercell_modes(dyn_trial)
+    assert len(ens.modes_cache) <= sscha.Ensemble.__MODES_CACHE_SIZE__
+    assert ens.get_supercell_modes(ens.dyn_0)[0] is w_0
+
+    # Only the current dyn_0 is pinned: the cache does not grow when dyn_0 changes
+    dyn_0 = ens.dyn_0
+    key_0 = ens.modes_cache_pinned
+    for k in range(2 * sscha.Ensemble.__MODES_CACHE_SIZE__):
+        ens.dyn_0 = dyn_start.Copy()
+        ens.dyn_0.dynmats[0] *= 1.0 + 0.01 * (k + 1)
+        ens.get_supercell_modes(ens.dyn_0)
+        ens.get_supercell_modes(dyn_end)
+        assert len(ens.modes_cache) <= sscha.Ensemble.__MODES_CACHE_SIZE__
+    assert ens.modes_cache_pinned != key_0
+    assert not key_0 in ens.modes_cache
+    ens.dyn_0 = dyn_0
+
+    # The split ensemble shares the cache and gives the same weights
+    ens.update_weights(dyn_end, T)
+    mask = np.zeros(N_RANDOM, dtype = bool)
+    mask[: N_RANDOM // 2] = True
+    ens_split = ens.split(mask)
+    assert ens_split.modes_cache is ens.modes_cache
+    assert np.max(np.abs(ens_split.rho - ens.rho[mask])) < __EPS__
+
+
+if __name__ == "__main__":
+    test_modes_cache()
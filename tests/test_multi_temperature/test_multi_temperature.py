@@ -0,0 +1,88 @@
+from __future__ import print_function
+import cellconstructor as CC
+import cellconstructor.Phonons
+
+import numpy as np
+
+import sscha, sscha.Ensemble, sscha.SchaMinimizer
+import sscha.MultiTemperature
+import sys, os
+
+DATA_PATH = "../../Examples/ensemble_data_test"
+N_CONFIGS = 500
+TEMPERATURES = [0, 20]
+__EPS__ = 1e-10
+
+
+def setup_minimizer(ens):
+    """
+    The minimizer used for all the temperatures
+    """
+    minim = sscha.SchaMinimizer.SSCHA_Minimizer(ens)
+    minim.min_step_dyn = 0.1
+    minim.kong_liu_ratio = 0.1
+    minim.meaningful_factor = 1e-10
+    minim.max_ka = 10
+    minim.use_julia = False
+    return minim
+
+
+def relax_single_temperature(T):
+    """
+    Minimize one temperature on its own copy of the sample ensemble
+    """
+    dyn = CC.Phonons.Phonons(os.path.join(DATA_PATH, "dyn"))
+    ens = sscha.Ensemble.Ensemble(dyn, 0, dyn.GetSupercell())
+    ens.load(DATA_PATH, 2, N_CONFIGS)
+    ens.update_weights(dyn, T)
+
+    minim = setup_minimizer(ens)
+    minim.init()
+    minim.run()
+    return minim.get_free_energy(), minim.dyn
+
+
+def test_multi_temperature(verbose = False):
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    # Minimize the temperatures on the sample ensemble (one population, no calculator)
+    dyn = CC.Phonons.Phonons(os.path.join(DATA_PATH, "dyn"))
+    ens = sscha.Ensemble.Ensemble(dyn, 0, dyn.GetSupercell())
+    ens.load(DATA_PATH, 2, N_CONFIGS)
+
+    multi = sscha.MultiTemperature.MultiTemperatureSSCHA(dyn, TEMPERATURES, setup_minimizer(ens), max_pop = 1)
+    multi.data_dir = None
+    assert multi.reference_temperature == max(TEMPERATURES)
+
+    multi.relax(ens)
+    fe = multi.get_free_energies()
+    dyns = multi.get_dynamical_matrices()
+
+    # The configurations are shared, the weights are not
+    ens_0 = multi.minims[0].ensemble
+    ens_1 = multi.minims[1].ensemble
+    assert ens_0.xats is ens.xats and ens_1.xats is ens.xats
+    assert ens_0.forces is ens.forces and ens_1.forces is ens.forces
+    assert ens_0.rho is not ens_1.rho
+    assert ens_0.sscha_forces is not ens_1.sscha_forces
+    assert ens_0.current_dyn is not ens_1.current_dyn
+
+    # Each temperature is the same minimization as a standalone one
+    for i, T in enumerate(TEMPERATURES):
+        fe_single, dyn_single = relax_single_temperature(T)
+
+        if verbose:
+            print("T = {} K | F = {} Ry | F (standalone) = {} Ry".format(T, fe[i], fe_single))
+
+        assert np.abs(fe[i] - fe_single) < __EPS__
+        assert np.max(np.abs(dyns[i].structure.coords - dyn_single.structure.coords)) < __EPS__
+        for iq in range(len(dyn_single.q_tot)):
+            assert np.max(np.abs(dyns[i].dynmats[iq] - dyn_single.dynmats[iq])) < __EPS__
+
+    # The two temperatures are different minimizations
+    assert np.abs(fe[0] - fe[1]) > __EPS__
+
+
+if __name__ == "__main__":
+    test_multi_temperature(verbose = True)
@@ -0,0 +1,95 @@
+from __future__ import print_function
+import cellconstructor as CC
+import cellconstructor.Phonons
+import cellconstructor.symmetries
+
+import numpy as np
+
+import sscha, sscha.SchaMinimizer
+import sys, os
+
+DYN_PATH = "../../Examples/ensemble_data_test/dyn"
+SUPERCELL_DYN_PATH = "../TestGenerateEnsembleSupercell/dyn"
+__EPS__ = 1e-8
+
+def test_qspace_symmetries(verbose = False):
+    np.random.seed(0)
+
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    dyn = CC.Phonons.Phonons(DYN_PATH)
+    nq = len(dyn.q_tot)
+    nat = dyn.structure.N_atoms
+
+    # A random hermitian gradient
+    grad = np.random.normal(size = (nq, 3*nat, 3*nat)) + 1j * np.random.normal(size = (nq, 3*nat, 3*nat))
+    grad += np.conj(np.transpose(grad, (0, 2, 1)))
+
+    # Symmetrize the force constants in the supercell
+    supercell = dyn.GetSupercell()
+    super_structure = dyn.structure.generate_supercell(supercell)
+    fc_supercell = CC.Phonons.GetSupercellFCFromDyn(grad, np.array(dyn.q_tot), dyn.structure, super_structure)
+    qe_sym = CC.symmetries.QE_Symmetry(super_structure)
+    qe_sym.SetupFromSPGLIB()
+    qe_sym.ApplySymmetriesToV2(fc_supercell)
+    grad_supercell = CC.Phonons.GetDynQFromFCSupercell(fc_supercell, np.array(dyn.q_tot), dyn.structure, super_structure)
+
+    # Symmetrize directly in q space
+    q_symmetries = sscha.SchaMinimizer.GetSpglibQSymmetries(dyn.structure, dyn.q_tot)
+    grad_q = grad.copy()
+    sscha.SchaMinimizer.ApplyQSymmetries(grad_q, q_symmetries)
+
+    error = np.max(np.abs(grad_q - grad_supercell))
+    if verbose:
+        print("Number of symmetries:", len(q_symmetries["rotations"]))
+        print("Max difference:", error)
+    assert error < __EPS__ * np.max(np.abs(grad_supercell))
+
+    # The cached tables are reused by the minimizer
+    minim = sscha.SchaMinimizer.SSCHA_Minimizer()
+    tables = minim.get_q_symmetries(dyn.structure, dyn.q_tot)
+    assert minim.get_q_symmetries(dyn.structure, dyn.q_tot) is tables
+
+
+def test_qspace_symmetries_supercell(verbose = False):
+    """
+    Compare the q space symmetrization with SymmetrizeFCQ
+    on a dynamical matrix with q points different from Gamma.
+    """
+    np.random.seed(1)
+
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    dyn = CC.Phonons.Phonons(SUPERCELL_DYN_PATH, 3)
+    nq = len(dyn.q_tot)
+    nat = dyn.structure.N_atoms
+    assert nq > 1
+
+    # A random hermitian gradient
+    grad = np.random.normal(size = (nq, 3*nat, 3*nat)) + 1j * np.random.normal(size = (nq, 3*nat, 3*nat))
+    grad += np.conj(np.transpose(grad, (0, 2, 1)))
+
+    # Symmetrize with the Quantum ESPRESSO symmetries (star by star)
+    grad_fcq = grad.copy()
+    qe_sym = CC.symmetries.QE_Symmetry(dyn.structure)
+    qe_sym.SetupQPoint()
+    qe_sym.SymmetrizeFCQ(grad_fcq, dyn.q_stars, asr = "custom")
+
+    # Symmetrize directly in q space (the sum rule is imposed at gamma as in the minimizer)
+    q_symmetries = sscha.SchaMinimizer.GetSpglibQSymmetries(dyn.structure, dyn.q_tot)
+    grad_q = grad.copy()
+    sscha.SchaMinimizer.ApplyQSymmetries(grad_q, q_symmetries)
+    CC.symmetries.CustomASR(grad_q[0, :, :])
+
+    error = np.max(np.abs(grad_q - grad_fcq))
+    if verbose:
+        print("Number of symmetries:", len(q_symmetries["rotations"]), "QE:", qe_sym.QE_nsym)
+        print("Max difference:", error)
+    assert error < 1e-6 * np.max(np.abs(grad_fcq))
+
+
+if __name__ == "__main__":
+    test_qspace_symmetries(verbose = True)
+    test_qspace_symmetries_supercell(verbose = True)
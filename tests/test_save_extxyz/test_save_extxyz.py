@@ -0,0 +1,53 @@
+# -*- coding: utf-8 -*-
+from __future__ import print_function
+from __future__ import division
+
+import sys, os
+import numpy as np
+import cellconstructor as CC
+import cellconstructor.Phonons
+
+import ase, ase.io
+
+import sscha, sscha.Ensemble
+
+
+def test_save_extxyz():
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    DATA_PATH = "../../Examples/ensemble_data_test/"
+
+    dyn = CC.Phonons.Phonons(os.path.join(DATA_PATH, "dyn"))
+    ens = sscha.Ensemble.Ensemble(dyn, 0, dyn.GetSupercell())
+    ens.load(DATA_PATH, 2, 1000)
+
+    mask = np.zeros(ens.N, dtype = bool)
+    mask[:20] = True
+    ens = ens.split(mask)
+
+    # Write the same ensemble with ASE and from the ensemble arrays
+    for fname in ["ase.extxyz", "arrays.extxyz"]:
+        if os.path.exists(fname):
+            os.remove(fname)
+    ens.save_extxyz("ase.extxyz")
+    ens.save_extxyz("arrays.extxyz", use_ase = False)
+
+    ase_structs = ase.io.read("ase.extxyz", index = ":")
+    array_structs = ase.io.read("arrays.extxyz", index = ":")
+
+    assert len(ase_structs) == len(array_structs) == ens.N
+    for s1, s2 in zip(ase_structs, array_structs):
+        assert s1.get_chemical_symbols() == s2.get_chemical_symbols()
+        assert np.allclose(s1.get_positions(), s2.get_positions())
+        assert np.allclose(s1.get_cell()[:, :], s2.get_cell()[:, :])
+        assert np.allclose(s1.get_potential_energy(), s2.get_potential_energy())
+        assert np.allclose(s1.get_forces(), s2.get_forces())
+        assert np.allclose(s1.get_stress(voigt = False), s2.get_stress(voigt = False))
+
+    for fname in ["ase.extxyz", "arrays.extxyz"]:
+        os.remove(fname)
+
+
+if __name__ == "__main__":
+    test_save_extxyz()
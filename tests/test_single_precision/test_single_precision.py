@@ -0,0 +1,55 @@
+from __future__ import print_function
+import sscha, sscha.Ensemble
+import cellconstructor as CC
+import cellconstructor.Phonons
+
+import numpy as np
+
+import pytest
+import sys, os
+
+DATA_DIR = "../../Examples/ensemble_data_test"
+N_CONFIGS = 1000
+__EPS__ = 1e-5
+
+def test_single_precision(verbose = False):
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    dyn = CC.Phonons.Phonons("{}/dyn".format(DATA_DIR))
+    dyn_end = CC.Phonons.Phonons("{}/dyn1_population2".format(DATA_DIR), full_name = True)
+
+    ens_double = sscha.Ensemble.Ensemble(dyn, 0, (1,1,1))
+    ens_double.load(DATA_DIR, 2, N_CONFIGS)
+
+    ens_single = sscha.Ensemble.Ensemble(dyn, 0, (1,1,1), single_precision = True)
+    ens_single.load(DATA_DIR, 2, N_CONFIGS)
+
+    # The per-configuration arrays must be stored in single precision
+    for name in ["xats", "u_disps", "u_disps_original", "forces", "sscha_forces"]:
+        assert getattr(ens_single, name).dtype == np.float32, name
+        assert getattr(ens_double, name).dtype == np.float64, name
+
+    for ens in [ens_double, ens_single]:
+        ens.update_weights(dyn_end, 0)
+
+    # The averages are accumulated in double precision
+    grad_double = ens_double.get_preconditioned_gradient()
+    grad_single = ens_single.get_preconditioned_gradient()
+    assert grad_single.dtype == np.float64
+
+    error = np.max(np.abs(grad_double - grad_single)) / np.max(np.abs(grad_double))
+    if verbose:
+        print("Relative error on the gradient:", error)
+    assert error < __EPS__
+
+    delta_w = np.abs(ens_double.rho - ens_single.rho)
+    assert np.max(delta_w) < __EPS__
+
+    # Going back to double precision
+    ens_single.single_precision = False
+    assert ens_single.forces.dtype == np.float64
+
+
+if __name__ == "__main__":
+    test_single_precision(verbose = True)
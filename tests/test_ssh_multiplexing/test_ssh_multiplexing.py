@@ -0,0 +1,114 @@
+# -*- coding: utf-8 -*-
+from __future__ import print_function
+from __future__ import division
+
+import sys, os
+import shutil
+
+import sscha, sscha.Cluster
+import sscha.LocalCluster
+
+"""
+This test checks that all the ssh and scp commands share the persistent connection,
+and that the inputs of a batch are sent with one scp and one ssh command.
+The ssh and scp commands are local scripts that log their arguments
+and execute the commands on the local machine.
+"""
+
+CALLS_FILE = "fake_calls.txt"
+FAKE_SSH = "fake_ssh.sh"
+FAKE_SCP = "fake_scp.sh"
+CONTROL_PATH = "/tmp/sscha_test_%C"
+
+def test_ssh_multiplexing(verbose = False):
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    # ssh [-o option]... host 'command'
+    with open(FAKE_SSH, "w") as fp:
+        fp.write('echo "ssh $@" >> {}\n'.format(CALLS_FILE))
+        fp.write('while [ "$1" = "-o" ]; do shift 2; done\n')
+        fp.write('if [ "$1" = "-O" ]; then exit 0; fi\n')
+        fp.write('shift\nbash -c "$*"\n')
+
+    # scp [-o option]... [host:]source [host:]destination
+    with open(FAKE_SCP, "w") as fp:
+        fp.write('echo "scp $@" >> {}\n'.format(CALLS_FILE))
+        fp.write('while [ "$1" = "-o" ]; do shift 2; done\n')
+        fp.write('cp -r "${1#*:}" "${2#*:}"\n')
+
+    local_workdir = os.path.join(total_path, "local")
+    workdir = os.path.join(total_path, "remote")
+    for dirname in [local_workdir, workdir]:
+        if os.path.exists(dirname):
+            shutil.rmtree(dirname)
+        os.makedirs(dirname)
+    if os.path.exists(CALLS_FILE):
+        os.remove(CALLS_FILE)
+
+    cluster = sscha.Cluster.Cluster("fakehost")
+    cluster.sshcmd = "bash {}".format(os.path.join(total_path, FAKE_SSH))
+    cluster.scpcmd = "bash {}".format(os.path.join(total_path, FAKE_SCP))
+    cluster.use_ssh_multiplexing = True
+    cluster.ssh_control_path = CONTROL_PATH
+    cluster.workdir = workdir
+    cluster.local_workdir = local_workdir
+
+    assert cluster.open_connection()
+
+    # The inputs of a batch (the outputs of a previous run must be cleaned)
+    inputs = ["ESP_{}.pwi".format(i) for i in range(3)]
+    outputs = ["ESP_{}.pwo".format(i) for i in range(3)]
+    for fname in inputs:
+        with open(os.path.join(local_workdir, fname), "w") as fp:
+            fp.write(fname)
+    for fname in outputs:
+        with open(os.path.join(workdir, fname), "w") as fp:
+            fp.write("old output")
+
+    with open(CALLS_FILE, "r") as fp:
+        n_open = len(fp.readlines())
+
+    assert cluster.copy_files(inputs, outputs, True)
+    for fname in inputs:
+        assert os.path.exists(os.path.join(workdir, fname))
+    for fname in outputs:
+        assert not os.path.exists(os.path.join(workdir, fname))
+
+    assert cluster.close_connection()
+
+    with open(CALLS_FILE, "r") as fp:
+        calls = [x.strip() for x in fp.readlines()]
+
+    if verbose:
+        print("\n".join(calls))
+
+    # All the commands share the same connection
+    options = "-o ControlMaster=auto -o ControlPath={} -o ControlPersist={:d}".format(CONTROL_PATH, cluster.ssh_persist)
+    for call in calls:
+        assert options in call, call
+
+    # One command opens the connection, one closes it
+    assert n_open == 1
+    assert calls[-1].startswith("ssh") and "-O exit" in calls[-1]
+
+    # The batch is copied with one scp and unpacked with one ssh,
+    # that also cleans the old outputs
+    batch = calls[n_open : -1]
+    assert len(batch) == 2
+    assert batch[0].startswith("scp")
+    assert batch[1].startswith("ssh")
+    assert "rm -f" in batch[1] and "tar xf" in batch[1]
+
+    # The local cluster does not use ssh
+    local = sscha.LocalCluster.LocalCluster("localhost")
+    assert local.get_ssh_options() == ""
+
+    for fname in [FAKE_SSH, FAKE_SCP, CALLS_FILE]:
+        os.remove(fname)
+    for dirname in [local_workdir, workdir]:
+        shutil.rmtree(dirname)
+
+
+if __name__ == "__main__":
+    test_ssh_multiplexing(True)
@@ -0,0 +1,177 @@
+# -*- coding: utf-8 -*-
+from __future__ import print_function
+from __future__ import division
+
+import sys, os
+import shutil
+import time
+import threading
+import numpy as np
+
+import sscha, sscha.Cluster
+import sscha.LocalCluster
+
+"""
+This test checks the streaming of the results (stream_results) on a local cluster:
+the outputs of the calculations are retrieved as soon as they are marked as done,
+while the job is still running, and only the remaining outputs are copied at the end.
+The scheduler is a local script that runs the submission script in the background
+and keeps the id of the job in a queue file until the end.
+"""
+
+N_ATOMS = 2
+N_CONFIGS = 3
+SLOW_LABEL = "ESP_2"
+FAKE_SBATCH = "fake_sbatch.sh"
+FAKE_PW = "fake_pw.sh"
+QUEUE_FILE = "fake_queue.txt"
+RELEASE_FILE = "release"
+
+
+class FakeCalculator(object):
+    def copy(self):
+        return FakeCalculator()
+
+
+class FakeStructure(object):
+    def __init__(self, coords):
+        self.coords = coords
+
+    def copy(self):
+        return FakeStructure(self.coords.copy())
+
+
+class FakeEnsemble(object):
+    """
+    The attributes of the ensemble filled by compute_ensemble_batch
+    """
+    def __init__(self, N):
+        self.N = N
+        self.structures = [FakeStructure(np.random.uniform(size = (N_ATOMS, 3))) for i in range(N)]
+        self.energies = np.zeros(N)
+        self.forces = np.zeros((N, N_ATOMS, 3))
+        self.stresses = np.zeros((N, 3, 3))
+        self.all_properties = [{} for i in range(N)]
+        self.has_stress = False
+        self.force_computed = np.zeros(N, dtype = bool)
+        self.stress_computed = np.zeros(N, dtype = bool)
+
+
+class StreamCluster(sscha.LocalCluster.LocalCluster):
+    """
+    The input of each calculation contains its energy [eV], the fake binary copies it in the output.
+    The copies of the outputs from the cluster are recorded.
+    """
+    def __init__(self, ensemble):
+        super(StreamCluster, self).__init__("localhost")
+        self.__dict__["ensemble"] = ensemble
+        self.__dict__["retrieved_outputs"] = []
+
+    def prepare_input_file(self, structures, calc, labels):
+        for label in labels:
+            with open(os.path.join(self.local_workdir, label + ".pwi"), "w") as fp:
+                fp.write("{}\n".format(get_energy(label)))
+        return [x + ".pwi" for x in labels], [x + ".pwo" for x in labels]
+
+    def read_results(self, calc, label):
+        with open(os.path.join(self.local_workdir, label + ".pwo"), "r") as fp:
+            energy = float(fp.read())
+        return {"energy" : energy, "forces" : np.full((N_ATOMS, 3), energy),
+                "structure" : self.ensemble.structures[int(label.split("_")[-1])]}
+
+    def copy_files(self, list_of_input, list_of_output, to_server):
+        if not to_server:
+            self.retrieved_outputs.append(list(list_of_output))
+        return super(StreamCluster, self).copy_files(list_of_input, list_of_output, to_server)
+
+
+def get_energy(label):
+    return 1.0 + int(label.split("_")[-1])
+
+
+def test_stream_results(verbose = False):
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+    np.random.seed(0)
+
+    local_workdir = os.path.join(total_path, "local")
+    workdir = os.path.join(total_path, "remote")
+    queue_file = os.path.join(total_path, QUEUE_FILE)
+    for dirname in [local_workdir, workdir]:
+        if os.path.exists(dirname):
+            shutil.rmtree(dirname)
+        os.makedirs(dirname)
+    with open(queue_file, "w") as fp:
+        pass
+
+    # The job is in the queue until the submission script ends
+    with open(FAKE_SBATCH, "w") as fp:
+        fp.write('JOB=$$\n')
+        fp.write('echo $JOB >> {}\n'.format(queue_file))
+        fp.write('( bash $1; sed -i "/^$JOB\\$/d" {} ) > /dev/null 2>&1 &\n'.format(queue_file))
+        fp.write('echo "Submitted batch job $JOB"\n')
+
+    # The slow calculation waits for the release file (in the working directory)
+    with open(FAKE_PW, "w") as fp:
+        fp.write('if [ "$1" = "{}" ]; then\n'.format(SLOW_LABEL))
+        fp.write('    for i in $(seq 600); do [ -e {} ] && break; sleep 0.05; done\n'.format(RELEASE_FILE))
+        fp.write('fi\ncp $1.pwi $1.pwo\n')
+
+    ensemble = FakeEnsemble(N_CONFIGS)
+    cluster = StreamCluster(ensemble)
+    cluster.workdir = workdir
+    cluster.local_workdir = local_workdir
+    cluster.submit_command = "bash {}".format(os.path.join(total_path, FAKE_SBATCH))
+    cluster.job_status_cmd = "echo JOBID; cat {}".format(queue_file)
+    cluster.binary = "bash {} PREFIX".format(os.path.join(total_path, FAKE_PW))
+    cluster.mpi_cmd = ""
+    cluster.check_timeout = 0.1
+    cluster.job_number = N_CONFIGS
+    cluster.batch_size = 1
+    cluster.stream_results = True
+
+    thread = threading.Thread(target = cluster.compute_ensemble_batch, args = (ensemble, FakeCalculator()),
+                              kwargs = {"get_stress" : False})
+    thread.start()
+
+    # The finished calculations are added to the ensemble while the job is running
+    t_start = time.time()
+    while not np.all(ensemble.force_computed[:2]) and time.time() - t_start < 30:
+        time.sleep(0.05)
+    computed_early = ensemble.force_computed.copy()
+    with open(queue_file, "r") as fp:
+        job_running = len(fp.read().strip()) > 0
+    outputs_early = [list(x) for x in cluster.retrieved_outputs]
+
+    with open(os.path.join(workdir, RELEASE_FILE), "w") as fp:
+        pass
+    thread.join()
+
+    if verbose:
+        print("Computed while the job was running: {}".format(computed_early))
+        print("Outputs copied at the end of the job: {}".format(cluster.retrieved_outputs))
+
+    assert job_running
+    assert np.all(computed_early[:2])
+    assert not computed_early[2]
+    assert len(outputs_early) == 0
+
+    # All the calculations are marked as done
+    for i in range(N_CONFIGS):
+        assert os.path.exists(os.path.join(workdir, "ESP_{}.done".format(i)))
+
+    # Only the output not streamed is copied at the end of the job
+    assert cluster.retrieved_outputs == [[SLOW_LABEL + ".pwo"]]
+
+    assert np.all(ensemble.force_computed)
+    expected = np.array([get_energy("ESP_{}".format(i)) for i in range(N_CONFIGS)]) / sscha.Cluster.units["Ry"]
+    assert np.max(np.abs(ensemble.energies - expected)) < 1e-12
+
+    for fname in [FAKE_SBATCH, FAKE_PW, QUEUE_FILE]:
+        os.remove(fname)
+    for dirname in [local_workdir, workdir]:
+        shutil.rmtree(dirname)
+
+
+if __name__ == "__main__":
+    test_stream_results(True)
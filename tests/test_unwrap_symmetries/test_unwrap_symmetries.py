@@ -0,0 +1,59 @@
+from __future__ import print_function
+import cellconstructor as CC
+import cellconstructor.Phonons
+import cellconstructor.symmetries
+
+import numpy as np
+import pytest
+
+import sscha, sscha.Ensemble
+import sys, os
+
+ENS_DIR = "../../Examples/ensemble_data_test"
+N_RANDOM = 2
+T = 0
+__EPS__ = 1e-8
+
+def test_unwrap_symmetries():
+    spglib = pytest.importorskip("spglib")
+    np.random.seed(0)
+
+    total_path = os.path.dirname(os.path.abspath(__file__))
+    os.chdir(total_path)
+
+    dyn = CC.Phonons.Phonons(os.path.join(ENS_DIR, "dyn"))
+    ens = sscha.Ensemble.Ensemble(dyn, T)
+    ens.generate(N_RANDOM)
+
+    # Fake some forces
+    ens.forces[:,:,:] = np.random.normal(size = ens.forces.shape)
+    ens.force_computed[:] = True
+
+    ens._unwrap_symmetries_()
+    rotations, irts = ens.symmetry_kernel
+    n_syms, nat_sc = irts.shape
+
+    # The ensemble is not replicated
+    assert ens.N == N_RANDOM
+
+    # Compare with the explicit unwrapping of the forces
+    super_structure = ens.current_dyn.structure.generate_supercell(ens.supercell)
+    cc_syms = CC.symmetries.GetSymmetriesFromSPGLIB(spglib.get_symmetry(super_structure.get_ase_atoms()), False)
+    f_explicit = np.zeros((N_RANDOM, nat_sc, 3), dtype = np.double)
+    for x in range(N_RANDOM):
+        for i in range(n_syms):
+            f_explicit[x, :, :] += CC.symmetries.ApplySymmetryToVector(cc_syms[i], ens.forces[x, :, :],
+                                                                        super_structure.unit_cell, irts[i, :])
+    f_explicit /= n_syms
+
+    f_implicit = ens.apply_symmetry_kernel(ens.forces)
+    assert np.max(np.abs(f_implicit - f_explicit)) < __EPS__
+
+    # A symmetrized tensor must be invariant
+    phi = np.random.normal(size = (3*nat_sc, 3*nat_sc))
+    phi_sym = ens.apply_symmetry_kernel(phi)
+    assert np.max(np.abs(ens.apply_symmetry_kernel(phi_sym) - phi_sym)) < __EPS__
+
+
+if __name__ == "__main__":
+    test_unwrap_symmetries()